@@ -0,0 +1,182 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+// Compares hash_string() with the FNV-1a it replaced: how long each takes
+// on strings of growing length, and how evenly each spreads a few kinds of
+// keys interpreters see a lot of. Build it with make bench.
+
+static uint32_t fnv1a(const char* key, int len) {
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < len; i++) {
+    hash ^= key[i];
+    hash *= 16777619;
+  }
+
+  return hash;
+}
+
+typedef uint32_t (*hasher)(const char*, int);
+
+static const char* names[] = {"fnv1a", "hash_string"};
+static const hasher hashers[] = {fnv1a, hash_string};
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Keeps the compiler from dropping hashes nobody looks at.
+static volatile uint32_t sink;
+
+static void speed(void) {
+  static const int lengths[] = {3, 8, 16, 32, 64, 128, 256, 1024, 4096, 65536};
+  int count = sizeof(lengths) / sizeof(lengths[0]);
+  int max = lengths[count - 1];
+
+  char* buf = malloc(max);
+  for (int i = 0; i < max; i++) buf[i] = (char)('a' + i * 7 % 26);
+
+  printf("speed, ns per hash (GB/s):\n%8s", "length");
+  for (int h = 0; h < 2; h++) printf(" %22s", names[h]);
+  putchar('\n');
+
+  for (int l = 0; l < count; l++) {
+    int len = lengths[l];
+    long reps = 64L * 1024 * 1024 / (len + 16);
+    printf("%8d", len);
+
+    for (int h = 0; h < 2; h++) {
+      uint32_t acc = 0;
+      double start = now();
+      // Feeding the last hash into the next start keeps calls from
+      // overlapping, which is what an interning lookup sees.
+      for (long r = 0; r < reps; r++) acc += hashers[h](buf + (acc & 7), len - 8 > 0 ? len - 8 : len);
+      double ns = (now() - start) * 1e9 / reps;
+      sink = acc;
+      printf(" %12.2f (%7.2f)", ns, len / ns);
+    }
+    putchar('\n');
+  }
+  free(buf);
+}
+
+#define KEYS 200000
+#define BUCKET_BITS 12
+#define BUCKETS (1 << BUCKET_BITS)
+
+typedef void (*key_maker)(int, char*, int*);
+
+static void identifiers(int i, char* buf, int* len) {
+  *len = sprintf(buf, "v%d", i);
+}
+
+static void numbers(int i, char* buf, int* len) {
+  *len = sprintf(buf, "%d", i * 10);
+}
+
+static void two_chars(int i, char* buf, int* len) {
+  buf[0] = (char)(i & 0xff);
+  buf[1] = (char)(i >> 8 & 0xff);
+  buf[2] = (char)(i >> 16);
+  *len = 3;
+}
+
+// Long strings built by concatenation differ only towards the end.
+static void long_suffix(int i, char* buf, int* len) {
+  memset(buf, 'x', 300);
+  *len = 300 + sprintf(buf + 300, "%d", i);
+}
+
+static const char* key_names[] = {"v<i>", "<i*10>", "3 bytes", "300 x + <i>"};
+static const key_maker makers[] = {identifiers, numbers, two_chars, long_suffix};
+
+static int compare_hashes(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Chi-squared of keys over buckets picked by bits shift and up, as tables
+// pick groups, normalized so that 1 is what a random function scores.
+static double spread(uint32_t* hashes, int shift) {
+  static int buckets[BUCKETS];
+  memset(buckets, 0, sizeof(buckets));
+  for (int i = 0; i < KEYS; i++) buckets[hashes[i] >> shift & (BUCKETS - 1)]++;
+
+  double expected = (double)KEYS / BUCKETS, chi = 0;
+  for (int i = 0; i < BUCKETS; i++) chi += (buckets[i] - expected) * (buckets[i] - expected) / expected;
+  return chi / (BUCKETS - 1);
+}
+
+// How many output bits flipping one input bit changes on average, 16 being
+// ideal, and the input bit furthest from that.
+static void avalanche(hasher h, key_maker make, double* mean, double* worst) {
+  char buf[64];
+  int len, bits = 0;
+  double total = 0;
+  *worst = 16;
+
+  for (int bit = 0; bit < 64 * 8; bit++) {
+    double flipped = 0;
+    int samples = 0;
+    // Only keys long enough to have that bit count.
+    for (int k = 0; k < 64; k++) {
+      make(12345 + k * 7919, buf, &len);
+      if (bit >= len * 8) continue;
+      uint32_t base = h(buf, len);
+      buf[bit / 8] ^= (char)(1 << bit % 8);
+      flipped += __builtin_popcount(base ^ h(buf, len));
+      samples++;
+    }
+    if (samples < 32) continue;
+
+    flipped /= samples;
+    total += flipped;
+    bits++;
+    if ((flipped - 16) * (flipped - 16) >= (*worst - 16) * (*worst - 16)) *worst = flipped;
+  }
+  *mean = total / bits;
+}
+
+static void distribution(void) {
+  uint32_t* hashes = malloc(sizeof(uint32_t) * KEYS);
+  char buf[512];
+  int len;
+
+  printf("\ndistribution of %d keys over %d buckets, chi-squared / df (1 is ideal):\n", KEYS, BUCKETS);
+  printf("%12s %12s %8s %8s %10s %14s\n", "keys", "hash", "bits 0+", "bits 7+", "collisions", "avalanche");
+
+  for (int m = 0; m < 4; m++) {
+    for (int h = 0; h < 2; h++) {
+      for (int i = 0; i < KEYS; i++) {
+        makers[m](i, buf, &len);
+        hashes[i] = hashers[h](buf, len);
+      }
+
+      double low = spread(hashes, 0), high = spread(hashes, 7);
+      qsort(hashes, KEYS, sizeof(uint32_t), compare_hashes);
+      int collisions = 0;
+      for (int i = 1; i < KEYS; i++) collisions += hashes[i] == hashes[i-1];
+
+      double mean = 0, worst = 0;
+      if (m != 3) avalanche(hashers[h], makers[m], &mean, &worst);
+      printf("%12s %12s %8.2f %8.2f %10d", key_names[m], names[h], low, high, collisions);
+      if (m != 3) printf("  %5.2f / %5.2f", mean, worst);
+      putchar('\n');
+    }
+  }
+  free(hashes);
+}
+
+int main(void) {
+  speed();
+  distribution();
+  return 0;
+}
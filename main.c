@@ -5,23 +5,84 @@
 #include "src/repl.h"
 #include "src/vm.h"
 
+static void print_heap(vm* cvm) {
+  static const char* names[HEAP_CATEGORIES] = {
+    "strings", "integers", "code", "constants", "tables", "stack", "other"
+  };
+
+  heap_stats h = heap_usage(cvm);
+  fprintf(stderr, "heap: %zu bytes, at most %zu\n", h.current, h.peak);
+  for (int i = 0; i < HEAP_CATEGORIES; i++) {
+    fprintf(stderr, "  %-10s %zu\n", names[i], h.categories[i]);
+  }
+}
+
 int main(int argc, const char** argv) {
   int ret = 0;
   vm* cvm = init_vm();
+  tier t = TIER_STACK;
+  bool emit = false;
+  bool stats = false;
+  const char* name = argv[0];
+  profile prof;
+  const char* pprof = NULL;
 
-  switch (argc) {
-  case 1: repl(cvm); break;
-  case 2: run_file(cvm, argv[1]); break;
+  while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+    if (!strcmp(argv[1], "--registers")) t = TIER_REGISTER;
+    else if (!strcmp(argv[1], "--jit")) t = TIER_JIT;
+    else if (!strcmp(argv[1], "--trace")) t = TIER_TRACE;
+    else if (!strcmp(argv[1], "--emit-c")) emit = true;
+    else if (!strcmp(argv[1], "--optimize")) cvm->optimize = true;
+    else if (!strncmp(argv[1], "--heap-limit=", 13)) cvm->heap.limit = strtoull(argv[1] + 13, NULL, 10);
+    else if (!strcmp(argv[1], "--heap-stats")) stats = true;
+    else if (!strncmp(argv[1], "--alloc-profile", 15) && (!argv[1][15] || argv[1][15] == '=')) {
+      init_profile(&prof);
+      cvm->profile = &prof;
+      cvm->profiler = profile_allocation;
+      if (argv[1][15]) pprof = argv[1] + 16;
+    }
+    else break;
+
+    argc--;
+    argv++;
+  }
+
+  switch (emit ? -argc : argc) {
+  case 1: repl(cvm, t); break;
+  case 2: ret = run_file(cvm, argv[1], t); break;
+  case -2: emit_file(cvm, argv[1]); break;
   default:
-    fprintf(stderr, "Usage: %s [file]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [--optimize] [--registers | --jit | --trace]\n", name);
+    fprintf(stderr, "       %*s [--heap-limit=bytes] [--heap-stats]\n", (int)strlen(name), "");
+    fprintf(stderr, "       %*s [--alloc-profile[=pprof file]] [file]\n", (int)strlen(name), "");
+    fprintf(stderr, "       %s [--optimize] --emit-c file\n", name);
     fputs(
       "  The [file] variable is optional.\n"
       "  Specifying it will result in that file being run, running clox without it will\n"
-      "  start a REPL.\n",
+      "  start a REPL.\n"
+      "  With --registers, scripts run on the register-based instruction set, with\n"
+      "  --jit they are compiled to machine code where the platform allows. --trace\n"
+      "  interprets them, compiling the loops they spend their time in.\n"
+      "  With --emit-c, the script is translated to a C program next to it, to be\n"
+      "  built along with src/value.c, src/obj.c, src/hash.c and src/memory.c.\n"
+      "  --optimize runs the optimizing middle-end over the compiled script first.\n"
+      "  --heap-limit caps what the script may allocate, running out being a\n"
+      "  runtime error, and --heap-stats reports what it did allocate on exit.\n"
+      "  --alloc-profile reports on exit how much each source line allocated, and\n"
+      "  with a file name writes the same to that file for pprof.\n",
       stderr);
     ret = 1;;
   }
 
+  if (stats) print_heap(cvm);
+  if (cvm->profile) {
+    print_profile(&prof, stderr);
+    if (pprof && !write_pprof(&prof, argc == 2 ? argv[1] : "repl", pprof)) {
+      fprintf(stderr, "Could not write \"%s\".\n", pprof);
+      ret = 74;
+    }
+    free_profile(&prof);
+  }
   free_vm(cvm);
 
   return ret;
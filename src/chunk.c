@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "common.h"
@@ -12,54 +13,79 @@ void init_chunk(chunk* c) {
   c->lines_count = 0;
   c->lines_capacity = 0;
   init_value_array(&c->constants);
+  c->global_names = NULL;
+  c->cells = NULL;
+  c->cell_offsets = NULL;
+  c->cell_count = 0;
+  c->arena = NULL;
 }
 
-void encode_line(chunk* c, int line) {
-  if (c->lines && c->lines[c->lines_count-1] == line) {
+// A chunk with an arena keeps its arrays there, and leaves freeing them to
+// whoever frees the arena. Should the arena run out, the chunk is left as it
+// was, missing what did not fit, and the arena records the failure.
+static void* grow(chunk* c, heap_category category, void* previous, size_t olds, size_t news) {
+  if (c->arena) return arena_grow(c->arena, category, previous, olds, news);
+  return reallocate_as(category, previous, olds, news);
+}
+
+static void release(chunk* c, heap_category category, void* p, size_t size) {
+  if (!c->arena) reallocate_as(category, p, size, 0);
+}
+
+bool encode_line(chunk* c, int line) {
+  if (c->lines_count && c->lines[c->lines_count-1] == line) {
     c->lines[c->lines_count-2] += 1;
-    return;
+    return true;
   }
 
-  if (c->lines_capacity < c->lines_count + 1) {
+  if (c->lines_capacity < c->lines_count + 2) {
     int oldc = c->lines_capacity;
-    c->lines_capacity = GROW_CAPACITY(c->lines_capacity);
-    c->lines = GROW_ARRAY(c->lines, int, oldc, c->lines_capacity);
+    int* lines = (int*)grow(c, HEAP_CODE, c->lines, sizeof(int) * oldc, sizeof(int) * GROW_CAPACITY(oldc));
+    if (!lines) return false;
+    c->lines = lines;
+    c->lines_capacity = GROW_CAPACITY(oldc);
   }
   c->lines[c->lines_count] = 1;
   c->lines[c->lines_count+1] = line;
   c->lines_count += 2;
+  return true;
+}
+
+// Makes room for n more bytes of code.
+static bool reserve_code(chunk* c, int n) {
+  if (c->capacity >= c->count + n) return true;
+
+  int oldc = c->capacity;
+  uint8_t* code = (uint8_t*)grow(c, HEAP_CODE, c->code, oldc, GROW_CAPACITY(oldc));
+  if (!code) return false;
+  c->code = code;
+  c->capacity = GROW_CAPACITY(oldc);
+  return true;
 }
 
 void write_chunk(chunk* c, uint8_t byte, int line) {
-  if (c->capacity < c->count + 1) {
-    int oldc = c->capacity;
-    c->capacity = GROW_CAPACITY(oldc);
-    c->code = GROW_ARRAY(c->code, uint8_t, oldc, c->capacity);
-  }
+  if (!reserve_code(c, 1)) return;
 
   c->code[c->count] = byte;
-  encode_line(c, line);
+  if (!encode_line(c, line)) return;
   c->count++;
 }
 
+// Only the first byte can need a new line entry, so only its encoding can
+// fail.
 void write_constant(chunk* c, value v, int line) {
   int offs = add_constant(c, v);
-
-  if (c->capacity < c->count + 4) {
-    int oldc = c->capacity;
-    c->capacity = GROW_CAPACITY(oldc);
-    c->code = GROW_ARRAY(c->code, uint8_t, oldc, c->capacity);
-  }
+  if (offs == -1 || !reserve_code(c, 4)) return;
 
   if (offs < 256) {
     c->code[c->count] = OP_CONSTANT;
-    encode_line(c, line);
+    if (!encode_line(c, line)) return;
     c->code[c->count+1] = offs;
     encode_line(c, line);
     c->count += 2;
   } else {
     c->code[c->count] = OP_CONSTANT_LONG;
-    encode_line(c, line);
+    if (!encode_line(c, line)) return;
     c->code[c->count+1] = offs & 0xff;
     encode_line(c, line);
     c->code[c->count+2] = (offs & 0xff00) >> 8;
@@ -70,14 +96,330 @@ void write_constant(chunk* c, value v, int line) {
   }
 }
 
+void truncate_chunk(chunk* c, int count) {
+  while (c->count > count) {
+    c->count--;
+    if (!--c->lines[c->lines_count-2]) c->lines_count -= 2;
+  }
+}
+
+void cut_chunk(chunk* c, int start, snippet* s) {
+  s->count = c->count - start;
+  s->code = (uint8_t*)grow(c, HEAP_CODE, NULL, 0, s->count);
+  s->lines = (int*)grow(c, HEAP_CODE, NULL, 0, sizeof(int) * s->count);
+  if (s->count && (!s->code || !s->lines)) {
+    release(c, HEAP_CODE, s->code, s->count);
+    release(c, HEAP_CODE, s->lines, sizeof(int) * s->count);
+    s->code = NULL;
+    s->lines = NULL;
+    s->count = 0;
+    return;
+  }
+
+  for (int i = s->count - 1; i >= 0; i--) {
+    s->code[i] = c->code[c->count-1];
+    s->lines[i] = c->lines[c->lines_count-1];
+    truncate_chunk(c, c->count-1);
+  }
+}
+
+void paste_chunk(chunk* c, snippet* s) {
+  for (int i = 0; i < s->count; i++) write_chunk(c, s->code[i], s->lines[i]);
+
+  release(c, HEAP_CODE, s->code, s->count);
+  release(c, HEAP_CODE, s->lines, sizeof(int) * s->count);
+}
+
 void free_chunk(chunk* c) {
-  FREE_ARRAY(uint8_t, c->code, c->capacity);
-  FREE_ARRAY(int, c->lines, c->capacity);
-  free_value_array(&c->constants);
+  release(c, HEAP_CODE, c->code, c->capacity);
+  release(c, HEAP_CODE, c->lines, sizeof(int) * c->lines_capacity);
+  release(c, HEAP_CONSTANTS, c->constants.values, sizeof(value) * c->constants.capacity);
+  release(c, HEAP_CODE, c->cells, sizeof(cell) * c->cell_count);
+  release(c, HEAP_CODE, c->cell_offsets, sizeof(int) * c->cell_count);
   init_chunk(c);
 }
 
-int add_constant(chunk* c, value value) {
-  write_value_array(&c->constants, value);
-  return c->constants.count - 1;
+// Gives c the code and lines of with, which was built from the same arena,
+// and frees what is left of with.
+void replace_code(chunk* c, chunk* with) {
+  release(c, HEAP_CODE, c->code, c->capacity);
+  release(c, HEAP_CODE, c->lines, sizeof(int) * c->lines_capacity);
+  c->code = with->code;
+  c->count = with->count;
+  c->capacity = with->capacity;
+  c->lines = with->lines;
+  c->lines_count = with->lines_count;
+  c->lines_capacity = with->lines_capacity;
+
+  with->code = NULL;
+  with->lines = NULL;
+  with->capacity = with->lines_capacity = 0;
+  free_chunk(with);
+}
+
+// Moves the finished constants, lines and code next to each other, in that
+// order, into one block of the arena.
+void compact_chunk(chunk* c) {
+  if (!c->arena) return;
+
+  size_t constants = sizeof(value) * c->constants.count;
+  size_t lines = sizeof(int) * c->lines_count;
+  if (!arena_reserve(c->arena, constants + lines + c->count)) return;
+  value* values = (value*)arena_allocate(c->arena, HEAP_CONSTANTS, constants);
+  char* block = (char*)arena_allocate(c->arena, HEAP_CODE, lines + c->count);
+  if (constants) memcpy(values, c->constants.values, constants);
+  memcpy(block, c->lines, lines);
+  memcpy(block + lines, c->code, c->count);
+
+  c->constants.values = values;
+  c->constants.capacity = c->constants.count;
+  c->lines = (int*)block;
+  c->lines_capacity = c->lines_count;
+  c->code = (uint8_t*)(block + lines);
+  c->capacity = c->count;
+}
+
+// Returns the index of v, or -1 if there is no room for it.
+int add_constant(chunk* c, value v) {
+  value_array* a = &c->constants;
+  if (a->capacity < a->count + 1) {
+    int oldc = a->capacity;
+    value* values = (value*)grow(c, HEAP_CONSTANTS, a->values, sizeof(value) * oldc, sizeof(value) * GROW_CAPACITY(oldc));
+    if (!values) return -1;
+    a->values = values;
+    a->capacity = GROW_CAPACITY(oldc);
+  }
+
+  a->values[a->count] = v;
+  return a->count++;
+}
+
+int instruction_length(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT_LONG:
+      return 4;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_LOOP:
+    case OP_LOOP_IF_TRUE:
+    case OP_LOOP_IF_EQUAL:
+    case OP_LOOP_IF_NOT_EQUAL:
+    case OP_LOOP_IF_GREATER:
+    case OP_LOOP_IF_NOT_GREATER:
+    case OP_LOOP_IF_LESS:
+    case OP_LOOP_IF_NOT_LESS:
+    case OP_GET_LOCALS:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+      return 3;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      return 2;
+    default:
+      return 1;
+  }
+}
+
+static bool jumps_back(uint8_t op) {
+  return op >= OP_LOOP && op <= OP_LOOP_IF_NOT_LESS;
+}
+
+// Returns the offset the jump at offs lands on, or -1 if it is no jump.
+int jump_target(chunk* c, int offs) {
+  int jump = instruction_length(c->code[offs]) == 3 ?
+               (c->code[offs+1] << 8) | c->code[offs+2] : 0;
+
+  if (jumps_back(c->code[offs])) return offs+3-jump;
+
+  switch (c->code[offs]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+      return offs+3+jump;
+    default:
+      return -1;
+  }
+}
+
+void set_jump_target(chunk* c, int offs, int target) {
+  int jump = jumps_back(c->code[offs]) ? offs+3-target : target-offs-3;
+  c->code[offs+1] = (jump >> 8) & 0xff;
+  c->code[offs+2] = jump & 0xff;
+}
+
+// How the instruction changes the height of the stack.
+int stack_effect(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+      return 1;
+    case OP_GET_LOCALS:
+      return 2;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_NEGATE:
+    case OP_NEGATE_NUMERIC:
+    case OP_NEGATE_DOUBLE:
+    case OP_NOT:
+    case OP_BITNOT:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    case OP_RETURN:
+      return 0;
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_LOOP_IF_EQUAL:
+    case OP_LOOP_IF_NOT_EQUAL:
+    case OP_LOOP_IF_GREATER:
+    case OP_LOOP_IF_NOT_GREATER:
+    case OP_LOOP_IF_LESS:
+    case OP_LOOP_IF_NOT_LESS:
+      return -2;
+    default:
+      return -1;
+  }
+}
+
+bool falls_through(uint8_t op) {
+  return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+}
+
+// Works out the height of the stack before every instruction, -1 where the
+// code is never reached. Returns the greatest height.
+int stack_heights(chunk* c, int* heights) {
+  int* work = ALLOCATE(int, c->count);
+  int n = 0;
+  int max = 0;
+
+  for (int i = 0; i < c->count; i++) heights[i] = -1;
+  heights[0] = 0;
+  work[n++] = 0;
+
+  while (n) {
+    int offs = work[--n];
+    uint8_t op = c->code[offs];
+    int height = heights[offs] + stack_effect(op);
+    int next[2] = { falls_through(op) ? offs + instruction_length(op) : -1,
+                    jump_target(c, offs) };
+
+    if (height > max) max = height;
+
+    for (int i = 0; i < 2; i++) {
+      if (next[i] == -1 || next[i] >= c->count || heights[next[i]] != -1) continue;
+      heights[next[i]] = height;
+      work[n++] = next[i];
+    }
+  }
+
+  FREE_ARRAY(int, work, c->count);
+  return max;
+}
+
+// Superinstructions that carry more operands than fit into one cell spill
+// the rest into the cell that follows.
+int cell_length(uint8_t op) {
+  return op == OP_ADD_LOCAL_CONSTANT ? 2 : 1;
+}
+
+// Translates the finished bytecode into one cell per instruction, holding
+// the handler to dispatch to and the already decoded operand. The bytes stay
+// around for disassembly; cell_offsets maps every cell back to them. Fails
+// if there is no room for the cells.
+bool thread_chunk(chunk* c, const handler* handlers, value* globals) {
+  int* index = ALLOCATE(int, c->count+1);
+  int n = 0;
+  if (!index) return false;
+
+  for (int offs = 0; offs < c->count; offs += instruction_length(c->code[offs])) {
+    index[offs] = n;
+    n += cell_length(c->code[offs]);
+  }
+  index[c->count] = n;
+
+  c->cells = (cell*)grow(c, HEAP_CODE, NULL, 0, sizeof(cell) * n);
+  c->cell_offsets = (int*)grow(c, HEAP_CODE, NULL, 0, sizeof(int) * n);
+  c->cell_count = n;
+  if (!c->cells || !c->cell_offsets) {
+    release(c, HEAP_CODE, c->cells, sizeof(cell) * n);
+    release(c, HEAP_CODE, c->cell_offsets, sizeof(int) * n);
+    c->cells = NULL;
+    c->cell_offsets = NULL;
+    c->cell_count = 0;
+    FREE_ARRAY(int, index, c->count+1);
+    return false;
+  }
+
+  for (int offs = 0; offs < c->count; offs += instruction_length(c->code[offs])) {
+    uint8_t op = c->code[offs];
+    cell* cur = c->cells+index[offs];
+    uint8_t* operand = c->code+offs+1;
+
+    cur->h = handlers[op];
+    for (int i = 0; i < cell_length(op); i++) c->cell_offsets[index[offs]+i] = offs;
+
+    switch (op) {
+      case OP_CONSTANT:
+        cur->as.v = c->constants.values[operand[0]];
+        break;
+      case OP_CONSTANT_LONG:
+        cur->as.v = c->constants.values[operand[0] | (operand[1] << 8) | (operand[2] << 16)];
+        break;
+      case OP_GET_GLOBAL:
+      case OP_DEFINE_GLOBAL:
+      case OP_SET_GLOBAL:
+      case OP_SET_GLOBAL_POP:
+        cur->as.global = globals + ((operand[0] << 8) | operand[1]);
+        break;
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+      case OP_SET_LOCAL_POP:
+        cur->as.slot = operand[0];
+        break;
+      case OP_GET_LOCALS:
+        cur->as.slots[0] = operand[0];
+        cur->as.slots[1] = operand[1];
+        break;
+      case OP_ADD_LOCAL_CONSTANT:
+        cur->as.slot = operand[0];
+        cur[1].as.v = c->constants.values[operand[1]];
+        break;
+      default: {
+        int target = jump_target(c, offs);
+        if (target != -1) cur->as.target = c->cells+index[target];
+        break;
+      }
+    }
+  }
+
+  FREE_ARRAY(int, index, c->count+1);
+  return true;
 }
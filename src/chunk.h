@@ -2,8 +2,34 @@
 #define clox_chunk_h
 
 #include "common.h"
+#include "memory.h"
 #include "value.h"
 
+#ifdef COMPUTED_GOTO
+typedef const void* handler;
+#else
+typedef uint8_t handler;
+#endif
+
+typedef struct cell {
+  handler h;
+  union {
+    value v;
+    struct cell* target;
+    value* global;
+    uint8_t slot;
+    uint8_t slots[2];
+  } as;
+} cell;
+
+// Code taken out of a chunk by cut_chunk, to be written back further down
+// with paste_chunk.
+typedef struct {
+  int count;
+  uint8_t* code;
+  int* lines;
+} snippet;
+
 typedef struct {
   int count;
   int capacity;
@@ -12,12 +38,31 @@ typedef struct {
   int lines_capacity;
   int lines_count;
   value_array constants;
+  value_array* global_names;
+  cell* cells;
+  int* cell_offsets;
+  int cell_count;
+  // Where the arrays above come from while compiling, if not the heap.
+  arena* arena;
 } chunk;
 
 void init_chunk(chunk*);
 void write_chunk(chunk*, uint8_t byte, int line);
 void free_chunk(chunk*);
+void replace_code(chunk*, chunk*);
+void compact_chunk(chunk*);
 int add_constant(chunk* chunk, value value);
 void write_constant(chunk* chunk, value value, int line);
+void truncate_chunk(chunk*, int);
+void cut_chunk(chunk*, int, snippet*);
+void paste_chunk(chunk*, snippet*);
+int instruction_length(uint8_t);
+int jump_target(chunk*, int);
+void set_jump_target(chunk*, int, int);
+int stack_effect(uint8_t);
+bool falls_through(uint8_t);
+int stack_heights(chunk*, int*);
+int cell_length(uint8_t);
+bool thread_chunk(chunk*, const handler*, value*);
 
 #endif
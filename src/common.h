@@ -2,12 +2,46 @@
 #define clox_common_h
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+// DEBUG_STRESS_GC collects garbage before every allocation, DEBUG_LOG_GC
+// reports what every collection frees.
+
+// NAN_BOXING packs every value into one 64-bit word, and the JIT and the
+// tracing tier only know that layout. It gives up nothing: integers too wide
+// for its payload are boxed. Leaving it out brings back the tagged struct.
+#define NAN_BOXING
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// The baseline JIT emits x86-64 code working on NaN-boxed values. Everywhere
+// else it declines, and scripts run on the interpreter.
+#if defined(NAN_BOXING) && defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+#define JIT
+#endif
+
+// Large buffers are mapped from the system directly where that is possible.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(NO_MMAP)
+#define MMAP
+#endif
+
+// Hash tables match a group of control bytes in one go with SSE2.
+#if defined(__SSE2__) && !defined(NO_SSE2)
+#define SSE2
+#endif
+
+// Traces are recorded by threading a handler of their own into cells.
+#if defined(JIT) && defined(COMPUTED_GOTO)
+#define TRACING
+#endif
 
 #define UINT8_COUNT (UINT8_MAX+1)
+#define UINT16_COUNT (UINT16_MAX+1)
 
 typedef enum {
   OP_CONSTANT,
@@ -21,6 +55,10 @@ typedef enum {
   OP_DEFINE_GLOBAL,
   OP_SET_LOCAL,
   OP_SET_GLOBAL,
+  OP_SET_LOCAL_POP,
+  OP_SET_GLOBAL_POP,
+  OP_GET_LOCALS,
+  OP_ADD_LOCAL_CONSTANT,
   OP_ADD,
   OP_SUBTRACT,
   OP_MULTIPLY,
@@ -40,8 +78,52 @@ typedef enum {
   OP_LESS,
   OP_PRINT,
   OP_JUMP_IF_FALSE,
+  OP_POP_JUMP_IF_FALSE,
+  OP_JUMP_IF_EQUAL,
+  OP_JUMP_IF_NOT_EQUAL,
+  OP_JUMP_IF_GREATER,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_LESS,
+  OP_JUMP_IF_NOT_LESS,
   OP_JUMP,
   OP_LOOP,
+  OP_LOOP_IF_TRUE,
+  OP_LOOP_IF_EQUAL,
+  OP_LOOP_IF_NOT_EQUAL,
+  OP_LOOP_IF_GREATER,
+  OP_LOOP_IF_NOT_GREATER,
+  OP_LOOP_IF_LESS,
+  OP_LOOP_IF_NOT_LESS,
+
+  // Unchecked variants the compiler emits for operands it has proven to be
+  // numbers, and doubles in particular.
+  OP_ADD_NUMERIC,
+  OP_SUBTRACT_NUMERIC,
+  OP_MULTIPLY_NUMERIC,
+  OP_DIVIDE_NUMERIC,
+  OP_NEGATE_NUMERIC,
+  OP_GREATER_NUMERIC,
+  OP_LESS_NUMERIC,
+  OP_ADD_DOUBLE,
+  OP_SUBTRACT_DOUBLE,
+  OP_MULTIPLY_DOUBLE,
+  OP_DIVIDE_DOUBLE,
+  OP_NEGATE_DOUBLE,
+  OP_GREATER_DOUBLE,
+  OP_LESS_DOUBLE,
+
+  // Specialized variants that only ever appear in threaded cells, where
+  // run() quickens the generic instruction after seeing its operand types.
+  OP_ADD_NUMBER,
+  OP_ADD_STRING,
+  OP_GREATER_NUMBER,
+  OP_LESS_NUMBER,
+  OP_ADD_INTEGER,
+  OP_GREATER_INTEGER,
+  OP_LESS_INTEGER,
+
+  // Only used by the register tier.
+  OP_MOVE,
 } op_code;
 
 #endif
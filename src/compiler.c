@@ -1,10 +1,14 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "peephole.h"
 #include "scanner.h"
+#include "ssa.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -18,15 +22,33 @@ typedef struct {
   bool panic_mode;
 } parser;
 
+// What the compiler has proven about a value. Later kinds are more precise,
+// so joining two is taking the lesser one.
+typedef enum {
+  TYPE_ANY,
+  TYPE_NUMERIC,  // an integer or a double
+  TYPE_DOUBLE,
+} static_type;
+
 typedef struct {
   token name;
   int depth;
+  static_type type;
 } local;
 
 typedef struct {
   local locals[UINT8_COUNT];
   int localc;
   int scope_depth;
+  int last_label;
+  int cmp_start;
+  int cmp_end;
+  uint8_t cmp_jump;
+  int const_start;
+  int const_end;
+  int const_pool;
+  int type_end;
+  static_type type;
 } compiler;
 
 typedef enum {
@@ -37,7 +59,7 @@ typedef enum {
   PREC_EQUALITY,    // == !=
   PREC_COMPARISON,  // < > <= >=
   PREC_TERM,        // + -
-  PREC_FACTOR,      // * /
+  PREC_FACTOR,      // * / %
   PREC_UNARY,       // ! - +
   PREC_CALL,        // . () []
   PREC_PRIMARY
@@ -130,8 +152,8 @@ static int emit_jump(parser* p, uint8_t inst) {
   return cur_chunk()->count-2;
 }
 
-static void emit_loop(parser* p, int loopstart) {
-  emit_byte(p, OP_LOOP);
+static void emit_loop(parser* p, uint8_t inst, int loopstart) {
+  emit_byte(p, inst);
 
   int offs = cur_chunk()->count - loopstart + 2;
   if (offs > UINT16_MAX) error(p, "Loop body too large.");
@@ -140,17 +162,65 @@ static void emit_loop(parser* p, int loopstart) {
   emit_byte(p, offs & 0xff);
 }
 
-static void patch_jump(parser* p, int offs) {
+static void patch_jump(parser* p, compiler* c, int offs) {
   int jump = cur_chunk()->count-offs-2;
 
   if (jump > UINT16_MAX) error(p, "Too much code to jump over.");
 
   cur_chunk()->code[offs] = (jump >> 8) & 0xff;
   cur_chunk()->code[offs+1] = jump & 0xff;
+  c->last_label = cur_chunk()->count;
+}
+
+// Returns the jump to take when the condition just compiled is false,
+// popping the condition either way. A comparison that directly feeds the jump
+// is dropped and fused with it, so the operands are compared and branched on
+// without ever materializing a boolean.
+static uint8_t condition_jump(compiler* c) {
+  chunk* ch = cur_chunk();
+
+  if (c->cmp_end == ch->count && c->last_label != ch->count) {
+    truncate_chunk(ch, c->cmp_start);
+    return c->cmp_jump;
+  }
+
+  return OP_POP_JUMP_IF_FALSE;
+}
+
+static int emit_condition_jump(parser* p, compiler* c) {
+  return emit_jump(p, condition_jump(c));
+}
+
+// The backward branch taken when the condition holds, for a condition whose
+// forward jump is taken when it does not.
+static uint8_t loop_branch(uint8_t jump) {
+  switch (jump) {
+    case OP_JUMP_IF_EQUAL:       return OP_LOOP_IF_NOT_EQUAL;
+    case OP_JUMP_IF_NOT_EQUAL:   return OP_LOOP_IF_EQUAL;
+    case OP_JUMP_IF_GREATER:     return OP_LOOP_IF_NOT_GREATER;
+    case OP_JUMP_IF_NOT_GREATER: return OP_LOOP_IF_GREATER;
+    case OP_JUMP_IF_LESS:        return OP_LOOP_IF_NOT_LESS;
+    case OP_JUMP_IF_NOT_LESS:    return OP_LOOP_IF_LESS;
+    default:                     return OP_LOOP_IF_TRUE;
+  }
+}
+
+// Takes the code from start on out of the chunk. Whatever the compiler
+// remembers about the code just emitted no longer holds once it is gone.
+static void cut_code(compiler* c, int start, snippet* s) {
+  cut_chunk(cur_chunk(), start, s);
+  c->cmp_end = -1;
+  c->const_end = -1;
+  c->type_end = -1;
 }
 
 static void end_compiler(parser* p) {
   emit_return(p);
+  // Code the arena had no room for is missing. Whoever set the arena up
+  // reports it.
+  if (cur_chunk()->arena && cur_chunk()->arena->failed) p->errored = true;
+  if (!p->errored && p->cvm->optimize) optimize_ssa(cur_chunk());
+  if (!p->errored) peephole_optimize(cur_chunk());
 
 #ifdef DEBUG_PRINT_CODE
   if (!p->errored) disassemble_chunk(cur_chunk(), "code");
@@ -161,8 +231,129 @@ static void emit_constant(parser* p, value v) {
   write_constant(cur_chunk(), v, p->prev.line);
 }
 
-static int make_constant(parser* p, value v) {
-  return add_constant(cur_chunk(), v);
+// Records the type of the expression that ends here.
+static void set_type(compiler* c, static_type type) {
+  c->type = type;
+  c->type_end = cur_chunk()->count;
+}
+
+// Emits a value known at compile time and records where it lives, so that an
+// operator applied to it can be folded away again.
+static void emit_literal(parser* p, compiler* c, value v) {
+  chunk* ch = cur_chunk();
+  c->const_start = ch->count;
+  c->const_pool = ch->constants.count;
+
+  if (IS_NIL(v)) emit_byte(p, OP_NIL);
+  else if (IS_BOOL(v)) emit_byte(p, AS_BOOL(v) ? OP_TRUE : OP_FALSE);
+  else emit_constant(p, v);
+
+  // Unless the arena ran out and nothing was written.
+  c->const_end = ch->count > c->const_start ? ch->count : -1;
+  set_type(c, IS_NUMBER(v) ? TYPE_DOUBLE : IS_INTEGER(v) ? TYPE_NUMERIC : TYPE_ANY);
+}
+
+// Start of the literal the last expression consists of, or -1 if it was not
+// one. A label at its end means some jump also produces the value there.
+static int literal_start(compiler* c) {
+  int count = cur_chunk()->count;
+  if (c->const_end != count || c->last_label == count) return -1;
+  return c->const_start;
+}
+
+static value literal_value(chunk* ch, int offs) {
+  uint8_t* code = &ch->code[offs];
+
+  switch (code[0]) {
+    case OP_NIL:   return NIL_VAL;
+    case OP_TRUE:  return BOOL_VAL(true);
+    case OP_FALSE: return BOOL_VAL(false);
+    case OP_CONSTANT: return ch->constants.values[code[1]];
+    default:
+      return ch->constants.values[code[1] | (code[2] << 8) | (code[3] << 16)];
+  }
+}
+
+// Replaces the code from start on, and the constants it added, by a single
+// literal.
+static void emit_folded(parser* p, compiler* c, int start, int pool, value v) {
+  truncate_chunk(cur_chunk(), start);
+  cur_chunk()->constants.count = pool;
+  emit_literal(p, c, v);
+}
+
+// What is known about the value of the last expression.
+static static_type expression_type(compiler* c) {
+  int count = cur_chunk()->count;
+  if (c->type_end != count || c->last_label == count) return TYPE_ANY;
+  return c->type;
+}
+
+// The type of what inst leaves behind, given those of its operands. Operators
+// that raise an error on anything but numbers yield a number, whatever was
+// known about the operands; '+' only needs one of them to be a number.
+static static_type result_type(uint8_t inst, static_type a, static_type b) {
+  static_type known = a > b ? a : b;
+
+  switch (inst) {
+    case OP_ADD:      return known;
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_NEGATE:   return known > TYPE_NUMERIC ? known : TYPE_NUMERIC;
+    case OP_DIVIDE:   return TYPE_DOUBLE;
+    case OP_MODULO:
+    case OP_SHIFTLEFT:
+    case OP_SHIFTRIGHT:
+    case OP_BITNOT:
+    case OP_BITOR:
+    case OP_BITXOR:
+    case OP_BITAND:   return TYPE_NUMERIC;
+    default:          return TYPE_ANY;
+  }
+}
+
+// The variant of inst that skips checking its operands, if they are proven
+// numbers and it has one.
+static uint8_t unchecked(uint8_t inst, static_type a, static_type b) {
+  if (a == TYPE_ANY || b == TYPE_ANY) return inst;
+  bool doubles = a == TYPE_DOUBLE && b == TYPE_DOUBLE;
+
+  switch (inst) {
+    case OP_ADD:      return doubles ? OP_ADD_DOUBLE : OP_ADD_NUMERIC;
+    case OP_SUBTRACT: return doubles ? OP_SUBTRACT_DOUBLE : OP_SUBTRACT_NUMERIC;
+    case OP_MULTIPLY: return doubles ? OP_MULTIPLY_DOUBLE : OP_MULTIPLY_NUMERIC;
+    case OP_DIVIDE:   return doubles ? OP_DIVIDE_DOUBLE : OP_DIVIDE_NUMERIC;
+    case OP_NEGATE:   return doubles ? OP_NEGATE_DOUBLE : OP_NEGATE_NUMERIC;
+    case OP_GREATER:  return doubles ? OP_GREATER_DOUBLE : OP_GREATER_NUMERIC;
+    case OP_LESS:     return doubles ? OP_LESS_DOUBLE : OP_LESS_NUMERIC;
+    default:          return inst;
+  }
+}
+
+// The types of the locals in scope, saved at one point of the program to be
+// restored or joined with those at another. Control flow only ever merges
+// at statement boundaries or around the operands of 'and' and 'or', where the
+// set of locals is the same on every path.
+static void save_types(compiler* c, static_type* types) {
+  for (int i = 0; i < c->localc; i++) types[i] = c->locals[i].type;
+}
+
+static void restore_types(compiler* c, static_type* types) {
+  for (int i = 0; i < c->localc; i++) c->locals[i].type = types[i];
+}
+
+// Joins the current types into types, returning whether that lost anything.
+static bool join_types(compiler* c, static_type* types) {
+  bool lost = false;
+
+  for (int i = 0; i < c->localc; i++) {
+    if (c->locals[i].type < types[i]) {
+      types[i] = c->locals[i].type;
+      lost = true;
+    }
+  }
+
+  return lost;
 }
 
 static void parse_precedence(parser*, scanner*, compiler*, precedence);
@@ -174,18 +365,28 @@ void expression(parser* p, scanner* s, compiler* c) {
 
 static void number(parser* p, scanner* s, compiler* c, bool _) {
   double v = strtod(p->prev.start, NULL);
-  emit_constant(p, NUMBER_VAL(v));
+  emit_literal(p, c, NUMBER_VAL(v));
+}
+
+// Literals too large for an integer are read as doubles.
+static void integer(parser* p, scanner* s, compiler* c, bool _) {
+  errno = 0;
+  long long v = strtoll(p->prev.start, NULL, 10);
+
+  if (errno == ERANGE) number(p, s, c, _);
+  else emit_literal(p, c, INTEGER_VAL((int64_t)v));
 }
 
 static void chr(parser* p, scanner* s, compiler* c, bool _) {
   char v = p->prev.start[p->prev.length-2];
-  emit_constant(p, CHAR_VAL(v));
+  emit_literal(p, c, CHAR_VAL(v));
 }
 
 static void string(parser* p, scanner* s, compiler* c, bool _) {
-  emit_constant(p, OBJ_VAL(copy_str(p->cvm,
-                                    p->prev.start + 1,
-                                    p->prev.length - 2)));
+  obj_str* str = copy_str(p->cvm, p->prev.start + 1, p->prev.length - 2);
+  // Nil keeps the stack the compiler tracks in shape.
+  if (!str) error(p, "Out of memory.");
+  emit_literal(p, c, str ? OBJ_VAL(str) : NIL_VAL);
 }
 
 static void grouping(parser* p, scanner* s, compiler* c, bool _) {
@@ -193,71 +394,283 @@ static void grouping(parser* p, scanner* s, compiler* c, bool _) {
   consume(p, s, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
+// Folding has to give exactly what run() would, so anything that raises a
+// runtime error there is left to run time.
+bool fold_unary(uint8_t op, value a, value* result) {
+  switch (op) {
+    case OP_NOT:
+      *result = BOOL_VAL(IS_NIL(a) || (IS_BOOL(a) && !AS_BOOL(a)));
+      return true;
+    case OP_NEGATE:
+      if (IS_INTEGER(a)) *result = subtract_integers(0, AS_INTEGER(a));
+      else if (IS_NUMBER(a)) *result = NUMBER_VAL(-AS_NUMBER(a));
+      else return false;
+      return true;
+    case OP_BITNOT:
+      if (!IS_NUMERIC(a)) return false;
+      *result = INTEGER_VAL(~to_integer(a));
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool as_chars(value v, const char** chars, int* len, char* buf) {
+  if (IS_STRING(v)) {
+    *chars = AS_STRING(v)->chars;
+    *len = AS_STRING(v)->len;
+  } else if (IS_CHAR(v)) {
+    *buf = AS_CHAR(v);
+    *chars = buf;
+    *len = 1;
+  } else return false;
+
+  return true;
+}
+
+static bool fold_concatenation(parser* p, value a, value b, value* result) {
+  const char *ac, *bc;
+  int alen, blen;
+  char abuf, bbuf;
+
+  if (!as_chars(a, &ac, &alen, &abuf) || !as_chars(b, &bc, &blen, &bbuf)) {
+    return false;
+  }
+
+  int len = alen + blen;
+  char* chars = ALLOCATE_AS(HEAP_STRINGS, char, len + 1);
+  obj_str* str = NULL;
+  if (chars) {
+    memcpy(chars, ac, alen);
+    memcpy(chars + alen, bc, blen);
+    chars[len] = '\0';
+    str = take_str(p->cvm, chars, len);
+  }
+
+  if (!str) {
+    error(p, "Out of memory.");
+    return false;
+  }
+
+  *result = OBJ_VAL(str);
+  return true;
+}
+
+bool fold_arithmetic(uint8_t op, value a, value b, value* result) {
+  if (op == OP_EQUAL) {
+    *result = BOOL_VAL(values_equal(a, b));
+    return true;
+  }
+
+  if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) return false;
+
+  if (IS_INTEGER(a) && IS_INTEGER(b)) {
+    int64_t x = AS_INTEGER(a), y = AS_INTEGER(b);
+
+    switch (op) {
+      case OP_GREATER:  *result = BOOL_VAL(x > y); return true;
+      case OP_LESS:     *result = BOOL_VAL(x < y); return true;
+      case OP_ADD:      *result = add_integers(x, y); return true;
+      case OP_SUBTRACT: *result = subtract_integers(x, y); return true;
+      case OP_MULTIPLY: *result = multiply_integers(x, y); return true;
+      default: break;
+    }
+  }
+
+  double x = to_number(a), y = to_number(b);
+
+  switch (op) {
+    case OP_GREATER:  *result = BOOL_VAL(x > y); return true;
+    case OP_LESS:     *result = BOOL_VAL(x < y); return true;
+    case OP_ADD:      *result = NUMBER_VAL(x + y); return true;
+    case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+    case OP_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+    case OP_DIVIDE:   *result = NUMBER_VAL(x / y); return true;
+    default: break;
+  }
+
+  int64_t l = to_integer(a), r = to_integer(b);
+
+  switch (op) {
+    case OP_MODULO:
+      if (!r) return false;
+      *result = modulo_integers(l, r);
+      return true;
+    case OP_SHIFTLEFT:  *result = shift_integer(l, r, true); return true;
+    case OP_SHIFTRIGHT: *result = shift_integer(l, r, false); return true;
+    case OP_BITOR:  *result = INTEGER_VAL(l | r); return true;
+    case OP_BITXOR: *result = INTEGER_VAL(l ^ r); return true;
+    case OP_BITAND: *result = INTEGER_VAL(l & r); return true;
+    default: return false;
+  }
+}
+
+static bool fold_binary(parser* p, uint8_t op, value a, value b, value* result) {
+  if (op == OP_ADD && !(IS_NUMERIC(a) && IS_NUMERIC(b))) {
+    return fold_concatenation(p, a, b, result);
+  }
+
+  return fold_arithmetic(op, a, b, result);
+}
+
+// x * 1 and x - 0 are x for every number, -0 and NaN included, as long as the
+// constant is an integer and so does not turn x into a double. They are only
+// dropped when x is known to be a number, since otherwise run() would report
+// an error.
+static bool is_identity(uint8_t op, value b) {
+  if (!IS_INTEGER(b)) return false;
+
+  switch (op) {
+    case OP_MULTIPLY: return AS_INTEGER(b) == 1;
+    case OP_SUBTRACT: return AS_INTEGER(b) == 0;
+    default:          return false;
+  }
+}
+
 static void unary(parser* p, scanner* s, compiler* c, bool _) {
   token_type op = p->prev.type;
+  int start = cur_chunk()->count;
 
   parse_precedence(p, s, c, PREC_UNARY);
 
+  uint8_t inst;
   switch(op) {
-    case TOKEN_MINUS: emit_byte(p, OP_NEGATE); break;
-    case TOKEN_BANG: emit_byte(p, OP_NOT); break;
-    case TOKEN_TILDE: emit_byte(p, OP_BITNOT); break;
+    case TOKEN_MINUS: inst = OP_NEGATE; break;
+    case TOKEN_BANG: inst = OP_NOT; break;
+    case TOKEN_TILDE: inst = OP_BITNOT; break;
     default: return;
   }
+
+  value result;
+  if (literal_start(c) == start &&
+      fold_unary(inst, literal_value(cur_chunk(), start), &result)) {
+    emit_folded(p, c, start, c->const_pool, result);
+    return;
+  }
+
+  static_type type = expression_type(c);
+  emit_byte(p, unchecked(inst, type, type));
+  set_type(c, result_type(inst, type, type));
+}
+
+static int fused_jump(token_type op) {
+  switch (op) {
+    case TOKEN_BANG_EQUAL:    return OP_JUMP_IF_EQUAL;
+    case TOKEN_EQUAL_EQUAL:   return OP_JUMP_IF_NOT_EQUAL;
+    case TOKEN_GREATER:       return OP_JUMP_IF_NOT_GREATER;
+    case TOKEN_GREATER_EQUAL: return OP_JUMP_IF_LESS;
+    case TOKEN_LESS:          return OP_JUMP_IF_NOT_LESS;
+    case TOKEN_LESS_EQUAL:    return OP_JUMP_IF_GREATER;
+    default:                  return -1;
+  }
 }
 
 static void binary(parser* p, scanner* s, compiler* c, bool _) {
   token_type op = p->prev.type;
+  int lhs = literal_start(c);
+  int lhs_pool = c->const_pool;
+  static_type lhs_type = expression_type(c);
+  int rhs = cur_chunk()->count;
 
   parse_rule* rule = get_rule(op);
   parse_precedence(p, s, c, (precedence)(rule->prec + 1));
 
+  uint8_t inst;
+  bool negate = false;
   switch (op) {
-    case TOKEN_BANG_EQUAL:    emit_bytes(p, OP_EQUAL, OP_NOT); break;
-    case TOKEN_EQUAL_EQUAL:   emit_byte(p, OP_EQUAL); break;
-    case TOKEN_GREATER:       emit_byte(p, OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emit_bytes(p, OP_LESS, OP_NOT); break;
-    case TOKEN_LESS:          emit_byte(p, OP_LESS); break;
-    case TOKEN_LESS_EQUAL:    emit_bytes(p, OP_GREATER, OP_NOT); break;
-    case TOKEN_PLUS:          emit_byte(p, OP_ADD); break;
-    case TOKEN_MINUS:         emit_byte(p, OP_SUBTRACT); break;
-    case TOKEN_STAR:          emit_byte(p, OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emit_byte(p, OP_DIVIDE); break;
-    case TOKEN_HAT:           emit_byte(p, OP_BITXOR); break;
-    case TOKEN_PIPE:          emit_byte(p, OP_BITAND); break;
-    case TOKEN_AMP:           emit_byte(p, OP_BITOR); break;
-    case TOKEN_SHIFTLEFT:     emit_byte(p, OP_SHIFTLEFT); break;
-    case TOKEN_SHIFTRIGHT:     emit_byte(p, OP_SHIFTRIGHT); break;
+    case TOKEN_BANG_EQUAL:    inst = OP_EQUAL; negate = true; break;
+    case TOKEN_EQUAL_EQUAL:   inst = OP_EQUAL; break;
+    case TOKEN_GREATER:       inst = OP_GREATER; break;
+    case TOKEN_GREATER_EQUAL: inst = OP_LESS; negate = true; break;
+    case TOKEN_LESS:          inst = OP_LESS; break;
+    case TOKEN_LESS_EQUAL:    inst = OP_GREATER; negate = true; break;
+    case TOKEN_PLUS:          inst = OP_ADD; break;
+    case TOKEN_MINUS:         inst = OP_SUBTRACT; break;
+    case TOKEN_STAR:          inst = OP_MULTIPLY; break;
+    case TOKEN_SLASH:         inst = OP_DIVIDE; break;
+    case TOKEN_PERCENT:       inst = OP_MODULO; break;
+    case TOKEN_HAT:           inst = OP_BITXOR; break;
+    case TOKEN_PIPE:          inst = OP_BITAND; break;
+    case TOKEN_AMP:           inst = OP_BITOR; break;
+    case TOKEN_SHIFTLEFT:     inst = OP_SHIFTLEFT; break;
+    case TOKEN_SHIFTRIGHT:    inst = OP_SHIFTRIGHT; break;
     default: return;
   }
+
+  chunk* ch = cur_chunk();
+  static_type rhs_type = expression_type(c);
+
+  if (literal_start(c) == rhs) {
+    value b = literal_value(ch, rhs);
+    value result;
+
+    if (lhs != -1 &&
+        fold_binary(p, inst, literal_value(ch, lhs), b, &result)) {
+      if (negate) fold_unary(OP_NOT, result, &result);
+      emit_folded(p, c, lhs, lhs_pool, result);
+      return;
+    }
+
+    if (lhs_type != TYPE_ANY && is_identity(inst, b)) {
+      truncate_chunk(ch, rhs);
+      ch->constants.count = c->const_pool;
+      c->const_end = -1;
+      set_type(c, lhs_type);
+      return;
+    }
+  }
+
+  int jump = fused_jump(op);
+  if (jump != -1) {
+    c->cmp_start = ch->count;
+    c->cmp_jump = jump;
+  }
+
+  emit_byte(p, unchecked(inst, lhs_type, rhs_type));
+  if (negate) emit_byte(p, OP_NOT);
+
+  if (jump != -1) c->cmp_end = ch->count;
+  else set_type(c, result_type(inst, lhs_type, rhs_type));
 }
 
 static void literal(parser* p, scanner* s, compiler* c, bool _) {
   switch (p->prev.type) {
-    case TOKEN_FALSE:  emit_byte(p, OP_FALSE); break;
-    case TOKEN_TRUE:  emit_byte(p, OP_TRUE); break;
-    case TOKEN_NIL:  emit_byte(p, OP_NIL); break;
+    case TOKEN_FALSE:  emit_literal(p, c, BOOL_VAL(false)); break;
+    case TOKEN_TRUE:  emit_literal(p, c, BOOL_VAL(true)); break;
+    case TOKEN_NIL:  emit_literal(p, c, NIL_VAL); break;
     default: return;
   }
 }
 
+// The right operand of 'and' and 'or' may be skipped, and with it any
+// assignment it makes.
 static void and_(parser* p, scanner* s, compiler* c, bool _) {
+  static_type skipped[UINT8_COUNT];
   int endj = emit_jump(p, OP_JUMP_IF_FALSE);
   emit_byte(p, OP_POP);
+
+  save_types(c, skipped);
   parse_precedence(p, s, c, PREC_AND);
+  join_types(c, skipped);
+  restore_types(c, skipped);
 
-  patch_jump(p, endj);
+  patch_jump(p, c, endj);
 }
 
 static void or_(parser* p, scanner* s, compiler* c, bool _) {
+  static_type skipped[UINT8_COUNT];
   int elsej = emit_jump(p, OP_JUMP_IF_FALSE);
   int endj = emit_jump(p, OP_JUMP);
 
-  patch_jump(p, elsej);
+  patch_jump(p, c, elsej);
   emit_byte(p, OP_POP);
 
+  save_types(c, skipped);
   parse_precedence(p, s, c, PREC_OR);
-  patch_jump(p, endj);
+  join_types(c, skipped);
+  restore_types(c, skipped);
+
+  patch_jump(p, c, endj);
 }
 
 static void variable(parser*, scanner*, compiler* c, bool can_assign);
@@ -275,6 +688,7 @@ parse_rule rules[] = {
   { NULL,     NULL,    PREC_NONE },       // TOKEN_SEMICOLON
   { NULL,     binary,  PREC_FACTOR },     // TOKEN_SLASH
   { NULL,     binary,  PREC_FACTOR },     // TOKEN_STAR
+  { NULL,     binary,  PREC_FACTOR },     // TOKEN_PERCENT
   { unary,    NULL,    PREC_NONE },       // TOKEN_BANG
   { NULL,     binary,  PREC_EQUALITY },   // TOKEN_BANG_EQUAL
   { NULL,     NULL,    PREC_NONE },       // TOKEN_EQUAL
@@ -292,6 +706,7 @@ parse_rule rules[] = {
   { variable, NULL,    PREC_NONE },       // TOKEN_IDENTIFIER
   { string,   NULL,    PREC_NONE },       // TOKEN_STRING
   { number,   NULL,    PREC_NONE },       // TOKEN_NUMBER
+  { integer,  NULL,    PREC_NONE },       // TOKEN_INTEGER
   { chr,      NULL,    PREC_NONE },       // TOKEN_CHR
   { NULL,     and_,    PREC_AND },        // TOKEN_AND
   { NULL,     NULL,    PREC_NONE },       // TOKEN_CLASS
@@ -384,6 +799,53 @@ static void statement(parser* p, scanner* s, compiler* c) {
 
 static void var_declaration(parser*, scanner*, compiler*);
 
+// A point in the source to go back to, together with how much code had been
+// compiled by then.
+typedef struct {
+  scanner s;
+  token cur;
+  token prev;
+  int count;
+  int constants;
+  int last_label;
+} checkpoint;
+
+static void save_checkpoint(parser* p, scanner* s, compiler* c, checkpoint* cp) {
+  cp->s = *s;
+  cp->cur = p->cur;
+  cp->prev = p->prev;
+  cp->count = cur_chunk()->count;
+  cp->constants = cur_chunk()->constants.count;
+  cp->last_label = c->last_label;
+}
+
+static void rewind_to(parser* p, scanner* s, compiler* c, checkpoint* cp) {
+  *s = cp->s;
+  p->cur = cp->cur;
+  p->prev = cp->prev;
+  truncate_chunk(cur_chunk(), cp->count);
+  cur_chunk()->constants.count = cp->constants;
+  c->last_label = cp->last_label;
+  c->cmp_end = -1;
+  c->const_end = -1;
+  c->type_end = -1;
+}
+
+// Whether a loop has to be compiled again because the types it was compiled
+// for do not hold on every iteration. Erroneous code is never run, and
+// compiling it twice would only report the same errors twice.
+static bool recompile_loop(parser* p, bool lost) {
+  return lost && !p->errored;
+}
+
+// Loops are compiled inverted: the condition is cut out and moved behind the
+// body, where a single backward branch tests it on every iteration. A jump
+// over the body enters the loop at the condition.
+//
+// The types of the locals at the condition have to hold for the first
+// iteration and for every one after, which is not known until the body has
+// been compiled. Should the body lose any of them, the loop is compiled again
+// from less precise ones, which can only happen a few times per local.
 static void for_statement(parser* p, scanner* s, compiler* c) {
   begin_scope(c);
   consume(p, s, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
@@ -391,74 +853,133 @@ static void for_statement(parser* p, scanner* s, compiler* c) {
   else if (match(p, s, TOKEN_SEMICOLON)) {}
   else expression_statement(p, s, c);
 
-  int loopstart = cur_chunk()->count;
+  chunk* ch = cur_chunk();
+  checkpoint start;
+  static_type head[UINT8_COUNT];
+  static_type after[UINT8_COUNT];
+  static_type step[UINT8_COUNT];
+  static_type back[UINT8_COUNT];
+  save_checkpoint(p, s, c, &start);
+  save_types(c, head);
+
+  // The increment runs after the body but is compiled before it, so it
+  // starts out from the types after the condition and is compiled again if
+  // the body does not preserve them.
+  for (bool first = true;; first = false) {
+    snippet cond = { 0 };
+    snippet incr = { 0 };
+    uint8_t branch = OP_LOOP;
+
+    if (!match(p, s, TOKEN_SEMICOLON)) {
+      int condstart = ch->count;
+      expression(p, s, c);
+      consume(p, s, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+      branch = loop_branch(condition_jump(c));
+      cut_code(c, condstart, &cond);
+    }
 
-  int exitj = -1;
+    save_types(c, after);
+    if (first) save_types(c, step);
+    restore_types(c, step);
 
-  if (!match(p, s, TOKEN_SEMICOLON)) {
-    expression(p, s, c);
-    consume(p, s, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    if (!match(p, s, TOKEN_RIGHT_PAREN)) {
+      int incrstart = ch->count;
+      expression(p, s, c);
+      emit_byte(p, OP_POP);
+      consume(p, s, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-    exitj = emit_jump(p, OP_JUMP_IF_FALSE);
-    emit_byte(p, OP_POP);
-  }
+      cut_code(c, incrstart, &incr);
+    }
 
-  if (!match(p, s, TOKEN_RIGHT_PAREN)) {
-    int bodyj = emit_jump(p, OP_JUMP);
+    save_types(c, back);
+    restore_types(c, after);
 
-    int incrstart = cur_chunk()->count;
-    expression(p, s, c);
-    emit_byte(p, OP_POP);
-    consume(p, s, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    int entryj = branch == OP_LOOP ? -1 : emit_jump(p, OP_JUMP);
+    int bodystart = ch->count;
 
-    emit_loop(p, loopstart);
-    loopstart = incrstart;
-    patch_jump(p, bodyj);
-  }
+    statement(p, s, c);
 
-  statement(p, s, c);
+    paste_chunk(ch, &incr);
+    if (entryj != -1) patch_jump(p, c, entryj);
+    paste_chunk(ch, &cond);
+    emit_loop(p, branch, bodystart);
 
-  emit_loop(p, loopstart);
-  if (exitj != -1) {
-    patch_jump(p, exitj);
-    emit_byte(p, OP_POP);
+    bool lost = join_types(c, step);
+    restore_types(c, back);
+    lost |= join_types(c, head);
+    if (!recompile_loop(p, lost)) break;
+
+    rewind_to(p, s, c, &start);
+    restore_types(c, head);
   }
+
+  restore_types(c, after);
   end_scope(p, c);
 }
 
 static void while_statement(parser* p, scanner* s, compiler* c) {
-  int loopstart = cur_chunk()->count;
+  chunk* ch = cur_chunk();
+  checkpoint start;
+  static_type head[UINT8_COUNT];
+  static_type after[UINT8_COUNT];
+
   consume(p, s, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  expression(p, s, c);
-  consume(p, s, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  save_checkpoint(p, s, c, &start);
+  save_types(c, head);
+
+  for (;;) {
+    snippet cond;
+    int condstart = ch->count;
+    expression(p, s, c);
+    consume(p, s, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int exitj = emit_jump(p, OP_JUMP_IF_FALSE);
+    uint8_t branch = loop_branch(condition_jump(c));
+    cut_code(c, condstart, &cond);
+    save_types(c, after);
 
-  emit_byte(p, OP_POP);
-  statement(p, s, c);
+    int entryj = emit_jump(p, OP_JUMP);
+    int bodystart = ch->count;
 
-  emit_loop(p, loopstart);
+    statement(p, s, c);
 
-  patch_jump(p, exitj);
-  emit_byte(p, OP_POP);
+    patch_jump(p, c, entryj);
+    paste_chunk(ch, &cond);
+    emit_loop(p, branch, bodystart);
+
+    if (!recompile_loop(p, join_types(c, head))) break;
+
+    rewind_to(p, s, c, &start);
+    restore_types(c, head);
+  }
+
+  restore_types(c, after);
 }
 
+// After an if, the locals have the types they have after either branch.
 static void if_statement(parser* p, scanner* s, compiler* c) {
+  static_type cond[UINT8_COUNT];
+  static_type then[UINT8_COUNT];
+
   consume(p, s, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
   expression(p, s, c);
   consume(p, s, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int thenj = emit_jump(p, OP_JUMP_IF_FALSE);
-  emit_byte(p, OP_POP);
+  int thenj = emit_condition_jump(p, c);
+  save_types(c, cond);
   statement(p, s, c);
+  save_types(c, then);
+  restore_types(c, cond);
 
   int elsej = emit_jump(p, OP_JUMP);
 
-  patch_jump(p, thenj);
-  emit_byte(p, OP_POP);
+  patch_jump(p, c, thenj);
 
   if (match(p, s, TOKEN_ELSE)) statement(p, s, c);
-  patch_jump(p, elsej);
+  patch_jump(p, c, elsej);
+
+  join_types(c, then);
+  restore_types(c, then);
 }
 
 
@@ -488,8 +1009,36 @@ static void synchronize(parser* p, scanner* s) {
   }
 }
 
-static int identifier_constant(parser* p) {
-  return make_constant(p, OBJ_VAL(copy_str(p->cvm, p->prev.start, p->prev.length)));
+// Resolves a global to its slot in the VM's global array, creating the slot
+// on first mention so code may refer to globals defined further down. The
+// slots outlive the chunk, which is what keeps REPL lines seeing each other.
+static int global_slot(parser* p) {
+  vm* cvm = p->cvm;
+  obj_str* name = copy_str(cvm, p->prev.start, p->prev.length);
+  value slot;
+
+  if (!name) {
+    error(p, "Out of memory.");
+    return 0;
+  }
+
+  if (table_get(&cvm->globals, name, &slot)) return (int)AS_INTEGER(slot);
+
+  if (cvm->global_values.count == UINT16_COUNT) {
+    error(p, "Too many global variables.");
+    return 0;
+  }
+
+  table_set(&cvm->globals, name, INTEGER_VAL(cvm->global_values.count));
+  write_value_array(&cvm->global_values, UNDEFINED_VAL);
+  write_value_array(&cvm->global_names, OBJ_VAL(name));
+  return cvm->global_values.count - 1;
+}
+
+static void emit_global(parser* p, uint8_t inst, int slot) {
+  emit_byte(p, inst);
+  emit_byte(p, (slot >> 8) & 0xff);
+  emit_byte(p, slot & 0xff);
 }
 
 static int resolve_local(parser* p, compiler* c, token* name) {
@@ -505,21 +1054,27 @@ static int resolve_local(parser* p, compiler* c, token* name) {
 }
 
 static void named_variable(parser* p, scanner* s, compiler* c, bool can_assign) {
-  uint8_t getop, setop;
   int arg = resolve_local(p, c, &p->prev);
-  if (arg == -1) {
-    arg = identifier_constant(p);
-    getop = OP_GET_GLOBAL;
-    setop = OP_SET_GLOBAL;
-  } else {
-    getop = OP_GET_LOCAL;
-    setop = OP_SET_LOCAL;
-  }
+  bool global = arg == -1;
+  if (global) arg = global_slot(p);
 
+  // Globals may be assigned anything by other REPL lines, so nothing is
+  // known about them.
   if (can_assign && match(p, s, TOKEN_EQUAL)) {
     expression(p, s, c);
-    emit_bytes(p, setop, (uint8_t)arg);
-  } else emit_bytes(p, getop, (uint8_t)arg);
+    static_type type = expression_type(c);
+
+    if (global) emit_global(p, OP_SET_GLOBAL, arg);
+    else {
+      emit_bytes(p, OP_SET_LOCAL, (uint8_t)arg);
+      c->locals[arg].type = type;
+      set_type(c, type);
+    }
+  } else if (global) emit_global(p, OP_GET_GLOBAL, arg);
+  else {
+    emit_bytes(p, OP_GET_LOCAL, (uint8_t)arg);
+    set_type(c, c->locals[arg].type);
+  }
 }
 
 static void variable(parser* p, scanner* s, compiler* c, bool can_assign) {
@@ -535,6 +1090,7 @@ static void add_local(parser* p, compiler* c, token name) {
   local* l = &c->locals[c->localc++];
   l->name = name;
   l->depth = -1;
+  l->type = TYPE_ANY;
 }
 
 static void declare_variable(parser* p, compiler* c) {
@@ -559,7 +1115,7 @@ static int parse_variable(parser* p, scanner* s, compiler* c, const char* msg) {
   declare_variable(p, c);
   if (c->scope_depth > 0) return 0;
 
-  return identifier_constant(p);
+  return global_slot(p);
 }
 
 static void mark_initialized(compiler* c) {
@@ -569,7 +1125,7 @@ static void mark_initialized(compiler* c) {
 
 static void define_variable(parser* p, compiler* c, int global) {
   if (c->scope_depth > 0) { mark_initialized(c); return; }
-  emit_bytes(p, OP_DEFINE_GLOBAL, (uint8_t)global);
+  emit_global(p, OP_DEFINE_GLOBAL, global);
 }
 
 static void var_declaration(parser* p, scanner* s, compiler* c) {
@@ -580,6 +1136,7 @@ static void var_declaration(parser* p, scanner* s, compiler* c) {
 
   consume(p, s, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
+  if (c->scope_depth > 0) c->locals[c->localc-1].type = expression_type(c);
   define_variable(p, c, glob);
 }
 
@@ -593,10 +1150,17 @@ static void declaration(parser* p, scanner* s, compiler* c) {
 static void init_compiler(compiler* c) {
   c->localc = 0;
   c->scope_depth = 0;
+  c->last_label = -1;
+  c->cmp_end = -1;
+  c->const_end = -1;
+  c->type_end = -1;
 }
 
+// Everything the chunk holds comes from its arena if it has one, sized with
+// COMPILE_ARENA_SIZE, and ends up in one block of it.
 bool compile(vm* cvm, const char* source, chunk* c) {
-  scanner* s = init_scanner(source);
+  scanner s;
+  init_scanner(&s, source);
   compiler com;
   init_compiler(&com);
   parser p;
@@ -604,11 +1168,17 @@ bool compile(vm* cvm, const char* source, chunk* c) {
   p.panic_mode = false;
   p.cvm = cvm;
   comp = c;
-
-  advance(&p, s);
-  while (!match(&p, s, TOKEN_EOF)) declaration(&p, s, &com);
-  consume(&p, s, TOKEN_EOF, "Expect end of expression.");
-  free(s);
+  c->global_names = &cvm->global_names;
+  // Where the collector finds the constants compiled so far, which are all
+  // allocated old.
+  cvm->c = c;
+  cvm->tenure = true;
+
+  advance(&p, &s);
+  while (!match(&p, &s, TOKEN_EOF)) declaration(&p, &s, &com);
+  consume(&p, &s, TOKEN_EOF, "Expect end of expression.");
   end_compiler(&p);
+  if (!p.errored) compact_chunk(c);
+  cvm->tenure = false;
   return !p.errored;
 }
@@ -4,6 +4,15 @@
 #include "chunk.h"
 #include "vm.h"
 
+// Roughly what compiling len bytes of source takes, threaded code included.
+// The arena grows should it take more.
+#define COMPILE_ARENA_SIZE(len) (16 * (len) + 256)
+
 bool compile(vm* cvm, const char*, chunk*);
 
+// Work out an instruction on constant operands the way run() would, failing
+// where run() would raise an error. Concatenation is left to the compiler.
+bool fold_unary(uint8_t op, value, value* result);
+bool fold_arithmetic(uint8_t op, value, value, value* result);
+
 #endif
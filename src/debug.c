@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 
 #include "debug.h"
@@ -20,16 +21,6 @@ static int simple_instruction(const char* name, int offs) {
   return offs + 1;
 }
 
-void print_value(value v) {
-  switch (v.type) {
-    case BOOL:   printf(AS_BOOL(v) ? "true" : "false"); break;
-    case NIL:    printf("nil"); break;
-    case NUMBER: printf("%g", AS_NUMBER(v)); break;
-    case CHAR:   printf("%c", AS_CHAR(v)); break;
-    case OBJ:    print_obj(v); break;
-  }
-}
-
 static int constant_instruction(const char* name, chunk* c, int offs) {
   uint8_t constant = c->code[offs+1];
   printf("%-16s %4d '", name, constant);
@@ -44,6 +35,28 @@ static int byte_instruction(const char* name, chunk* c, int offs) {
   return offs+2;
 }
 
+static int two_byte_instruction(const char* name, chunk* c, int offs) {
+  printf("%-16s %4d %4d\n", name, c->code[offs+1], c->code[offs+2]);
+  return offs+3;
+}
+
+static int local_constant_instruction(const char* name, chunk* c, int offs) {
+  uint8_t slot = c->code[offs+1];
+  uint8_t constant = c->code[offs+2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  print_value(c->constants.values[constant]);
+  puts("'");
+  return offs+3;
+}
+
+static int global_instruction(const char* name, chunk* c, int offs) {
+  uint16_t slot = (uint16_t)(c->code[offs+1] << 8) | c->code[offs+2];
+  printf("%-16s %4d '", name, slot);
+  if (c->global_names) print_value(c->global_names->values[slot]);
+  puts("'");
+  return offs + 3;
+}
+
 static int long_constant_instruction(const char* name, chunk* c, int offs) {
   uint32_t constant = c->code[offs+1] + (c->code[offs+2]<<8) + (c->code[offs+3]<<16);
   printf("%-16s %4d '", name, constant);
@@ -96,8 +109,50 @@ int disassemble_instruction(chunk* c, int offs) {
       return simple_instruction("multiply", offs);
     case OP_DIVIDE:
       return simple_instruction("divide", offs);
+    case OP_MODULO:
+      return simple_instruction("modulo", offs);
+    case OP_SHIFTLEFT:
+      return simple_instruction("shl", offs);
+    case OP_SHIFTRIGHT:
+      return simple_instruction("shr", offs);
+    case OP_BITOR:
+      return simple_instruction("or", offs);
+    case OP_BITXOR:
+      return simple_instruction("xor", offs);
+    case OP_BITAND:
+      return simple_instruction("and", offs);
+    case OP_BITNOT:
+      return simple_instruction("bitnot", offs);
     case OP_NEGATE:
       return simple_instruction("negate", offs);
+    case OP_ADD_NUMERIC:
+      return simple_instruction("add numeric", offs);
+    case OP_SUBTRACT_NUMERIC:
+      return simple_instruction("subtract numeric", offs);
+    case OP_MULTIPLY_NUMERIC:
+      return simple_instruction("multiply numeric", offs);
+    case OP_DIVIDE_NUMERIC:
+      return simple_instruction("divide numeric", offs);
+    case OP_NEGATE_NUMERIC:
+      return simple_instruction("negate numeric", offs);
+    case OP_GREATER_NUMERIC:
+      return simple_instruction("gt numeric", offs);
+    case OP_LESS_NUMERIC:
+      return simple_instruction("lt numeric", offs);
+    case OP_ADD_DOUBLE:
+      return simple_instruction("add double", offs);
+    case OP_SUBTRACT_DOUBLE:
+      return simple_instruction("subtract double", offs);
+    case OP_MULTIPLY_DOUBLE:
+      return simple_instruction("multiply double", offs);
+    case OP_DIVIDE_DOUBLE:
+      return simple_instruction("divide double", offs);
+    case OP_NEGATE_DOUBLE:
+      return simple_instruction("negate double", offs);
+    case OP_GREATER_DOUBLE:
+      return simple_instruction("gt double", offs);
+    case OP_LESS_DOUBLE:
+      return simple_instruction("lt double", offs);
     case OP_NIL:
       return simple_instruction("nil", offs);
     case OP_TRUE:
@@ -117,21 +172,57 @@ int disassemble_instruction(chunk* c, int offs) {
     case OP_POP:
       return simple_instruction("pop", offs);
     case OP_DEFINE_GLOBAL:
-      return constant_instruction("define global", c, offs);
+      return global_instruction("define global", c, offs);
     case OP_GET_GLOBAL:
-      return constant_instruction("get global", c, offs);
+      return global_instruction("get global", c, offs);
     case OP_SET_GLOBAL:
-      return constant_instruction("set global", c, offs);
+      return global_instruction("set global", c, offs);
     case OP_GET_LOCAL:
       return byte_instruction("get local", c, offs);
     case OP_SET_LOCAL:
       return byte_instruction("set local", c, offs);
+    case OP_SET_LOCAL_POP:
+      return byte_instruction("set local pop", c, offs);
+    case OP_SET_GLOBAL_POP:
+      return global_instruction("set global pop", c, offs);
+    case OP_GET_LOCALS:
+      return two_byte_instruction("get locals", c, offs);
+    case OP_ADD_LOCAL_CONSTANT:
+      return local_constant_instruction("add local const", c, offs);
     case OP_JUMP:
       return jump_instruction("jump", 1, c, offs);
     case OP_LOOP:
       return jump_instruction("loop", -1, c, offs);
+    case OP_LOOP_IF_TRUE:
+      return jump_instruction("loop if true", -1, c, offs);
+    case OP_LOOP_IF_EQUAL:
+      return jump_instruction("loop if eq", -1, c, offs);
+    case OP_LOOP_IF_NOT_EQUAL:
+      return jump_instruction("loop if not eq", -1, c, offs);
+    case OP_LOOP_IF_GREATER:
+      return jump_instruction("loop if gt", -1, c, offs);
+    case OP_LOOP_IF_NOT_GREATER:
+      return jump_instruction("loop if not gt", -1, c, offs);
+    case OP_LOOP_IF_LESS:
+      return jump_instruction("loop if lt", -1, c, offs);
+    case OP_LOOP_IF_NOT_LESS:
+      return jump_instruction("loop if not lt", -1, c, offs);
     case OP_JUMP_IF_FALSE:
       return jump_instruction("jump if false", 1, c, offs);
+    case OP_POP_JUMP_IF_FALSE:
+      return jump_instruction("pop jump if false", 1, c, offs);
+    case OP_JUMP_IF_EQUAL:
+      return jump_instruction("jump if eq", 1, c, offs);
+    case OP_JUMP_IF_NOT_EQUAL:
+      return jump_instruction("jump if not eq", 1, c, offs);
+    case OP_JUMP_IF_GREATER:
+      return jump_instruction("jump if gt", 1, c, offs);
+    case OP_JUMP_IF_NOT_GREATER:
+      return jump_instruction("jump if not gt", 1, c, offs);
+    case OP_JUMP_IF_LESS:
+      return jump_instruction("jump if lt", 1, c, offs);
+    case OP_JUMP_IF_NOT_LESS:
+      return jump_instruction("jump if not lt", 1, c, offs);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offs + 1;
@@ -146,5 +237,158 @@ void print_trace(vm* cvm) {
       fputs(" ]", stdout);
     }
     puts("");
-    disassemble_instruction(cvm->c, (int)(cvm->ip - cvm->c->code));
+    disassemble_instruction(cvm->c, cvm->c->cell_offsets[cvm->ip - cvm->c->cells]);
+  }
+
+static const char* register_names[] = {
+  [OP_MOVE] = "move",
+  [OP_GET_GLOBAL] = "get global",
+  [OP_DEFINE_GLOBAL] = "define global",
+  [OP_SET_GLOBAL] = "set global",
+  [OP_ADD] = "add",
+  [OP_SUBTRACT] = "subtract",
+  [OP_MULTIPLY] = "multiply",
+  [OP_DIVIDE] = "divide",
+  [OP_MODULO] = "modulo",
+  [OP_SHIFTLEFT] = "shl",
+  [OP_SHIFTRIGHT] = "shr",
+  [OP_BITNOT] = "bitnot",
+  [OP_BITOR] = "or",
+  [OP_BITXOR] = "xor",
+  [OP_BITAND] = "and",
+  [OP_NEGATE] = "negate",
+  [OP_RETURN] = "return",
+  [OP_NOT] = "not",
+  [OP_EQUAL] = "eq",
+  [OP_GREATER] = "gt",
+  [OP_LESS] = "lt",
+  [OP_PRINT] = "print",
+  [OP_JUMP_IF_FALSE] = "jump if false",
+  [OP_JUMP_IF_EQUAL] = "jump if eq",
+  [OP_JUMP_IF_NOT_EQUAL] = "jump if not eq",
+  [OP_JUMP_IF_GREATER] = "jump if gt",
+  [OP_JUMP_IF_NOT_GREATER] = "jump if not gt",
+  [OP_JUMP_IF_LESS] = "jump if lt",
+  [OP_JUMP_IF_NOT_LESS] = "jump if not lt",
+  [OP_JUMP] = "jump",
+  [OP_LOOP] = "loop",
+  [OP_LOOP_IF_TRUE] = "loop if true",
+  [OP_LOOP_IF_EQUAL] = "loop if eq",
+  [OP_LOOP_IF_NOT_EQUAL] = "loop if not eq",
+  [OP_LOOP_IF_GREATER] = "loop if gt",
+  [OP_LOOP_IF_NOT_GREATER] = "loop if not gt",
+  [OP_LOOP_IF_LESS] = "loop if lt",
+  [OP_LOOP_IF_NOT_LESS] = "loop if not lt",
+  [OP_ADD_NUMERIC] = "add numeric",
+  [OP_SUBTRACT_NUMERIC] = "subtract numeric",
+  [OP_MULTIPLY_NUMERIC] = "multiply numeric",
+  [OP_DIVIDE_NUMERIC] = "divide numeric",
+  [OP_NEGATE_NUMERIC] = "negate numeric",
+  [OP_GREATER_NUMERIC] = "gt numeric",
+  [OP_LESS_NUMERIC] = "lt numeric",
+  [OP_ADD_DOUBLE] = "add double",
+  [OP_SUBTRACT_DOUBLE] = "subtract double",
+  [OP_MULTIPLY_DOUBLE] = "multiply double",
+  [OP_DIVIDE_DOUBLE] = "divide double",
+  [OP_NEGATE_DOUBLE] = "negate double",
+  [OP_GREATER_DOUBLE] = "gt double",
+  [OP_LESS_DOUBLE] = "lt double",
+};
+
+// Registers print as r0, r1, ..., the constants above them as their value.
+static void print_slot(chunk* c, reg_code* rc, int slot) {
+  if (slot < rc->registers) {
+    printf(" r%d", slot);
+    return;
   }
+
+  fputs(" '", stdout);
+  print_value(frame_constant(c, rc, slot));
+  putchar('\'');
+}
+
+static void disassemble_register_instruction(chunk* c, reg_code* rc, int i) {
+  reg_inst* inst = &rc->code[i];
+  int line = get_line(c->lines, c->lines_count, rc->offsets[i]);
+  int prev_line = i ? get_line(c->lines, c->lines_count, rc->offsets[i-1]) : -1;
+
+  printf("%04d ", i);
+  if (line == prev_line) fputs("   | ", stdout);
+  else printf("%4d ", line);
+  printf("%-16s", register_names[inst->op]);
+
+  switch (inst->op) {
+    case OP_RETURN:
+      break;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+      if (inst->op == OP_GET_GLOBAL) print_slot(c, rc, inst->a);
+      else print_slot(c, rc, inst->b);
+      fputs(" '", stdout);
+      if (c->global_names) print_value(c->global_names->values[inst->c]);
+      putchar('\'');
+      break;
+    case OP_MOVE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_NEGATE_NUMERIC:
+    case OP_NEGATE_DOUBLE:
+    case OP_BITNOT:
+      print_slot(c, rc, inst->a);
+      print_slot(c, rc, inst->b);
+      break;
+    case OP_PRINT:
+      print_slot(c, rc, inst->b);
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP_IF_TRUE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_LOOP_IF_EQUAL:
+    case OP_LOOP_IF_NOT_EQUAL:
+    case OP_LOOP_IF_GREATER:
+    case OP_LOOP_IF_NOT_GREATER:
+    case OP_LOOP_IF_LESS:
+    case OP_LOOP_IF_NOT_LESS: {
+      int target = rc->threaded ? (int)(inst->as.target - rc->code) : inst->as.index;
+      if (inst->op != OP_JUMP && inst->op != OP_LOOP) print_slot(c, rc, inst->b);
+      if (inst->op != OP_JUMP && inst->op != OP_LOOP &&
+          inst->op != OP_JUMP_IF_FALSE && inst->op != OP_LOOP_IF_TRUE) {
+        print_slot(c, rc, inst->c);
+      }
+      printf(" -> %d", target);
+      break;
+    }
+    default:
+      print_slot(c, rc, inst->a);
+      print_slot(c, rc, inst->b);
+      print_slot(c, rc, inst->c);
+      break;
+  }
+
+  puts("");
+}
+
+void disassemble_registers(chunk* c, reg_code* rc, const char* name) {
+  printf("== %s ==\n", name);
+  for (int i = 0; i < rc->count; i++) disassemble_register_instruction(c, rc, i);
+  puts("========");
+}
+
+void print_register_trace(chunk* c, reg_code* rc, value* frame, int i) {
+  fputs("          ", stdout);
+  for (int r = 0; r < rc->registers; r++) {
+    fputs("[ ", stdout);
+    print_value(frame[r]);
+    fputs(" ]", stdout);
+  }
+  puts("");
+  disassemble_register_instruction(c, rc, i);
+}
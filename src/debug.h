@@ -2,11 +2,14 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "regcode.h"
 #include "vm.h"
 
 void disassemble_chunk(chunk*, const char*);
 int disassemble_instruction(chunk*, int);
-void print_value(value);
 void print_trace(vm*);
+void disassemble_registers(chunk*, reg_code*, const char*);
+void print_register_trace(chunk*, reg_code*, value*, int);
+int get_line(int*, int, int);
 
 #endif
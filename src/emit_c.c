@@ -0,0 +1,505 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "compiler.h"
+#include "debug.h"
+#include "emit_c.h"
+#include "memory.h"
+
+// Ahead-of-time translation of a chunk to C. Every stack slot becomes a
+// local of main(), at the height stack_heights() works out for it, and
+// every instruction a statement on them, so the C compiler is free to keep
+// slots in registers and fold what is constant. Jumps become gotos.
+//
+// The collector cannot see locals, so where it may run, at concatenations
+// and loop back-edges, the live slots are copied to lox_frame first, which
+// it marks as it does the register tier's frame. Without a nursery objects
+// never move, and nothing needs copying back.
+//
+// The generated program links against value.c, obj.c, hash.c and memory.c.
+// What run() does on top of those comes along in the prelude below, raising
+// the same errors with the same exit code.
+static const char* prelude =
+  "#include <limits.h>\n"
+  "#include <stdarg.h>\n"
+  "#include <stdio.h>\n"
+  "#include <stdlib.h>\n"
+  "#include <string.h>\n"
+  "\n"
+  "#include \"memory.h\"\n"
+  "#include \"value.h\"\n"
+  "#include \"vm.h\"\n"
+  "\n"
+  "// Holds the heap, with the globals, the constants and lox_frame as roots.\n"
+  "static vm lox_vm;\n"
+  "static chunk lox_chunk;\n"
+  "\n"
+  "static inline void lox_error(int line, const char* format, ...) {\n"
+  "  va_list args;\n"
+  "  va_start(args, format);\n"
+  "  vfprintf(stderr, format, args);\n"
+  "  va_end(args);\n"
+  "  fputs(\"\\n\", stderr);\n"
+  "  fprintf(stderr, \"[line %d] in script\\n\", line);\n"
+  "  exit(70);\n"
+  "}\n"
+  "\n"
+  "static inline double lox_double(uint64_t bits) {\n"
+  "  double d;\n"
+  "  memcpy(&d, &bits, sizeof(d));\n"
+  "  return d;\n"
+  "}\n"
+  "\n"
+  "static inline void lox_numeric(value a, value b, int line) {\n"
+  "  if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) lox_error(line, \"Operands must be numbers.\");\n"
+  "}\n"
+  "\n"
+  "// Arithmetic on operands known to be numbers.\n"
+  "static inline value lox_arith(value a, value b, char op) {\n"
+  "  if (op != '/' && ARE_INTEGERS(a, b)) {\n"
+  "    if (op == '+') return add_integers(AS_INTEGER(a), AS_INTEGER(b));\n"
+  "    if (op == '-') return subtract_integers(AS_INTEGER(a), AS_INTEGER(b));\n"
+  "    return multiply_integers(AS_INTEGER(a), AS_INTEGER(b));\n"
+  "  }\n"
+  "\n"
+  "  double x = to_number(a);\n"
+  "  double y = to_number(b);\n"
+  "  if (op == '+') return NUMBER_VAL(x + y);\n"
+  "  if (op == '-') return NUMBER_VAL(x - y);\n"
+  "  if (op == '*') return NUMBER_VAL(x * y);\n"
+  "  return NUMBER_VAL(x / y);\n"
+  "}\n"
+  "\n"
+  "static inline value lox_checked_arith(value a, value b, char op, int line) {\n"
+  "  if (!ARE_INTEGERS(a, b)) lox_numeric(a, b, line);\n"
+  "  return lox_arith(a, b, op);\n"
+  "}\n"
+  "\n"
+  "static inline bool lox_compare(value a, value b, char op) {\n"
+  "  if (ARE_INTEGERS(a, b)) {\n"
+  "    return op == '>' ? AS_INTEGER(a) > AS_INTEGER(b) : AS_INTEGER(a) < AS_INTEGER(b);\n"
+  "  }\n"
+  "  return op == '>' ? to_number(a) > to_number(b) : to_number(a) < to_number(b);\n"
+  "}\n"
+  "\n"
+  "static inline bool lox_checked_compare(value a, value b, char op, int line) {\n"
+  "  if (!ARE_INTEGERS(a, b)) lox_numeric(a, b, line);\n"
+  "  return lox_compare(a, b, op);\n"
+  "}\n"
+  "\n"
+  "// Strings and chars, in any combination.\n"
+  "static inline value lox_concatenate(value a, value b, int line) {\n"
+  "  char ca, cb;\n"
+  "  const char* pa = &ca;\n"
+  "  const char* pb = &cb;\n"
+  "  int la = 1, lb = 1;\n"
+  "\n"
+  "  if (IS_STRING(a)) pa = AS_CSTRING(a), la = AS_STRING(a)->len;\n"
+  "  else if (IS_CHAR(a)) ca = AS_CHAR(a);\n"
+  "  else lox_error(line, \"Operands must be two numbers or two strings.\");\n"
+  "  if (IS_STRING(b)) pb = AS_CSTRING(b), lb = AS_STRING(b)->len;\n"
+  "  else if (IS_CHAR(b)) cb = AS_CHAR(b);\n"
+  "  else lox_error(line, \"Operands must be two numbers or two strings.\");\n"
+  "\n"
+  "  obj_str* s = (int64_t)la + lb > INT_MAX ? NULL : new_str(&lox_vm, la + lb);\n"
+  "  if (!s) lox_error(line, \"Out of memory.\");\n"
+  "  memcpy(s->chars, pa, la);\n"
+  "  memcpy(s->chars + la, pb, lb);\n"
+  "  return OBJ_VAL(s);\n"
+  "}\n"
+  "\n"
+  "  "// Bitwise operators, shifts and modulo, on the integers of the operands.\n"
+  "static inline value lox_bitwise(value a, value b, char op, int line) {\n"
+  "  if (!ARE_INTEGERS(a, b)) lox_numeric(a, b, line);\n"
+  "  int64_t x = to_integer(a);\n"
+  "  int64_t y = to_integer(b);\n"
+  "\n"
+  "  switch (op) {\n"
+  "    case '&': return INTEGER_VAL(x & y);\n"
+  "    case '|': return INTEGER_VAL(x | y);\n"
+  "    case '^': return INTEGER_VAL(x ^ y);\n"
+  "    case '<': return shift_integer(x, y, true);\n"
+  "    case '>': return shift_integer(x, y, false);\n"
+  "    default:\n"
+  "      if (!y) lox_error(line, \"Modulo by zero.\");\n"
+  "      return modulo_integers(x, y);\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "static inline value lox_negate(value a, int line) {\n"
+  "  if (IS_INTEGER(a)) return subtract_integers(0, AS_INTEGER(a));\n"
+  "  if (!IS_NUMBER(a)) lox_error(line, \"Operand to '-' must be a number.\");\n"
+  "  return NUMBER_VAL(-AS_NUMBER(a));\n"
+  "}\n"
+  "\n"
+  "static inline value lox_bitnot(value a, int line) {\n"
+  "  if (!IS_NUMERIC(a)) lox_error(line, \"Operand to '~' must be a number.\");\n"
+  "  return INTEGER_VAL(~to_integer(a));\n"
+  "}\n"
+  "\n";
+
+static void emit_string(FILE* out, const char* chars, int len) {
+  fputc('"', out);
+  for (int i = 0; i < len; i++) {
+    unsigned char ch = chars[i];
+    if (ch == '"' || ch == '\\') fprintf(out, "\\%c", ch);
+    // Question marks could start trigraphs.
+    else if (ch >= ' ' && ch < 0x7f && ch != '?') fputc(ch, out);
+    else fprintf(out, "\\%03o", ch);
+  }
+  fputc('"', out);
+}
+
+// Writes constant as a C expression. Strings and boxed integers are made
+// once, at startup, and read from the constants array.
+static void emit_value(FILE* out, chunk* c, int constant) {
+  value v = c->constants.values[constant];
+
+  if (IS_INTEGER(v) && !IS_OBJ(v)) {
+    fprintf(out, "INTEGER_VAL(INT64_C(%" PRId64 "))", AS_INTEGER(v));
+  } else if (IS_NUMBER(v)) {
+    double d = AS_NUMBER(v);
+    if (isfinite(d)) fprintf(out, "NUMBER_VAL(%a)", d);
+    else {
+      uint64_t bits;
+      memcpy(&bits, &d, sizeof(bits));
+      fprintf(out, "NUMBER_VAL(lox_double(UINT64_C(0x%016" PRIx64 ")))", bits);
+    }
+  } else if (IS_BOOL(v)) {
+    fputs(AS_BOOL(v) ? "BOOL_VAL(true)" : "BOOL_VAL(false)", out);
+  } else if (IS_NIL(v)) {
+    fputs("NIL_VAL", out);
+  } else if (IS_CHAR(v)) {
+    fprintf(out, "CHAR_VAL(%d)", AS_CHAR(v));
+  } else {
+    fprintf(out, "constants[%d]", constant);
+  }
+}
+
+// The character the prelude, or C itself, knows the operator by.
+static char operator_of(uint8_t op) {
+  switch (op) {
+    case OP_ADD_NUMERIC:
+    case OP_ADD_DOUBLE:
+      return '+';
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUMERIC:
+    case OP_SUBTRACT_DOUBLE:
+      return '-';
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUMERIC:
+    case OP_MULTIPLY_DOUBLE:
+      return '*';
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUMERIC:
+    case OP_DIVIDE_DOUBLE:
+      return '/';
+    case OP_MODULO: return '%';
+    case OP_SHIFTLEFT: return '<';
+    case OP_SHIFTRIGHT: return '>';
+    case OP_BITOR: return '|';
+    case OP_BITXOR: return '^';
+    case OP_BITAND: return '&';
+    case OP_GREATER_DOUBLE: return '>';
+    default: return '<';
+  }
+}
+
+// Writes the condition a conditional jump is taken on.
+static void emit_condition(FILE* out, uint8_t op, int h, int line) {
+  switch (op) {
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+      fprintf(out, "is_falsy(s%d)", h-1);
+      break;
+    case OP_LOOP_IF_TRUE:
+      fprintf(out, "!is_falsy(s%d)", h-1);
+      break;
+    case OP_JUMP_IF_EQUAL:
+    case OP_LOOP_IF_EQUAL:
+      fprintf(out, "values_equal(s%d, s%d)", h-2, h-1);
+      break;
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_LOOP_IF_NOT_EQUAL:
+      fprintf(out, "!values_equal(s%d, s%d)", h-2, h-1);
+      break;
+    default: {
+      bool greater = op == OP_JUMP_IF_GREATER || op == OP_JUMP_IF_NOT_GREATER ||
+                     op == OP_LOOP_IF_GREATER || op == OP_LOOP_IF_NOT_GREATER;
+      bool negated = op == OP_JUMP_IF_NOT_GREATER || op == OP_JUMP_IF_NOT_LESS ||
+                     op == OP_LOOP_IF_NOT_GREATER || op == OP_LOOP_IF_NOT_LESS;
+      fprintf(out, "%slox_checked_compare(s%d, s%d, '%c', %d)", negated ? "!" : "",
+              h-2, h-1, greater ? '>' : '<', line);
+      break;
+    }
+  }
+}
+
+// Slot slot, or the constant if there is one.
+static void emit_operand(FILE* out, chunk* c, int slot, int constant) {
+  if (constant == -1) fprintf(out, "s%d", slot);
+  else emit_value(out, c, constant);
+}
+
+// Shows the first n slots to the collector.
+static void emit_frame(FILE* out, int n) {
+  for (int i = 0; i < n; i++) fprintf(out, "    lox_frame[%d] = s%d;\n", i, i);
+  fprintf(out, "    lox_vm.frame_size = %d;\n", n);
+}
+
+// Adds slot b, or the constant, to slot a, at height h.
+static void emit_add(FILE* out, chunk* c, int a, int b, int constant, int h, int line) {
+  fprintf(out, "  if (IS_NUMERIC(s%d) && IS_NUMERIC(", a);
+  emit_operand(out, c, b, constant);
+  fprintf(out, ")) s%d = lox_arith(s%d, ", a, a);
+  emit_operand(out, c, b, constant);
+  fputs(", '+');\n  else {\n", out);
+  emit_frame(out, h);
+  fprintf(out, "    s%d = lox_concatenate(s%d, ", a, a);
+  emit_operand(out, c, b, constant);
+  fprintf(out, ", %d);\n    lox_vm.frame_size = 0;\n  }\n", line);
+}
+
+// Loops collect what boxing integers left behind, as run() does.
+static void emit_safepoint(FILE* out, int h) {
+  fputs("  if (lox_vm.bytes_allocated > lox_vm.next_gc) {\n", out);
+  emit_frame(out, h);
+  fputs("    collect_garbage(&lox_vm);\n    lox_vm.frame_size = 0;\n  }\n", out);
+}
+
+static void emit_instruction(FILE* out, chunk* c, int offs, int h) {
+  uint8_t op = c->code[offs];
+  uint8_t* operand = c->code + offs + 1;
+  int global = (operand[0] << 8) | operand[1];
+  int line = get_line(c->lines, c->lines_count, offs);
+  int a = h-2;
+  int b = h-1;
+
+  if (op >= OP_LOOP && op <= OP_LOOP_IF_NOT_LESS) emit_safepoint(out, h);
+
+  switch (op) {
+    case OP_CONSTANT:
+      fprintf(out, "  s%d = ", h);
+      emit_value(out, c, operand[0]);
+      fputs(";\n", out);
+      break;
+    case OP_CONSTANT_LONG:
+      fprintf(out, "  s%d = ", h);
+      emit_value(out, c, operand[0] | (operand[1] << 8) | (operand[2] << 16));
+      fputs(";\n", out);
+      break;
+    case OP_NIL:   fprintf(out, "  s%d = NIL_VAL;\n", h); break;
+    case OP_TRUE:  fprintf(out, "  s%d = BOOL_VAL(true);\n", h); break;
+    case OP_FALSE: fprintf(out, "  s%d = BOOL_VAL(false);\n", h); break;
+    case OP_POP:
+      break;
+    case OP_GET_LOCAL:
+      fprintf(out, "  s%d = s%d;\n", h, operand[0]);
+      break;
+    case OP_GET_LOCALS:
+      fprintf(out, "  s%d = s%d;\n  s%d = s%d;\n", h, operand[0], h+1, operand[1]);
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      fprintf(out, "  s%d = s%d;\n", operand[0], b);
+      break;
+    case OP_ADD_LOCAL_CONSTANT:
+      emit_add(out, c, operand[0], -1, operand[1], h, line);
+      break;
+    case OP_GET_GLOBAL:
+      fprintf(out, "  if (IS_UNDEFINED(globals[%d])) "
+                   "lox_error(%d, \"Undefined variable '%%s'.\", global_names[%d]);\n",
+              global, line, global);
+      fprintf(out, "  s%d = globals[%d];\n", h, global);
+      break;
+    case OP_DEFINE_GLOBAL:
+      fprintf(out, "  if (!IS_UNDEFINED(globals[%d])) "
+                   "lox_error(%d, \"Redefined variable '%%s'.\", global_names[%d]);\n",
+              global, line, global);
+      fprintf(out, "  globals[%d] = s%d;\n", global, b);
+      break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+      fprintf(out, "  if (IS_UNDEFINED(globals[%d])) "
+                   "lox_error(%d, \"Undefined variable '%%s'.\", global_names[%d]);\n",
+              global, line, global);
+      fprintf(out, "  globals[%d] = s%d;\n", global, b);
+      break;
+    case OP_ADD:
+      emit_add(out, c, a, b, -1, h, line);
+      break;
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      fprintf(out, "  s%d = lox_checked_arith(s%d, s%d, '%c', %d);\n",
+              a, a, b, operator_of(op), line);
+      break;
+    case OP_MODULO:
+    case OP_SHIFTLEFT:
+    case OP_SHIFTRIGHT:
+    case OP_BITOR:
+    case OP_BITXOR:
+    case OP_BITAND:
+      fprintf(out, "  s%d = lox_bitwise(s%d, s%d, '%c', %d);\n",
+              a, a, b, operator_of(op), line);
+      break;
+    case OP_ADD_NUMERIC:
+    case OP_SUBTRACT_NUMERIC:
+    case OP_MULTIPLY_NUMERIC:
+    case OP_DIVIDE_NUMERIC:
+      fprintf(out, "  s%d = lox_arith(s%d, s%d, '%c');\n", a, a, b, operator_of(op));
+      break;
+    case OP_ADD_DOUBLE:
+    case OP_SUBTRACT_DOUBLE:
+    case OP_MULTIPLY_DOUBLE:
+    case OP_DIVIDE_DOUBLE:
+      fprintf(out, "  s%d = NUMBER_VAL(AS_NUMBER(s%d) %c AS_NUMBER(s%d));\n",
+              a, a, operator_of(op), b);
+      break;
+    case OP_NEGATE:
+      fprintf(out, "  s%d = lox_negate(s%d, %d);\n", b, b, line);
+      break;
+    case OP_NEGATE_NUMERIC:
+      fprintf(out, "  s%d = IS_INTEGER(s%d) ? subtract_integers(0, AS_INTEGER(s%d))"
+                   " : NUMBER_VAL(-AS_NUMBER(s%d));\n", b, b, b, b);
+      break;
+    case OP_NEGATE_DOUBLE:
+      fprintf(out, "  s%d = NUMBER_VAL(-AS_NUMBER(s%d));\n", b, b);
+      break;
+    case OP_BITNOT:
+      fprintf(out, "  s%d = lox_bitnot(s%d, %d);\n", b, b, line);
+      break;
+    case OP_NOT:
+      fprintf(out, "  s%d = BOOL_VAL(is_falsy(s%d));\n", b, b);
+      break;
+    case OP_EQUAL:
+      fprintf(out, "  s%d = BOOL_VAL(values_equal(s%d, s%d));\n", a, a, b);
+      break;
+    case OP_GREATER:
+    case OP_LESS:
+      fprintf(out, "  s%d = BOOL_VAL(lox_checked_compare(s%d, s%d, '%c', %d));\n",
+              a, a, b, op == OP_GREATER ? '>' : '<', line);
+      break;
+    case OP_GREATER_NUMERIC:
+    case OP_LESS_NUMERIC:
+      fprintf(out, "  s%d = BOOL_VAL(lox_compare(s%d, s%d, '%c'));\n",
+              a, a, b, op == OP_GREATER_NUMERIC ? '>' : '<');
+      break;
+    case OP_GREATER_DOUBLE:
+    case OP_LESS_DOUBLE:
+      fprintf(out, "  s%d = BOOL_VAL(AS_NUMBER(s%d) %c AS_NUMBER(s%d));\n",
+              a, a, operator_of(op), b);
+      break;
+    case OP_PRINT:
+      fprintf(out, "  print_value(s%d);\n  puts(\"\");\n", b);
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      fprintf(out, "  goto L%d;\n", jump_target(c, offs));
+      break;
+    case OP_RETURN:
+      fputs("  return 0;\n", out);
+      break;
+    default:
+      fputs("  if (", out);
+      emit_condition(out, op, h, line);
+      fprintf(out, ") goto L%d;\n", jump_target(c, offs));
+      break;
+  }
+}
+
+// Compiles source and writes it to out as a C program, name being the
+// script it came from. Returns false on compile errors.
+bool emit_c(vm* cvm, const char* source, const char* name, FILE* out) {
+  arena a;
+  chunk c;
+  init_chunk(&c);
+  c.arena = &a;
+  if (!init_arena(&a, COMPILE_ARENA_SIZE(strlen(source))) || !compile(cvm, source, &c)) {
+    if (a.failed) fputs("Out of memory.\n", stderr);
+    free_chunk(&c);
+    free_arena(&a);
+    cvm->c = NULL;
+    return false;
+  }
+
+  int* heights = ALLOCATE(int, c.count);
+  bool* targets = ALLOCATE(bool, c.count);
+  int max = stack_heights(&c, heights);
+  int globals = cvm->global_values.count;
+
+  for (int offs = 0; offs < c.count; offs++) targets[offs] = false;
+  for (int offs = 0; offs < c.count; offs += instruction_length(c.code[offs])) {
+    int target = jump_target(&c, offs);
+    if (heights[offs] != -1 && target != -1) targets[target] = true;
+  }
+
+  fprintf(out, "// Translated from %s by clox --emit-c.\n", name);
+  fputs(prelude, out);
+
+  if (globals) {
+    fprintf(out, "static value globals[%d];\n", globals);
+    fprintf(out, "static const char* global_names[%d] = {\n", globals);
+    for (int i = 0; i < globals; i++) {
+      obj_str* global_name = AS_STRING(cvm->global_names.values[i]);
+      fputs("  ", out);
+      emit_string(out, global_name->chars, global_name->len);
+      fputs(",\n", out);
+    }
+    fputs("};\n", out);
+  }
+  bool objects = false;
+  for (int i = 0; i < c.constants.count; i++) objects |= IS_OBJ(c.constants.values[i]);
+  if (objects) fprintf(out, "static value constants[%d];\n", c.constants.count);
+  fprintf(out, "static value lox_frame[%d];\n", max ? max : 1);
+
+  fputs("\nint main(void) {\n", out);
+  // Integers are boxed for the VM the thread allocates for.
+  fputs("  charge_to(&lox_vm);\n", out);
+  fputs("  init_table(&lox_vm.strings);\n", out);
+  fputs("  lox_vm.stack_top = lox_vm.stack;\n", out);
+  fputs("  lox_vm.next_gc = GC_INITIAL_THRESHOLD;\n", out);
+  fputs("  lox_vm.gc_growth = GC_GROWTH;\n", out);
+  fputs("  lox_vm.frame = lox_frame;\n", out);
+  fputs("  lox_vm.c = &lox_chunk;\n", out);
+  if (globals) {
+    fprintf(out, "  for (int i = 0; i < %d; i++) globals[i] = UNDEFINED_VAL;\n", globals);
+    fputs("  lox_vm.global_values.values = globals;\n", out);
+    fprintf(out, "  lox_vm.global_values.count = %d;\n", globals);
+  }
+  if (objects) {
+    fputs("  lox_chunk.constants.values = constants;\n", out);
+    fprintf(out, "  lox_chunk.constants.count = %d;\n", c.constants.count);
+  }
+
+  for (int i = 0; i < c.constants.count; i++) {
+    value v = c.constants.values[i];
+    if (IS_INTEGER(v) && IS_OBJ(v)) {
+      fprintf(out, "  constants[%d] = INTEGER_VAL(INT64_C(%" PRId64 "));\n", i, AS_INTEGER(v));
+    }
+    if (!IS_STRING(v)) continue;
+    fprintf(out, "  constants[%d] = OBJ_VAL(copy_str(&lox_vm, ", i);
+    emit_string(out, AS_CSTRING(v), AS_STRING(v)->len);
+    fprintf(out, ", %d));\n", AS_STRING(v)->len);
+  }
+  for (int i = 0; i < max; i++) fprintf(out, "  value s%d = NIL_VAL;\n", i);
+  fputs("\n", out);
+
+  for (int offs = 0; offs < c.count; offs += instruction_length(c.code[offs])) {
+    if (heights[offs] == -1) continue;
+    if (targets[offs]) fprintf(out, "L%d:\n", offs);
+    emit_instruction(out, &c, offs, heights[offs]);
+  }
+
+  fputs("}\n", out);
+
+  FREE_ARRAY(int, heights, c.count);
+  FREE_ARRAY(bool, targets, c.count);
+  free_chunk(&c);
+  free_arena(&a);
+  cvm->c = NULL;
+  return true;
+}
@@ -0,0 +1,10 @@
+#ifndef clox_emit_c_h
+#define clox_emit_c_h
+
+#include <stdio.h>
+
+#include "vm.h"
+
+bool emit_c(vm*, const char*, const char*, FILE*);
+
+#endif
@@ -1,89 +1,160 @@
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "common.h"
 #include "memory.h"
 #include "hash.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef SSE2
+#include <emmintrin.h>
+#endif
+
+#define GROUP_SIZE 16
+#define EMPTY 0x80
+#define DELETED 0xfe
+#define IS_FULL(ctrl) (!((ctrl) & 0x80))
+#define FRAGMENT(hash) ((hash) & 0x7f)
 
 void init_table(table* t) {
   t->count = 0;
+  t->deleted = 0;
   t->capacity = 0;
+  t->ctrl = NULL;
   t->entries = NULL;
 }
 
-static entry* find_entry(entry* entries, int capacity, obj_str* key) {
-  uint32_t i = key->hash % capacity;
-  entry* tombstone = NULL;
-  while(1) {
-    entry* e = entries+i;
+// Which entries of the group at ctrl have the control byte c, one bit each.
+static uint32_t match(const uint8_t* ctrl, uint8_t c) {
+#ifdef SSE2
+  __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)c)));
+#else
+  uint32_t bits = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) bits |= (uint32_t)(ctrl[i] == c) << i;
+  return bits;
+#endif
+}
+
+// Which entries of the group at ctrl are empty or deleted.
+static uint32_t match_free(const uint8_t* ctrl) {
+#ifdef SSE2
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+  uint32_t bits = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) bits |= (uint32_t)!IS_FULL(ctrl[i]) << i;
+  return bits;
+#endif
+}
+
+// Groups are probed in triangular steps from the one the hash picks, which
+// visits every group of a power of two of them. A key is looked for no
+// further than the first group with an empty entry, so deleting leaves a
+// tombstone only in groups without one.
+static uint32_t first_group(table* t, uint32_t hash) {
+  return (hash >> 7) & (t->capacity / GROUP_SIZE - 1);
+}
+
+static uint32_t next_group(table* t, uint32_t g, uint32_t step) {
+  return (g + step) & (t->capacity / GROUP_SIZE - 1);
+}
+
+// The index of key, or -1.
+static int find_key(table* t, obj_str* key) {
+  if (!t->capacity) return -1;
 
-    if (e->key == key) {
-      return e;
-    } else if (!e->key) {
-      if (IS_NIL(e->val)) return tombstone ? tombstone : e;
-      else if (!tombstone) tombstone = e;
+  for (uint32_t g = first_group(t, key->hash), step = 1;; g = next_group(t, g, step++)) {
+    uint8_t* ctrl = t->ctrl + g * GROUP_SIZE;
+    for (uint32_t m = match(ctrl, FRAGMENT(key->hash)); m; m &= m - 1) {
+      int at = g * GROUP_SIZE + __builtin_ctz(m);
+      if (t->entries[at].key == key) return at;
     }
+    if (match(ctrl, EMPTY)) return -1;
+  }
+}
 
-    i = (i+1) % capacity;
+// The first entry a new key of that hash can go in.
+static int find_free(table* t, uint32_t hash) {
+  for (uint32_t g = first_group(t, hash), step = 1;; g = next_group(t, g, step++)) {
+    uint32_t bits = match_free(t->ctrl + g * GROUP_SIZE);
+    if (bits) return g * GROUP_SIZE + __builtin_ctz(bits);
   }
 }
 
-static void adjust_capacity(table* t, int cap) {
-  entry* entries = ALLOCATE(entry, cap);
+static void put(table* t, int at, obj_str* key, value v) {
+  if (t->ctrl[at] == DELETED) t->deleted--;
+  t->ctrl[at] = FRAGMENT(key->hash);
+  t->entries[at].key = key;
+  t->entries[at].val = v;
+  t->count++;
+}
 
-  for (int i = 0; i < cap; i++) {
-    entries[i].key = NULL;
-    entries[i].val = NIL_VAL;
-  }
+// The control bytes follow the entries in the same block.
+static size_t table_size(int cap) {
+  return (sizeof(entry) + 1) * (size_t)cap;
+}
 
+static void adjust_capacity(table* t, int cap) {
+  table old = *t;
+
+  t->entries = (entry*)ALLOCATE_AS(HEAP_TABLES, uint8_t, table_size(cap));
+  t->ctrl = (uint8_t*)(t->entries + cap);
+  t->capacity = cap;
   t->count = 0;
-  for (int i = 0; i < t->capacity; i++) {
-    entry* e = t->entries+i;
-    if (!e->key) continue;
+  t->deleted = 0;
+  memset(t->ctrl, EMPTY, cap);
 
-    entry* d = find_entry(entries, cap, e->key);
-    d->key = e->key;
-    d->val = e->val;
-    t->count++;
+  for (int i = 0; i < old.capacity; i++) {
+    if (!IS_FULL(old.ctrl[i])) continue;
+    entry* e = old.entries+i;
+    put(t, find_free(t, e->key->hash), e->key, e->val);
   }
 
-  FREE_ARRAY(value, t->entries, t->capacity);
-  t->entries = entries;
-  t->capacity = cap;
+  FREE_ARRAY_AS(HEAP_TABLES, uint8_t, old.entries, table_size(old.capacity));
 }
 
 bool table_set(table* t, obj_str* key, value v) {
-  if (t->count+1 > t->capacity*TABLE_MAX_LOAD) adjust_capacity(t, GROW_CAPACITY(t->capacity));
-  entry* e = find_entry(t->entries, t->capacity, key);
-  bool is_new_key = !e->key;
-  e->key = key;
-  e->val = v;
+  int at = find_key(t, key);
+  if (at != -1) {
+    t->entries[at].val = v;
+    return false;
+  }
+
+  // Entries are at most seven eighths full, tombstones included.
+  if (t->count + t->deleted + 1 > t->capacity / 8 * 7) {
+    // The intern table loses most of its keys to the collector, and the
+    // tombstones they leave behind only need rehashing away.
+    bool grow = t->count >= t->capacity / 2;
+    adjust_capacity(t, grow ? (t->capacity ? t->capacity * 2 : GROUP_SIZE) : t->capacity);
+  }
 
-  if (is_new_key) t->count++;
-  return is_new_key;
+  put(t, find_free(t, key->hash), key, v);
+  return true;
 }
 
 bool table_get(table* t, obj_str* key, value* v) {
-  if (!t->entries) return false;
-
-  entry* e = find_entry(t->entries, t->capacity, key);
-  if (!e->key) return false;
+  int at = find_key(t, key);
+  if (at == -1) return false;
 
-  *v = e->val;
+  *v = t->entries[at].val;
   return true;
 }
 
 bool table_delete(table* t, obj_str* key) {
-  if (!t->count) return false;
-
-  entry* e = find_entry(t->entries, t->capacity, key);
-
-  if (!e->key) return false;
+  int at = find_key(t, key);
+  if (at == -1) return false;
 
-  e->key = NULL;
-  e->val = BOOL_VAL(true);
+  if (match(t->ctrl + at / GROUP_SIZE * GROUP_SIZE, EMPTY)) {
+    t->ctrl[at] = EMPTY;
+  } else {
+    t->ctrl[at] = DELETED;
+    t->deleted++;
+  }
+  t->entries[at].key = NULL;
+  t->count--;
 
   return true;
 }
@@ -91,28 +162,160 @@ bool table_delete(table* t, obj_str* key) {
 void table_add_all(table* from, table* to) {
   for (int i = 0; i < from->capacity; i++) {
     entry* e = from->entries+i;
-    if (e->key) table_set(to, e->key, e->val);
+    if (IS_FULL(from->ctrl[i])) table_set(to, e->key, e->val);
   }
 }
 
 void free_table(table* t) {
-  FREE_ARRAY(entry, t->entries, t->capacity);
+  FREE_ARRAY_AS(HEAP_TABLES, uint8_t, t->entries, table_size(t->capacity));
   init_table(t);
 }
 
 obj_str* table_find_str(table* t, const char* chars, int len, uint32_t hash) {
-  if (!t->entries) return NULL;
+  if (!t->capacity) return NULL;
 
-  uint32_t i = hash % t->capacity;
+  for (uint32_t g = first_group(t, hash), step = 1;; g = next_group(t, g, step++)) {
+    uint8_t* ctrl = t->ctrl + g * GROUP_SIZE;
+    for (uint32_t m = match(ctrl, FRAGMENT(hash)); m; m &= m - 1) {
+      obj_str* key = t->entries[g * GROUP_SIZE + __builtin_ctz(m)].key;
+      if (key->hash == hash && key->len == len && !memcmp(key->chars, chars, len)) return key;
+    }
+    if (match(ctrl, EMPTY)) return NULL;
+  }
+}
+
+void mark_table(table* t) {
+  for (int i = 0; i < t->capacity; i++) {
+    entry* e = t->entries+i;
+    if (!IS_FULL(t->ctrl[i])) continue;
+    mark_value(OBJ_VAL(e->key));
+    mark_value(e->val);
+  }
+}
 
-  while (1) {
+// Drops the keys the collector is about to free.
+void table_remove_white(table* t) {
+  for (int i = 0; i < t->capacity; i++) {
     entry* e = t->entries+i;
+    if (IS_FULL(t->ctrl[i]) && !e->key->o.marked) table_delete(t, e->key);
+  }
+}
+
+// Points the entry of key at a copy of it, which hashes the same.
+void table_move_key(table* t, obj_str* key, obj_str* copy) {
+  int at = find_key(t, key);
+  if (at != -1) t->entries[at].key = copy;
+}
+
+// Strings are hashed in the manner of wyhash: sixteen bytes at a time go
+// into the state through a 64x64->128-bit multiply, and past 48 bytes into
+// three states at once, whose multiplies overlap. Up to 16 bytes take two
+// reads from either end and no loop. Every state starts from a seed picked
+// once per process, so which strings collide cannot be worked out ahead of
+// time.
+static const uint64_t prime[4] = {
+  0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+static uint64_t read64(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t read32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Replaces a and b with the low and high halves of their product.
+static void multiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+  __extension__ unsigned __int128 r = (unsigned __int128)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ah = *a >> 32, al = (uint32_t)*a, bh = *b >> 32, bl = (uint32_t)*b;
+  uint64_t hl = ah * bl, lh = al * bh, ll = al * bl;
+  uint64_t mid = (ll >> 32) + (uint32_t)hl + (uint32_t)lh;
+  *b = ah * bh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+  *a = ll + (hl << 32) + (lh << 32);
+#endif
+}
+
+// The halves of a*b, xored.
+static uint64_t mix(uint64_t a, uint64_t b) {
+  multiply(&a, &b);
+  return a ^ b;
+}
+
+static _Atomic uint64_t process_seed;
 
-    if (!e->key) return NULL;
-    if (e->key->len == len && !memcmp(e->key->chars, chars, len)) return e->key;
+static uint64_t random_seed(void) {
+  uint64_t s = 0;
+  FILE* f = fopen("/dev/urandom", "rb");
+  if (f) {
+    if (fread(&s, sizeof(s), 1, f) != 1) s = 0;
+    fclose(f);
+  }
+  // Where the stack and the binary landed is some entropy still.
+  if (!s) s = mix((uint64_t)time(NULL) ^ (uintptr_t)&s, (uintptr_t)&process_seed ^ prime[0]);
+  return mix(s ^ prime[0], prime[1]);
+}
 
-    i = (i + 1) % t->capacity;
+// Zero stands for not picked yet. If two threads race to pick it, they both
+// end up with the one that got there first.
+static uint64_t seed(void) {
+  uint64_t s = atomic_load_explicit(&process_seed, memory_order_relaxed);
+  if (s) return s;
+
+  uint64_t fresh = random_seed() | 1;
+  return atomic_compare_exchange_strong(&process_seed, &s, fresh) ? fresh : s;
+}
+
+uint32_t hash_string(const char* key, int length) {
+  const char* p = key;
+  size_t len = (size_t)length;
+  uint64_t s = seed(), a, b;
+
+  if (len <= 16) {
+    if (len >= 4) {
+      // Two overlapping reads from each end cover everything in between.
+      size_t mid = (len >> 3) << 2;
+      a = read32(p) << 32 | read32(p + mid);
+      b = read32(p + len - 4) << 32 | read32(p + len - 4 - mid);
+    } else if (len) {
+      a = (uint64_t)(uint8_t)p[0] << 16 | (uint64_t)(uint8_t)p[len >> 1] << 8 | (uint8_t)p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t s1 = s, s2 = s;
+      do {
+        s = mix(read64(p) ^ prime[1], read64(p + 8) ^ s);
+        s1 = mix(read64(p + 16) ^ prime[2], read64(p + 24) ^ s1);
+        s2 = mix(read64(p + 32) ^ prime[3], read64(p + 40) ^ s2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      s ^= s1 ^ s2;
+    }
+    while (i > 16) {
+      s = mix(read64(p) ^ prime[1], read64(p + 8) ^ s);
+      p += 16;
+      i -= 16;
+    }
+    a = read64(p + i - 16);
+    b = read64(p + i - 8);
   }
 
-  return NULL;
+  a ^= prime[1];
+  b ^= s;
+  multiply(&a, &b);
+  uint64_t h = mix(a ^ prime[0] ^ len, b ^ prime[1]);
+  return (uint32_t)(h ^ h >> 32);
 }
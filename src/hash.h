@@ -9,9 +9,15 @@ typedef struct {
   value val;
 } entry;
 
+// Open addressing over a power of two of entries, in groups of 16. Every
+// entry has a control byte, kept apart from the entries so a whole group of
+// them can be matched at once: empty, deleted, or for a full entry the low
+// seven bits of its key's hash.
 typedef struct {
   int count;
+  int deleted;
   int capacity;
+  uint8_t* ctrl;
   entry* entries;
 } table;
 
@@ -21,5 +27,9 @@ bool table_get(table*, obj_str*, value*);
 bool table_delete(table*, obj_str*);
 void table_add_all(table*, table*);
 obj_str* table_find_str(table*, const char*, int, uint32_t);
+void mark_table(table*);
+void table_remove_white(table*);
+void table_move_key(table*, obj_str*, obj_str*);
 void free_table(table*);
+uint32_t hash_string(const char*, int);
 #endif
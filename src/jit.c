@@ -0,0 +1,1441 @@
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "debug.h"
+#include "jit.h"
+#include "memory.h"
+
+void init_jit_code(jit_code* jc) {
+  jc->code = NULL;
+  jc->size = 0;
+}
+
+#ifdef JIT
+
+void free_jit_code(jit_code* jc) {
+  if (jc->code) munmap(jc->code, jc->size);
+  init_jit_code(jc);
+}
+
+// The baseline JIT. Every instruction of the stack code is translated on its
+// own into a template of machine code. The heights of the stack are known at
+// compile time, so stack slots become fixed offsets from the base of the VM
+// stack, and what the templates cannot do inline they leave to the runtime
+// helpers below, which raise the same errors the interpreter does.
+
+// Boxing an integer cannot collect, and machine code only ever boxes in the
+// helpers, so they collect once they are done, should boxes have taken the
+// heap past next_gc. Everything live is on the stack below top then.
+static void collect_if_due(vm* cvm, value* top) {
+  if (cvm->bytes_allocated <= cvm->next_gc) return;
+  cvm->stack_top = top;
+  collect_garbage(cvm);
+}
+
+static bool jit_arith(vm* cvm, value* operands, int op, int offs) {
+  value a = operands[0];
+  value b = operands[1];
+
+  if (op == OP_ADD) {
+    cvm->stack_top = operands + 2;
+    const char* error = add_values(cvm, offs);
+    if (error) runtime_error(cvm, offs, "%s", error);
+    else collect_if_due(cvm, operands + 1);
+    return !error;
+  }
+
+  if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+    runtime_error(cvm, offs, "Operands must be numbers.");
+    return false;
+  }
+
+  bool integers = ARE_INTEGERS(a, b);
+  switch (op) {
+    case OP_SUBTRACT:
+      operands[0] = integers ? subtract_integers(AS_INTEGER(a), AS_INTEGER(b))
+                             : NUMBER_VAL(to_number(a) - to_number(b));
+      break;
+    case OP_MULTIPLY:
+      operands[0] = integers ? multiply_integers(AS_INTEGER(a), AS_INTEGER(b))
+                             : NUMBER_VAL(to_number(a) * to_number(b));
+      break;
+    case OP_DIVIDE:
+      operands[0] = NUMBER_VAL(to_number(a) / to_number(b));
+      break;
+    case OP_MODULO:
+      if (!to_integer(b)) {
+        runtime_error(cvm, offs, "Modulo by zero.");
+        return false;
+      }
+      operands[0] = modulo_integers(to_integer(a), to_integer(b));
+      break;
+    case OP_SHIFTLEFT:
+    case OP_SHIFTRIGHT:
+      operands[0] = shift_integer(to_integer(a), to_integer(b), op == OP_SHIFTLEFT);
+      break;
+    case OP_BITOR:  operands[0] = INTEGER_VAL(to_integer(a) | to_integer(b)); break;
+    case OP_BITXOR: operands[0] = INTEGER_VAL(to_integer(a) ^ to_integer(b)); break;
+    case OP_BITAND: operands[0] = INTEGER_VAL(to_integer(a) & to_integer(b)); break;
+  }
+
+  collect_if_due(cvm, operands + 1);
+  return true;
+}
+
+// Returns whether a > b, or a < b for OP_LESS, and -1 on error.
+static int jit_compare(vm* cvm, value* operands, int op, int offs) {
+  value a = operands[0];
+  value b = operands[1];
+
+  if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+    runtime_error(cvm, offs, "Operands must be numbers.");
+    return -1;
+  }
+
+  if (ARE_INTEGERS(a, b)) {
+    return op == OP_GREATER ? AS_INTEGER(a) > AS_INTEGER(b)
+                            : AS_INTEGER(a) < AS_INTEGER(b);
+  }
+
+  return op == OP_GREATER ? to_number(a) > to_number(b)
+                          : to_number(a) < to_number(b);
+}
+
+static bool jit_unary(vm* cvm, value* operand, int op, int offs) {
+  value a = *operand;
+
+  if (op == OP_NEGATE) {
+    if (IS_INTEGER(a)) *operand = subtract_integers(0, AS_INTEGER(a));
+    else if (IS_NUMBER(a)) *operand = NUMBER_VAL(-AS_NUMBER(a));
+    else {
+      runtime_error(cvm, offs, "Operand to '-' must be a number.");
+      return false;
+    }
+  } else {
+    if (!IS_NUMERIC(a)) {
+      runtime_error(cvm, offs, "Operand to '~' must be a number.");
+      return false;
+    }
+    *operand = INTEGER_VAL(~to_integer(a));
+  }
+
+  collect_if_due(cvm, operand + 1);
+  return true;
+}
+
+static void jit_global_error(vm* cvm, int slot, int op, int offs) {
+  runtime_error(cvm, offs, op == OP_DEFINE_GLOBAL ? "Redefined variable '%s'."
+                                                  : "Undefined variable '%s'.",
+                AS_CSTRING(cvm->global_names.values[slot]));
+}
+
+static void jit_print(value v) {
+  print_value(v);
+  puts("");
+}
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Condition codes, as encoded in jcc and setcc.
+enum {
+  CC_O = 0x0,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_A = 0x7,
+  CC_NP = 0xb,
+  CC_L = 0xc,
+  CC_G = 0xf,
+};
+
+// Opcodes of the two-register forms of the ALU instructions.
+enum {
+  ALU_ADD = 0x01,
+  ALU_OR = 0x09,
+  ALU_AND = 0x21,
+  ALU_SUB = 0x29,
+  ALU_XOR = 0x31,
+  ALU_CMP = 0x39,
+  ALU_MOV = 0x89,
+};
+
+enum { SHL = 4, SHR = 5, SAR = 7 };
+
+// Generated code keeps the base of the VM stack in rbx and the VM in r12,
+// along with the masks values are told apart by: the integer test in r13
+// and r14, and QNAN, which no double has all of, in r15.
+#define STACK_BASE RBX
+#define INTEGER_MASK R13
+#define INTEGER_BITS R14
+#define QNAN_BITS R15
+
+typedef struct {
+  int at;
+  int target;
+} fixup;
+
+typedef struct {
+  chunk* c;
+  vm* cvm;
+  uint8_t* code;
+  int count;
+  int capacity;
+  // Where the code for every instruction starts. The one past the end of the
+  // chunk is where failed instructions go.
+  int* labels;
+  fixup* fixups;
+  int fixup_count;
+  int fixup_capacity;
+} assembler;
+
+// Jumps within a template that are bound together once their target is.
+typedef struct {
+  int at[4];
+  int count;
+} jump_list;
+
+static void emit_byte(assembler* as, uint8_t byte) {
+  if (as->capacity < as->count + 1) {
+    int oldc = as->capacity;
+    as->capacity = GROW_CAPACITY(oldc);
+    as->code = GROW_ARRAY(as->code, uint8_t, oldc, as->capacity);
+  }
+
+  as->code[as->count++] = byte;
+}
+
+static void emit_u32(assembler* as, uint32_t v) {
+  for (int i = 0; i < 4; i++) emit_byte(as, (v >> (8*i)) & 0xff);
+}
+
+static void emit_u64(assembler* as, uint64_t v) {
+  for (int i = 0; i < 8; i++) emit_byte(as, (v >> (8*i)) & 0xff);
+}
+
+static void rex_w(assembler* as, int reg, int rm) {
+  emit_byte(as, 0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3));
+}
+
+static void modrm_reg(assembler* as, int reg, int rm) {
+  emit_byte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [base + disp32]. Bases that share their low bits with rsp need a SIB byte.
+static void modrm_mem(assembler* as, int reg, int base, int disp) {
+  emit_byte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emit_byte(as, 0x24);
+  emit_u32(as, (uint32_t)disp);
+}
+
+static void load(assembler* as, int reg, int base, int disp) {
+  rex_w(as, reg, base);
+  emit_byte(as, 0x8b);
+  modrm_mem(as, reg, base, disp);
+}
+
+static void store(assembler* as, int base, int disp, int reg) {
+  rex_w(as, reg, base);
+  emit_byte(as, 0x89);
+  modrm_mem(as, reg, base, disp);
+}
+
+static void lea(assembler* as, int reg, int base, int disp) {
+  rex_w(as, reg, base);
+  emit_byte(as, 0x8d);
+  modrm_mem(as, reg, base, disp);
+}
+
+static void load_immediate(assembler* as, int reg, uint64_t imm) {
+  emit_byte(as, 0x48 | ((reg & 8) >> 3));
+  emit_byte(as, 0xb8 + (reg & 7));
+  emit_u64(as, imm);
+}
+
+// mov to one of the argument registers below r8, zero extending.
+static void load_immediate32(assembler* as, int reg, uint32_t imm) {
+  emit_byte(as, 0xb8 + reg);
+  emit_u32(as, imm);
+}
+
+static void alu(assembler* as, uint8_t op, int dst, int src) {
+  rex_w(as, src, dst);
+  emit_byte(as, op);
+  modrm_reg(as, src, dst);
+}
+
+static void imul(assembler* as, int dst, int src) {
+  rex_w(as, dst, src);
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0xaf);
+  modrm_reg(as, dst, src);
+}
+
+static void shift(assembler* as, int kind, int reg, uint8_t count) {
+  rex_w(as, 0, reg);
+  emit_byte(as, 0xc1);
+  modrm_reg(as, kind, reg);
+  emit_byte(as, count);
+}
+
+static void movq_to_xmm(assembler* as, int xmm, int reg) {
+  emit_byte(as, 0x66);
+  rex_w(as, xmm, reg);
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0x6e);
+  modrm_reg(as, xmm, reg);
+}
+
+static void movq_from_xmm(assembler* as, int reg, int xmm) {
+  emit_byte(as, 0x66);
+  rex_w(as, xmm, reg);
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0x7e);
+  modrm_reg(as, xmm, reg);
+}
+
+// The scalar double instructions, addsd and friends behind F2 and ucomisd
+// behind 66.
+static void sse(assembler* as, uint8_t prefix, uint8_t op, int x, int y) {
+  emit_byte(as, prefix);
+  emit_byte(as, 0x0f);
+  emit_byte(as, op);
+  modrm_reg(as, x, y);
+}
+
+// setcc into one of the byte registers below spl.
+static void setcc(assembler* as, int cc, int reg) {
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0x90 | cc);
+  modrm_reg(as, 0, reg);
+}
+
+static void call(assembler* as, uint64_t fn) {
+  load_immediate(as, RAX, fn);
+  emit_byte(as, 0xff);
+  modrm_reg(as, 2, RAX);
+}
+
+static void push_reg(assembler* as, int reg) {
+  if (reg & 8) emit_byte(as, 0x41);
+  emit_byte(as, 0x50 + (reg & 7));
+}
+
+static void pop_reg(assembler* as, int reg) {
+  if (reg & 8) emit_byte(as, 0x41);
+  emit_byte(as, 0x58 + (reg & 7));
+}
+
+// Forward jumps within a template return where their displacement goes, for
+// bind to fill in.
+static int jcc(assembler* as, int cc) {
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0x80 | cc);
+  emit_u32(as, 0);
+  return as->count - 4;
+}
+
+static int jmp(assembler* as) {
+  emit_byte(as, 0xe9);
+  emit_u32(as, 0);
+  return as->count - 4;
+}
+
+static void bind(assembler* as, int at) {
+  uint32_t rel = (uint32_t)(as->count - (at + 4));
+  memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+static void add_jump(jump_list* list, int at) {
+  list->at[list->count++] = at;
+}
+
+static void bind_all(assembler* as, jump_list* list) {
+  for (int i = 0; i < list->count; i++) bind(as, list->at[i]);
+}
+
+// Jumps to the code of another instruction, resolved once it is all there.
+static void add_fixup(assembler* as, int at, int target) {
+  if (as->fixup_capacity < as->fixup_count + 1) {
+    int oldc = as->fixup_capacity;
+    as->fixup_capacity = GROW_CAPACITY(oldc);
+    as->fixups = GROW_ARRAY(as->fixups, fixup, oldc, as->fixup_capacity);
+  }
+
+  as->fixups[as->fixup_count].at = at;
+  as->fixups[as->fixup_count].target = target;
+  as->fixup_count++;
+}
+
+static void jcc_to(assembler* as, int cc, int target) {
+  add_fixup(as, jcc(as, cc), target);
+}
+
+static void jmp_to(assembler* as, int target) {
+  add_fixup(as, jmp(as), target);
+}
+
+static void fail_if(assembler* as, int cc) {
+  jcc_to(as, cc, as->c->count);
+}
+
+static int slot(int i) {
+  return i * (int)sizeof(value);
+}
+
+static void prologue(assembler* as) {
+  push_reg(as, RBP);
+  alu(as, ALU_MOV, RBP, RSP);
+  push_reg(as, RBX);
+  push_reg(as, R12);
+  push_reg(as, R13);
+  push_reg(as, R14);
+  push_reg(as, R15);
+  // Keep the stack aligned to 16 bytes for the helpers.
+  rex_w(as, 0, RSP);
+  emit_byte(as, 0x83);
+  modrm_reg(as, 5, RSP);
+  emit_byte(as, 8);
+
+  alu(as, ALU_MOV, R12, RDI);
+  alu(as, ALU_MOV, STACK_BASE, RSI);
+  load_immediate(as, INTEGER_MASK, SIGN_BIT | QNAN | INTEGER_TAG);
+  load_immediate(as, INTEGER_BITS, QNAN | INTEGER_TAG);
+  load_immediate(as, QNAN_BITS, QNAN);
+}
+
+static void epilogue(assembler* as) {
+  rex_w(as, 0, RSP);
+  emit_byte(as, 0x83);
+  modrm_reg(as, 0, RSP);
+  emit_byte(as, 8);
+  pop_reg(as, R15);
+  pop_reg(as, R14);
+  pop_reg(as, R13);
+  pop_reg(as, R12);
+  pop_reg(as, RBX);
+  pop_reg(as, RBP);
+  emit_byte(as, 0xc3);
+}
+
+static void copy(assembler* as, int from, int to) {
+  load(as, RAX, STACK_BASE, slot(from));
+  store(as, STACK_BASE, slot(to), RAX);
+}
+
+static void load_value(assembler* as, value v, int to) {
+  load_immediate(as, RAX, v);
+  store(as, STACK_BASE, slot(to), RAX);
+}
+
+// Calls helper(vm, &stack[x], op, offs), which the helpers above all take
+// but jit_global_error, whose second argument is the slot of the global.
+static void call_helper(assembler* as, uint64_t helper, int x, int op, int offs) {
+  alu(as, ALU_MOV, RDI, R12);
+  lea(as, RSI, STACK_BASE, slot(x));
+  load_immediate32(as, RDX, op);
+  load_immediate32(as, RCX, offs);
+  call(as, helper);
+}
+
+// Jumps away unless both rax and rcx hold integers.
+static int unless_integers(assembler* as) {
+  alu(as, ALU_MOV, RDX, RAX);
+  alu(as, ALU_AND, RDX, RCX);
+  alu(as, ALU_AND, RDX, INTEGER_MASK);
+  alu(as, ALU_CMP, RDX, INTEGER_BITS);
+  return jcc(as, CC_NE);
+}
+
+static int unless_number(assembler* as, int reg) {
+  alu(as, ALU_MOV, RDX, reg);
+  alu(as, ALU_AND, RDX, QNAN_BITS);
+  alu(as, ALU_CMP, RDX, QNAN_BITS);
+  return jcc(as, CC_E);
+}
+
+static void unbox_integer(assembler* as, int reg) {
+  shift(as, SHL, reg, 16);
+  shift(as, SAR, reg, 16);
+}
+
+// Boxes the integer in rax, jumping to slow when it does not fit the payload.
+static void box_integer(assembler* as, jump_list* slow) {
+  alu(as, ALU_MOV, RDX, RAX);
+  unbox_integer(as, RDX);
+  alu(as, ALU_CMP, RDX, RAX);
+  add_jump(slow, jcc(as, CC_NE));
+  shift(as, SHL, RAX, 16);
+  shift(as, SHR, RAX, 16);
+  alu(as, ALU_OR, RAX, INTEGER_BITS);
+}
+
+static uint8_t sse_op(uint8_t op) {
+  switch (op) {
+    case OP_ADD:      return 0x58;
+    case OP_MULTIPLY: return 0x59;
+    case OP_SUBTRACT: return 0x5c;
+    default:          return 0x5e;
+  }
+}
+
+// The binary operators on slots x and x+1. Integers and doubles are worked
+// out inline, everything else, from overflows to string concatenation, by
+// jit_arith. Operands known to be doubles need no checks at all.
+static void arithmetic(assembler* as, uint8_t op, bool doubles, int x, int offs) {
+  jump_list slow = { .count = 0 };
+  int stored = -1;
+
+  if (op != OP_ADD && op != OP_SUBTRACT && op != OP_MULTIPLY && op != OP_DIVIDE) {
+    call_helper(as, (uint64_t)(uintptr_t)jit_arith, x, op, offs);
+    emit_byte(as, 0x84);
+    emit_byte(as, 0xc0);
+    fail_if(as, CC_E);
+    return;
+  }
+
+  load(as, RAX, STACK_BASE, slot(x));
+  load(as, RCX, STACK_BASE, slot(x+1));
+
+  if (!doubles) {
+    if (op != OP_DIVIDE) {
+      int not_integers = unless_integers(as);
+      unbox_integer(as, RAX);
+      unbox_integer(as, RCX);
+      if (op == OP_MULTIPLY) {
+        imul(as, RAX, RCX);
+        add_jump(&slow, jcc(as, CC_O));
+      } else {
+        alu(as, op == OP_ADD ? ALU_ADD : ALU_SUB, RAX, RCX);
+      }
+      box_integer(as, &slow);
+      stored = jmp(as);
+      bind(as, not_integers);
+    }
+
+    add_jump(&slow, unless_number(as, RAX));
+    add_jump(&slow, unless_number(as, RCX));
+  }
+
+  movq_to_xmm(as, 0, RAX);
+  movq_to_xmm(as, 1, RCX);
+  sse(as, 0xf2, sse_op(op), 0, 1);
+  movq_from_xmm(as, RAX, 0);
+  if (stored != -1) bind(as, stored);
+  store(as, STACK_BASE, slot(x), RAX);
+
+  if (!doubles) {
+    int done = jmp(as);
+    bind_all(as, &slow);
+    call_helper(as, (uint64_t)(uintptr_t)jit_arith, x, op, offs);
+    emit_byte(as, 0x84);
+    emit_byte(as, 0xc0);
+    fail_if(as, CC_E);
+    bind(as, done);
+  }
+}
+
+// Compares slots x and x+1, leaving in dl whether a > b, or a < b for
+// OP_LESS.
+static void comparison(assembler* as, uint8_t op, bool doubles, int x, int offs) {
+  jump_list slow = { .count = 0 };
+  jump_list done = { .count = 0 };
+
+  load(as, RAX, STACK_BASE, slot(x));
+  load(as, RCX, STACK_BASE, slot(x+1));
+
+  if (!doubles) {
+    int not_integers = unless_integers(as);
+    unbox_integer(as, RAX);
+    unbox_integer(as, RCX);
+    alu(as, ALU_CMP, RAX, RCX);
+    setcc(as, op == OP_GREATER ? CC_G : CC_L, RDX);
+    add_jump(&done, jmp(as));
+    bind(as, not_integers);
+
+    add_jump(&slow, unless_number(as, RAX));
+    add_jump(&slow, unless_number(as, RCX));
+  }
+
+  movq_to_xmm(as, 0, RAX);
+  movq_to_xmm(as, 1, RCX);
+  // Unordered operands leave CF set, so NaN compares false either way.
+  if (op == OP_GREATER) sse(as, 0x66, 0x2e, 0, 1);
+  else sse(as, 0x66, 0x2e, 1, 0);
+  setcc(as, CC_A, RDX);
+
+  if (!doubles) {
+    add_jump(&done, jmp(as));
+    bind_all(as, &slow);
+    call_helper(as, (uint64_t)(uintptr_t)jit_compare, x, op, offs);
+    // cmp eax, -1
+    emit_byte(as, 0x83);
+    emit_byte(as, 0xf8);
+    emit_byte(as, 0xff);
+    fail_if(as, CC_E);
+    // test eax, eax
+    emit_byte(as, 0x85);
+    emit_byte(as, 0xc0);
+    setcc(as, CC_NE, RDX);
+    bind_all(as, &done);
+  }
+}
+
+// Leaves in dl whether slot x is equal to slot x+1.
+static void equality(assembler* as, int x) {
+  load(as, RDI, STACK_BASE, slot(x));
+  load(as, RSI, STACK_BASE, slot(x+1));
+  call(as, (uint64_t)(uintptr_t)values_equal);
+  alu(as, ALU_MOV, RDX, RAX);
+}
+
+// Leaves in dl whether slot x is falsy.
+static void falsiness(assembler* as, int x) {
+  load(as, RAX, STACK_BASE, slot(x));
+  load_immediate(as, RCX, NIL_VAL);
+  alu(as, ALU_CMP, RAX, RCX);
+  setcc(as, CC_E, RDX);
+  load_immediate(as, RCX, FALSE_VAL);
+  alu(as, ALU_CMP, RAX, RCX);
+  setcc(as, CC_E, RCX);
+  // or dl, cl
+  emit_byte(as, 0x08);
+  modrm_reg(as, RCX, RDX);
+}
+
+// Stores the condition left in dl into slot x as a bool.
+static void store_condition(assembler* as, int x) {
+  // movzx edx, dl
+  emit_byte(as, 0x0f);
+  emit_byte(as, 0xb6);
+  modrm_reg(as, RDX, RDX);
+  load_immediate(as, RAX, FALSE_VAL);
+  alu(as, ALU_ADD, RAX, RDX);
+  store(as, STACK_BASE, slot(x), RAX);
+}
+
+static void branch_on_condition(assembler* as, bool when, int target) {
+  // test dl, dl
+  emit_byte(as, 0x84);
+  modrm_reg(as, RDX, RDX);
+  jcc_to(as, when ? CC_NE : CC_E, target);
+}
+
+static void global(assembler* as, uint8_t op, int global_slot, int x, int offs) {
+  load_immediate(as, RCX, (uint64_t)(uintptr_t)(as->cvm->global_values.values + global_slot));
+  load(as, RAX, RCX, 0);
+  load_immediate(as, RDX, UNDEFINED_VAL);
+  alu(as, ALU_CMP, RAX, RDX);
+  int ok = jcc(as, op == OP_DEFINE_GLOBAL ? CC_E : CC_NE);
+
+  alu(as, ALU_MOV, RDI, R12);
+  load_immediate32(as, RSI, global_slot);
+  load_immediate32(as, RDX, op);
+  load_immediate32(as, RCX, offs);
+  call(as, (uint64_t)(uintptr_t)jit_global_error);
+  jmp_to(as, as->c->count);
+
+  bind(as, ok);
+  if (op == OP_GET_GLOBAL) {
+    store(as, STACK_BASE, slot(x), RAX);
+  } else {
+    load(as, RAX, STACK_BASE, slot(x));
+    store(as, RCX, 0, RAX);
+  }
+}
+
+// The operator behind one of the unchecked variants.
+static uint8_t checked_op(uint8_t op) {
+  switch (op) {
+    case OP_ADD_NUMERIC:
+    case OP_ADD_DOUBLE:      return OP_ADD;
+    case OP_SUBTRACT_NUMERIC:
+    case OP_SUBTRACT_DOUBLE: return OP_SUBTRACT;
+    case OP_MULTIPLY_NUMERIC:
+    case OP_MULTIPLY_DOUBLE: return OP_MULTIPLY;
+    case OP_DIVIDE_NUMERIC:
+    case OP_DIVIDE_DOUBLE:   return OP_DIVIDE;
+    case OP_NEGATE_NUMERIC:
+    case OP_NEGATE_DOUBLE:   return OP_NEGATE;
+    case OP_GREATER_NUMERIC:
+    case OP_GREATER_DOUBLE:  return OP_GREATER;
+    case OP_LESS_NUMERIC:
+    case OP_LESS_DOUBLE:     return OP_LESS;
+    default:                 return op;
+  }
+}
+
+static bool is_double_op(uint8_t op) {
+  return op >= OP_ADD_DOUBLE && op <= OP_LESS_DOUBLE;
+}
+
+// Translates the instruction at offs, with the stack height before it at h.
+// Returns false for instructions there is no template for.
+static bool translate(assembler* as, int offs, int h) {
+  chunk* c = as->c;
+  uint8_t op = c->code[offs];
+  uint8_t* operand = c->code + offs + 1;
+  int target = jump_target(c, offs);
+
+  switch (op) {
+    case OP_CONSTANT:
+      load_value(as, c->constants.values[operand[0]], h);
+      break;
+    case OP_CONSTANT_LONG:
+      load_value(as, c->constants.values[operand[0] | (operand[1] << 8) | (operand[2] << 16)], h);
+      break;
+    case OP_NIL:   load_value(as, NIL_VAL, h); break;
+    case OP_TRUE:  load_value(as, TRUE_VAL, h); break;
+    case OP_FALSE: load_value(as, FALSE_VAL, h); break;
+    case OP_POP:
+      break;
+    case OP_GET_LOCAL:
+      copy(as, operand[0], h);
+      break;
+    case OP_GET_LOCALS:
+      copy(as, operand[0], h);
+      copy(as, operand[1], h+1);
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      copy(as, h-1, operand[0]);
+      break;
+    case OP_ADD_LOCAL_CONSTANT:
+      copy(as, operand[0], h);
+      load_value(as, c->constants.values[operand[1]], h+1);
+      arithmetic(as, OP_ADD, false, h, offs);
+      copy(as, h, operand[0]);
+      break;
+    case OP_GET_GLOBAL:
+      global(as, op, (operand[0] << 8) | operand[1], h, offs);
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+      global(as, op == OP_DEFINE_GLOBAL ? op : OP_SET_GLOBAL,
+             (operand[0] << 8) | operand[1], h-1, offs);
+      break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_SHIFTLEFT:
+    case OP_SHIFTRIGHT:
+    case OP_BITOR:
+    case OP_BITXOR:
+    case OP_BITAND:
+    case OP_ADD_NUMERIC:
+    case OP_SUBTRACT_NUMERIC:
+    case OP_MULTIPLY_NUMERIC:
+    case OP_DIVIDE_NUMERIC:
+    case OP_ADD_DOUBLE:
+    case OP_SUBTRACT_DOUBLE:
+    case OP_MULTIPLY_DOUBLE:
+    case OP_DIVIDE_DOUBLE:
+      arithmetic(as, checked_op(op), is_double_op(op), h-2, offs);
+      break;
+    case OP_NEGATE:
+    case OP_NEGATE_NUMERIC:
+    case OP_NEGATE_DOUBLE: {
+      int slow = -1;
+      load(as, RAX, STACK_BASE, slot(h-1));
+      if (op != OP_NEGATE_DOUBLE) slow = unless_number(as, RAX);
+      // btc rax, 63
+      rex_w(as, 0, RAX);
+      emit_byte(as, 0x0f);
+      emit_byte(as, 0xba);
+      modrm_reg(as, 7, RAX);
+      emit_byte(as, 63);
+      store(as, STACK_BASE, slot(h-1), RAX);
+      if (slow != -1) {
+        int done = jmp(as);
+        bind(as, slow);
+        call_helper(as, (uint64_t)(uintptr_t)jit_unary, h-1, OP_NEGATE, offs);
+        emit_byte(as, 0x84);
+        emit_byte(as, 0xc0);
+        fail_if(as, CC_E);
+        bind(as, done);
+      }
+      break;
+    }
+    case OP_BITNOT:
+      call_helper(as, (uint64_t)(uintptr_t)jit_unary, h-1, op, offs);
+      emit_byte(as, 0x84);
+      emit_byte(as, 0xc0);
+      fail_if(as, CC_E);
+      break;
+    case OP_NOT:
+      falsiness(as, h-1);
+      store_condition(as, h-1);
+      break;
+    case OP_EQUAL:
+      equality(as, h-2);
+      store_condition(as, h-2);
+      break;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GREATER_NUMERIC:
+    case OP_LESS_NUMERIC:
+    case OP_GREATER_DOUBLE:
+    case OP_LESS_DOUBLE:
+      comparison(as, checked_op(op), is_double_op(op), h-2, offs);
+      store_condition(as, h-2);
+      break;
+    case OP_PRINT:
+      load(as, RDI, STACK_BASE, slot(h-1));
+      call(as, (uint64_t)(uintptr_t)jit_print);
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      jmp_to(as, target);
+      break;
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+      falsiness(as, h-1);
+      branch_on_condition(as, true, target);
+      break;
+    case OP_LOOP_IF_TRUE:
+      falsiness(as, h-1);
+      branch_on_condition(as, false, target);
+      break;
+    case OP_JUMP_IF_EQUAL:
+    case OP_LOOP_IF_EQUAL:
+      equality(as, h-2);
+      branch_on_condition(as, true, target);
+      break;
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_LOOP_IF_NOT_EQUAL:
+      equality(as, h-2);
+      branch_on_condition(as, false, target);
+      break;
+    case OP_JUMP_IF_GREATER:
+    case OP_LOOP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_LOOP_IF_NOT_GREATER:
+      comparison(as, OP_GREATER, false, h-2, offs);
+      branch_on_condition(as, op == OP_JUMP_IF_GREATER || op == OP_LOOP_IF_GREATER, target);
+      break;
+    case OP_JUMP_IF_LESS:
+    case OP_LOOP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_LOOP_IF_NOT_LESS:
+      comparison(as, OP_LESS, false, h-2, offs);
+      branch_on_condition(as, op == OP_JUMP_IF_LESS || op == OP_LOOP_IF_LESS, target);
+      break;
+    case OP_RETURN:
+      lea(as, RAX, STACK_BASE, slot(h));
+      store(as, R12, offsetof(vm, stack_top), RAX);
+      // xor eax, eax
+      emit_byte(as, 0x31);
+      emit_byte(as, 0xc0);
+      epilogue(as);
+      break;
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+static void resolve_fixups(assembler* as) {
+  for (int i = 0; i < as->fixup_count; i++) {
+    int at = as->fixups[i].at;
+    uint32_t rel = (uint32_t)(as->labels[as->fixups[i].target] - (at + 4));
+    memcpy(as->code + at, &rel, sizeof(rel));
+  }
+}
+
+// Copies the code into pages of its own, which are never writable and
+// executable at once. Returns NULL when that fails.
+static void* map_code(assembler* as) {
+  void* mem = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return NULL;
+
+  memcpy(mem, as->code, as->count);
+  if (mprotect(mem, as->count, PROT_READ | PROT_EXEC)) {
+    munmap(mem, as->count);
+    return NULL;
+  }
+
+  return mem;
+}
+
+static void init_assembler(assembler* as, vm* cvm, chunk* c) {
+  as->c = c;
+  as->cvm = cvm;
+  as->code = NULL;
+  as->count = 0;
+  as->capacity = 0;
+  as->labels = NULL;
+  as->fixups = NULL;
+  as->fixup_count = 0;
+  as->fixup_capacity = 0;
+}
+
+static void free_assembler(assembler* as) {
+  FREE_ARRAY(uint8_t, as->code, as->capacity);
+  FREE_ARRAY(fixup, as->fixups, as->fixup_capacity);
+}
+
+// Translates c into native code. Fails, leaving the chunk to run(), where
+// there is an instruction without a template or the stack could overflow.
+bool jit_compile(vm* cvm, chunk* c, jit_code* out) {
+  int* heights = ALLOCATE(int, c->count);
+  // ADD_LOCAL_CONSTANT works two slots above the stack.
+  bool ok = stack_heights(c, heights) + 2 <= STACK_MAX;
+
+  assembler as;
+  init_assembler(&as, cvm, c);
+  as.labels = ALLOCATE(int, c->count+1);
+
+  prologue(&as);
+  for (int offs = 0; ok && offs < c->count; offs += instruction_length(c->code[offs])) {
+    as.labels[offs] = as.count;
+    if (heights[offs] != -1) ok = translate(&as, offs, heights[offs]);
+  }
+
+  // Failed instructions have reported their error by the time they get here.
+  as.labels[c->count] = as.count;
+  load_immediate32(&as, RAX, INTERPRET_RUNTIME_ERROR);
+  epilogue(&as);
+
+  if (ok) {
+    resolve_fixups(&as);
+    out->code = map_code(&as);
+    out->size = as.count;
+    ok = out->code != NULL;
+  }
+
+  FREE_ARRAY(int, as.labels, c->count+1);
+  free_assembler(&as);
+  FREE_ARRAY(int, heights, c->count);
+  return ok;
+}
+
+// The trace compiler. A recording is one path through a loop, so it becomes
+// straight-line code specialized to the types the recording saw: guards
+// check them where they are not known yet and leave the trace where they
+// fail, as do branches going the other way than they did while recording.
+// Every exit hands the interpreter a cell and a stack height to go on with,
+// and the stack is in memory all along, so nothing else needs restoring.
+typedef struct {
+  assembler* as;
+  native_trace* out;
+  int exit_capacity;
+  // What is known of the type of every slot at this point of the trace.
+  uint8_t known[STACK_MAX];
+} trace_compiler;
+
+static int trace_exit_index(trace_compiler* tc, int cell, int height) {
+  native_trace* out = tc->out;
+
+  for (int i = 0; i < out->exit_count; i++) {
+    if (out->exits[i].cell == cell && out->exits[i].height == height) return i;
+  }
+
+  if (tc->exit_capacity < out->exit_count + 1) {
+    int oldc = tc->exit_capacity;
+    tc->exit_capacity = GROW_CAPACITY(oldc);
+    out->exits = GROW_ARRAY(out->exits, trace_exit, oldc, tc->exit_capacity);
+  }
+
+  out->exits[out->exit_count].cell = cell;
+  out->exits[out->exit_count].height = height;
+  return out->exit_count++;
+}
+
+// Leaves the trace for the interpreter to go on at cell when cc holds.
+static void exit_if(trace_compiler* tc, int cc, int cell, int height) {
+  jcc_to(tc->as, cc, trace_exit_index(tc, cell, height));
+}
+
+// Leaves before entry e unless reg, loaded from slot x, is of the type.
+static void guard_type(trace_compiler* tc, int reg, int x, uint8_t type, trace_entry* e) {
+  assembler* as = tc->as;
+  if (tc->known[x] == type) return;
+
+  alu(as, ALU_MOV, RDX, reg);
+  if (type == TRACE_INTEGER) {
+    alu(as, ALU_AND, RDX, INTEGER_MASK);
+    alu(as, ALU_CMP, RDX, INTEGER_BITS);
+    exit_if(tc, CC_NE, e->cell, e->height);
+  } else {
+    alu(as, ALU_AND, RDX, QNAN_BITS);
+    alu(as, ALU_CMP, RDX, QNAN_BITS);
+    exit_if(tc, CC_E, e->cell, e->height);
+  }
+
+  tc->known[x] = type;
+}
+
+static void load_integer(trace_compiler* tc, int reg, int x, trace_entry* e) {
+  load(tc->as, reg, STACK_BASE, slot(x));
+  guard_type(tc, reg, x, TRACE_INTEGER, e);
+  unbox_integer(tc->as, reg);
+}
+
+// Loads slot x of the recorded type as a double into xmm.
+static void load_double(trace_compiler* tc, int xmm, int x, uint8_t type, trace_entry* e) {
+  assembler* as = tc->as;
+  load(as, RAX, STACK_BASE, slot(x));
+  guard_type(tc, RAX, x, type, e);
+
+  if (type == TRACE_INTEGER) {
+    unbox_integer(as, RAX);
+    // cvtsi2sd xmm, rax
+    emit_byte(as, 0xf2);
+    rex_w(as, xmm, RAX);
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x2a);
+    modrm_reg(as, xmm, RAX);
+  } else {
+    movq_to_xmm(as, xmm, RAX);
+  }
+}
+
+// Boxes the integer in rax into slot x, leaving before e when it does not
+// fit the payload.
+static void store_integer(trace_compiler* tc, int x, trace_entry* e) {
+  assembler* as = tc->as;
+  alu(as, ALU_MOV, RDX, RAX);
+  unbox_integer(as, RDX);
+  alu(as, ALU_CMP, RDX, RAX);
+  exit_if(tc, CC_NE, e->cell, e->height);
+  shift(as, SHL, RAX, 16);
+  shift(as, SHR, RAX, 16);
+  alu(as, ALU_OR, RAX, INTEGER_BITS);
+  store(as, STACK_BASE, slot(x), RAX);
+  tc->known[x] = TRACE_INTEGER;
+}
+
+static void store_double(trace_compiler* tc, int x) {
+  movq_from_xmm(tc->as, RAX, 0);
+  store(tc->as, STACK_BASE, slot(x), RAX);
+  tc->known[x] = TRACE_DOUBLE;
+}
+
+static void trace_copy(trace_compiler* tc, int from, int to) {
+  copy(tc->as, from, to);
+  tc->known[to] = tc->known[from];
+}
+
+static void trace_value(trace_compiler* tc, value v, int to) {
+  load_value(tc->as, v, to);
+  tc->known[to] = trace_type_of(v);
+}
+
+static bool trace_arithmetic(trace_compiler* tc, uint8_t op, trace_entry* e, int x) {
+  assembler* as = tc->as;
+  uint8_t ta = e->types[0];
+  uint8_t tb = e->types[1];
+
+  if (ta == TRACE_OTHER || tb == TRACE_OTHER) return false;
+
+  if (ta == TRACE_INTEGER && tb == TRACE_INTEGER && op != OP_DIVIDE) {
+    load_integer(tc, RAX, x, e);
+    load_integer(tc, RCX, x+1, e);
+
+    switch (op) {
+      case OP_ADD:      alu(as, ALU_ADD, RAX, RCX); break;
+      case OP_SUBTRACT: alu(as, ALU_SUB, RAX, RCX); break;
+      case OP_BITAND:   alu(as, ALU_AND, RAX, RCX); break;
+      case OP_BITOR:    alu(as, ALU_OR, RAX, RCX); break;
+      case OP_BITXOR:   alu(as, ALU_XOR, RAX, RCX); break;
+      case OP_MULTIPLY:
+        imul(as, RAX, RCX);
+        exit_if(tc, CC_O, e->cell, e->height);
+        break;
+      case OP_SHIFTLEFT:
+      case OP_SHIFTRIGHT:
+        // Shifts by cl take the count modulo 64 already.
+        rex_w(as, 0, RAX);
+        emit_byte(as, 0xd3);
+        modrm_reg(as, op == OP_SHIFTLEFT ? SHL : SAR, RAX);
+        break;
+      case OP_MODULO:
+        // Dividing by 0 and -1 is left to the interpreter.
+        rex_w(as, 0, RCX);
+        emit_byte(as, 0x83);
+        modrm_reg(as, 7, RCX);
+        emit_byte(as, 0);
+        exit_if(tc, CC_E, e->cell, e->height);
+        rex_w(as, 0, RCX);
+        emit_byte(as, 0x83);
+        modrm_reg(as, 7, RCX);
+        emit_byte(as, 0xff);
+        exit_if(tc, CC_E, e->cell, e->height);
+        // cqo; idiv rcx
+        rex_w(as, 0, 0);
+        emit_byte(as, 0x99);
+        rex_w(as, 0, RCX);
+        emit_byte(as, 0xf7);
+        modrm_reg(as, 7, RCX);
+        alu(as, ALU_MOV, RAX, RDX);
+        break;
+      default:
+        return false;
+    }
+
+    store_integer(tc, x, e);
+    return true;
+  }
+
+  if (op != OP_ADD && op != OP_SUBTRACT && op != OP_MULTIPLY && op != OP_DIVIDE) {
+    return false;
+  }
+
+  load_double(tc, 0, x, ta, e);
+  load_double(tc, 1, x+1, tb, e);
+  sse(as, 0xf2, sse_op(op), 0, 1);
+  store_double(tc, x);
+  return true;
+}
+
+// Leaves in dl whether a > b, or a < b for OP_LESS, of slots x and x+1.
+static bool trace_comparison(trace_compiler* tc, uint8_t op, trace_entry* e, int x) {
+  assembler* as = tc->as;
+  uint8_t ta = e->types[0];
+  uint8_t tb = e->types[1];
+
+  if (ta == TRACE_OTHER || tb == TRACE_OTHER) return false;
+
+  if (ta == TRACE_INTEGER && tb == TRACE_INTEGER) {
+    load_integer(tc, RAX, x, e);
+    load_integer(tc, RCX, x+1, e);
+    alu(as, ALU_CMP, RAX, RCX);
+    setcc(as, op == OP_GREATER ? CC_G : CC_L, RDX);
+    return true;
+  }
+
+  load_double(tc, 0, x, ta, e);
+  load_double(tc, 1, x+1, tb, e);
+  if (op == OP_GREATER) sse(as, 0x66, 0x2e, 0, 1);
+  else sse(as, 0x66, 0x2e, 1, 0);
+  setcc(as, CC_A, RDX);
+  return true;
+}
+
+// Leaves in dl whether slots x and x+1 are equal.
+static void trace_equality(trace_compiler* tc, trace_entry* e, int x) {
+  assembler* as = tc->as;
+
+  if (e->types[0] == TRACE_INTEGER && e->types[1] == TRACE_INTEGER) {
+    // Integers are boxed the one way, so equal ones have equal bits.
+    load(as, RAX, STACK_BASE, slot(x));
+    guard_type(tc, RAX, x, TRACE_INTEGER, e);
+    load(as, RCX, STACK_BASE, slot(x+1));
+    guard_type(tc, RCX, x+1, TRACE_INTEGER, e);
+    alu(as, ALU_CMP, RAX, RCX);
+    setcc(as, CC_E, RDX);
+  } else if (e->types[0] == TRACE_DOUBLE && e->types[1] == TRACE_DOUBLE) {
+    load_double(tc, 0, x, TRACE_DOUBLE, e);
+    load_double(tc, 1, x+1, TRACE_DOUBLE, e);
+    sse(as, 0x66, 0x2e, 0, 1);
+    // NaN sets the parity flag and equals nothing.
+    setcc(as, CC_E, RDX);
+    setcc(as, CC_NP, RCX);
+    emit_byte(as, 0x20);
+    modrm_reg(as, RCX, RDX);
+  } else {
+    equality(as, x);
+  }
+}
+
+// Follows the branch of entry e the way it went while recording, leaving
+// the trace when it goes the other. The branch jumps when dl differs from
+// negated.
+static void trace_branch(trace_compiler* tc, trace_entry* e, uint8_t op, bool negated) {
+  assembler* as = tc->as;
+  chunk* c = as->c;
+  int other = e->taken ? e->cell + cell_length(op)
+                       : (int)(c->cells[e->cell].as.target - c->cells);
+
+  // test dl, dl
+  emit_byte(as, 0x84);
+  modrm_reg(as, RDX, RDX);
+  exit_if(tc, e->taken != negated ? CC_E : CC_NE, other, e->height + stack_effect(op));
+}
+
+static bool trace_global(trace_compiler* tc, uint8_t op, int global_slot, int x, trace_entry* e) {
+  assembler* as = tc->as;
+
+  load_immediate(as, RCX, (uint64_t)(uintptr_t)(as->cvm->global_values.values + global_slot));
+  load(as, RAX, RCX, 0);
+  load_immediate(as, RDX, UNDEFINED_VAL);
+  alu(as, ALU_CMP, RAX, RDX);
+  exit_if(tc, op == OP_DEFINE_GLOBAL ? CC_NE : CC_E, e->cell, e->height);
+
+  if (op == OP_GET_GLOBAL) {
+    store(as, STACK_BASE, slot(x), RAX);
+    tc->known[x] = TRACE_OTHER;
+  } else {
+    load(as, RAX, STACK_BASE, slot(x));
+    store(as, RCX, 0, RAX);
+  }
+
+  return true;
+}
+
+static bool trace_instruction(trace_compiler* tc, trace_entry* e) {
+  assembler* as = tc->as;
+  chunk* c = as->c;
+  uint8_t op = c->code[e->offs];
+  uint8_t* operand = c->code + e->offs + 1;
+  int h = e->height;
+
+  // What the compiler has proven needs no guards.
+  if (is_double_op(op)) {
+    e->types[0] = e->types[1] = TRACE_DOUBLE;
+    if (h > 0) tc->known[h-1] = TRACE_DOUBLE;
+    if (h > 1 && op != OP_NEGATE_DOUBLE) tc->known[h-2] = TRACE_DOUBLE;
+  }
+
+  switch (op) {
+    case OP_CONSTANT:
+      trace_value(tc, c->constants.values[operand[0]], h);
+      return true;
+    case OP_CONSTANT_LONG:
+      trace_value(tc, c->constants.values[operand[0] | (operand[1] << 8) | (operand[2] << 16)], h);
+      return true;
+    case OP_NIL:   trace_value(tc, NIL_VAL, h); return true;
+    case OP_TRUE:  trace_value(tc, TRUE_VAL, h); return true;
+    case OP_FALSE: trace_value(tc, FALSE_VAL, h); return true;
+    case OP_POP:
+    case OP_JUMP:
+    case OP_LOOP:
+      return true;
+    case OP_GET_LOCAL:
+      trace_copy(tc, operand[0], h);
+      return true;
+    case OP_GET_LOCALS:
+      trace_copy(tc, operand[0], h);
+      trace_copy(tc, operand[1], h+1);
+      return true;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      trace_copy(tc, h-1, operand[0]);
+      return true;
+    case OP_ADD_LOCAL_CONSTANT:
+      trace_copy(tc, operand[0], h);
+      trace_value(tc, c->constants.values[operand[1]], h+1);
+      if (!trace_arithmetic(tc, OP_ADD, e, h)) return false;
+      trace_copy(tc, h, operand[0]);
+      return true;
+    case OP_GET_GLOBAL:
+      return trace_global(tc, op, (operand[0] << 8) | operand[1], h, e);
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+      return trace_global(tc, op == OP_DEFINE_GLOBAL ? op : OP_SET_GLOBAL,
+                          (operand[0] << 8) | operand[1], h-1, e);
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_SHIFTLEFT:
+    case OP_SHIFTRIGHT:
+    case OP_BITOR:
+    case OP_BITXOR:
+    case OP_BITAND:
+    case OP_ADD_NUMERIC:
+    case OP_SUBTRACT_NUMERIC:
+    case OP_MULTIPLY_NUMERIC:
+    case OP_DIVIDE_NUMERIC:
+    case OP_ADD_DOUBLE:
+    case OP_SUBTRACT_DOUBLE:
+    case OP_MULTIPLY_DOUBLE:
+    case OP_DIVIDE_DOUBLE:
+      return trace_arithmetic(tc, checked_op(op), e, h-2);
+    case OP_NEGATE:
+    case OP_NEGATE_NUMERIC:
+    case OP_NEGATE_DOUBLE:
+    case OP_BITNOT:
+      if (e->types[1] == TRACE_INTEGER) {
+        load_integer(tc, RAX, h-1, e);
+        // neg rax, or not rax
+        rex_w(as, 0, RAX);
+        emit_byte(as, 0xf7);
+        modrm_reg(as, op == OP_BITNOT ? 2 : 3, RAX);
+        store_integer(tc, h-1, e);
+        return true;
+      }
+      if (e->types[1] != TRACE_DOUBLE || op == OP_BITNOT) return false;
+      load(as, RAX, STACK_BASE, slot(h-1));
+      guard_type(tc, RAX, h-1, TRACE_DOUBLE, e);
+      // btc rax, 63
+      rex_w(as, 0, RAX);
+      emit_byte(as, 0x0f);
+      emit_byte(as, 0xba);
+      modrm_reg(as, 7, RAX);
+      emit_byte(as, 63);
+      store(as, STACK_BASE, slot(h-1), RAX);
+      return true;
+    case OP_NOT:
+      falsiness(as, h-1);
+      store_condition(as, h-1);
+      tc->known[h-1] = TRACE_OTHER;
+      return true;
+    case OP_EQUAL:
+      trace_equality(tc, e, h-2);
+      store_condition(as, h-2);
+      tc->known[h-2] = TRACE_OTHER;
+      return true;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GREATER_NUMERIC:
+    case OP_LESS_NUMERIC:
+    case OP_GREATER_DOUBLE:
+    case OP_LESS_DOUBLE:
+      if (!trace_comparison(tc, checked_op(op), e, h-2)) return false;
+      store_condition(as, h-2);
+      tc->known[h-2] = TRACE_OTHER;
+      return true;
+    case OP_PRINT:
+      load(as, RDI, STACK_BASE, slot(h-1));
+      call(as, (uint64_t)(uintptr_t)jit_print);
+      return true;
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LOOP_IF_TRUE:
+      falsiness(as, h-1);
+      trace_branch(tc, e, op, op == OP_LOOP_IF_TRUE);
+      return true;
+    case OP_JUMP_IF_EQUAL:
+    case OP_LOOP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_LOOP_IF_NOT_EQUAL:
+      trace_equality(tc, e, h-2);
+      trace_branch(tc, e, op, op == OP_JUMP_IF_NOT_EQUAL || op == OP_LOOP_IF_NOT_EQUAL);
+      return true;
+    case OP_JUMP_IF_GREATER:
+    case OP_LOOP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_LOOP_IF_NOT_GREATER:
+      if (!trace_comparison(tc, OP_GREATER, e, h-2)) return false;
+      trace_branch(tc, e, op, op == OP_JUMP_IF_NOT_GREATER || op == OP_LOOP_IF_NOT_GREATER);
+      return true;
+    case OP_JUMP_IF_LESS:
+    case OP_LOOP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_LOOP_IF_NOT_LESS:
+      if (!trace_comparison(tc, OP_LESS, e, h-2)) return false;
+      trace_branch(tc, e, op, op == OP_JUMP_IF_NOT_LESS || op == OP_LOOP_IF_NOT_LESS);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Compiles a recording into a loop of native code that runs until one of
+// its exits is taken. Fails for operand types there is no code for.
+bool compile_trace(vm* cvm, chunk* c, recording* rec, native_trace* out) {
+  assembler as;
+  init_assembler(&as, cvm, c);
+
+  trace_compiler tc;
+  tc.as = &as;
+  tc.out = out;
+  tc.exit_capacity = 0;
+  out->exits = NULL;
+  out->exit_count = 0;
+  for (int i = 0; i < STACK_MAX; i++) tc.known[i] = TRACE_OTHER;
+
+  prologue(&as);
+  int start = as.count;
+  bool ok = true;
+  for (int i = 0; ok && i < rec->count; i++) ok = trace_instruction(&tc, &rec->entries[i]);
+
+  // Back around to the header.
+  emit_byte(&as, 0xe9);
+  emit_u32(&as, (uint32_t)(start - (as.count + 4)));
+
+  as.labels = ALLOCATE(int, out->exit_count);
+  for (int i = 0; i < out->exit_count; i++) {
+    as.labels[i] = as.count;
+    load_immediate32(&as, RAX, i);
+    epilogue(&as);
+  }
+
+  if (ok) {
+    resolve_fixups(&as);
+    out->code = map_code(&as);
+    out->size = as.count;
+    ok = out->code != NULL;
+  }
+
+  FREE_ARRAY(int, as.labels, out->exit_count);
+  free_assembler(&as);
+  if (!ok) FREE_ARRAY(trace_exit, out->exits, tc.exit_capacity);
+  else out->exits = GROW_ARRAY(out->exits, trace_exit, tc.exit_capacity, out->exit_count);
+  return ok;
+}
+
+typedef int (*trace_entry_point)(vm*, value*);
+
+// Runs the trace from its header with the stack at slots, returning the
+// exit it left through.
+int run_trace(vm* cvm, native_trace* t, value* slots) {
+  trace_entry_point entry;
+  memcpy(&entry, &t->code, sizeof(entry));
+  return entry(cvm, slots);
+}
+
+void free_native_trace(native_trace* t) {
+  munmap(t->code, t->size);
+  FREE_ARRAY(trace_exit, t->exits, t->exit_count);
+}
+
+typedef interpret_result (*jit_entry)(vm*, value*);
+
+interpret_result run_jit(vm* cvm, jit_code* jc) {
+  jit_entry entry;
+  // Object and function pointers do not convert into one another in ISO C.
+  memcpy(&entry, &jc->code, sizeof(entry));
+  return entry(cvm, cvm->stack);
+}
+
+#else
+
+void free_jit_code(jit_code* jc) {
+  init_jit_code(jc);
+}
+
+bool jit_compile(vm* cvm, chunk* c, jit_code* out) {
+  (void)cvm;
+  (void)c;
+  (void)out;
+  return false;
+}
+
+interpret_result run_jit(vm* cvm, jit_code* jc) {
+  (void)cvm;
+  (void)jc;
+  return INTERPRET_RUNTIME_ERROR;
+}
+
+bool compile_trace(vm* cvm, chunk* c, recording* rec, native_trace* out) {
+  (void)cvm;
+  (void)c;
+  (void)rec;
+  (void)out;
+  return false;
+}
+
+int run_trace(vm* cvm, native_trace* t, value* slots) {
+  (void)cvm;
+  (void)t;
+  (void)slots;
+  return 0;
+}
+
+void free_native_trace(native_trace* t) {
+  (void)t;
+}
+
+#endif
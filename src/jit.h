@@ -0,0 +1,23 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+#include "trace.h"
+#include "vm.h"
+
+// Native code translated from a chunk.
+typedef struct {
+  void* code;
+  size_t size;
+} jit_code;
+
+void init_jit_code(jit_code*);
+void free_jit_code(jit_code*);
+bool jit_compile(vm*, chunk*, jit_code*);
+interpret_result run_jit(vm*, jit_code*);
+
+bool compile_trace(vm*, chunk*, recording*, native_trace*);
+int run_trace(vm*, native_trace*, value*);
+void free_native_trace(native_trace*);
+
+#endif
@@ -1,8 +1,494 @@
+#define _DEFAULT_SOURCE
+
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "memory.h"
+#include "vm.h"
+
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#endif
+
+// Blocks of up to SLAB_MAX bytes are cut from slabs of SLAB_SIZE bytes, each
+// slab holding blocks of one size class. Every thread has slabs and free
+// lists of its own, so VMs on different threads never contend; a block freed
+// on another thread than the one it came from simply joins the free list
+// there. Slabs are kept for reuse rather than given back.
+//
+// Buffers of LARGE_SIZE bytes and more are mapped straight from the system,
+// and anything in between goes to malloc. Which of the three a block came
+// from follows from its size, so the sizes reallocate() is passed have to
+// be the ones the block was allocated with.
+#define SIZE_CLASSES 12
+#define SLAB_MAX 1024
+#define SLAB_SIZE (64 * 1024)
+#define LARGE_SIZE (128 * 1024)
+
+static const size_t class_size[SIZE_CLASSES] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024
+};
+
+typedef struct free_block {
+  struct free_block* next;
+} free_block;
+
+typedef struct {
+  free_block* free[SIZE_CLASSES];
+  char* next[SIZE_CLASSES];
+  char* end[SIZE_CLASSES];
+} slab_cache;
+
+static _Thread_local slab_cache cache;
+
+// Classes go up in steps of 16 bytes to 64, then alternate between powers of
+// two and halfway in between.
+static int size_class(size_t size) {
+  if (size <= 64) return (int)((size + 15) / 16) - 1;
+
+  int log = 63 - __builtin_clzll(size - 1);
+  return 4 + 2 * (log - 6) + (size > (size_t)3 << (log - 1));
+}
+
+static void* slab_allocate(int c) {
+  free_block* b = cache.free[c];
+  if (b) {
+    cache.free[c] = b->next;
+    return b;
+  }
+
+  if (cache.next[c] == cache.end[c]) {
+    char* slab = malloc(SLAB_SIZE);
+    if (!slab) return NULL;
+    cache.next[c] = slab;
+    cache.end[c] = slab + SLAB_SIZE / class_size[c] * class_size[c];
+  }
+
+  void* p = cache.next[c];
+  cache.next[c] += class_size[c];
+  return p;
+}
+
+static void slab_free(void* p, int c) {
+  free_block* b = (free_block*)p;
+  b->next = cache.free[c];
+  cache.free[c] = b;
+}
+
+#ifdef MMAP
+static size_t mapped_size(size_t size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+#endif
+
+static void* acquire(size_t size) {
+  if (size <= SLAB_MAX) return slab_allocate(size_class(size));
+#ifdef MMAP
+  if (size >= LARGE_SIZE) {
+    void* p = mmap(NULL, mapped_size(size), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+  }
+#endif
+  return malloc(size);
+}
+
+static void release(void* p, size_t size) {
+  if (!p) return;
+  if (size <= SLAB_MAX) slab_free(p, size_class(size));
+#ifdef MMAP
+  else if (size >= LARGE_SIZE) munmap(p, mapped_size(size));
+#endif
+  else free(p);
+}
+
+// Whether a block of olds bytes has room for news as it is.
+static bool fits(size_t olds, size_t news) {
+  if (olds <= SLAB_MAX || news <= SLAB_MAX) {
+    return olds <= SLAB_MAX && news <= SLAB_MAX && size_class(olds) == size_class(news);
+  }
+#ifdef MMAP
+  if (olds >= LARGE_SIZE || news >= LARGE_SIZE) {
+    return olds >= LARGE_SIZE && news >= LARGE_SIZE && mapped_size(olds) == mapped_size(news);
+  }
+#endif
+  return false;
+}
+
+// The VM whose heap the calling thread allocates on, if any. Sizes wrap
+// around on the way down, as they are unsigned, but add up all the same.
+static _Thread_local vm* owner;
+
+void charge_to(vm* cvm) {
+  owner = cvm;
+}
+
+// What reallocate_as() does, short of telling the profiler. A block that
+// cannot be had leaves previous, and the heap, as they were.
+static void* resize(heap_category category, void* previous, size_t olds, size_t news) {
+  void* p = NULL;
+  if (!news) {
+    release(previous, olds);
+  } else if (previous && fits(olds, news)) {
+    p = previous;
+  } else if (previous && olds > SLAB_MAX && news > SLAB_MAX && olds < LARGE_SIZE && news < LARGE_SIZE) {
+    p = realloc(previous, news);
+  } else {
+    p = acquire(news);
+    if (p && previous) {
+      memcpy(p, previous, olds < news ? olds : news);
+      release(previous, olds);
+    }
+  }
+  if (news && !p) return NULL;
+
+  if (owner) {
+    heap_stats* heap = &owner->heap;
+    heap->categories[category] += news - olds;
+    heap->current += news - olds;
+    if (heap->current > heap->peak) heap->peak = heap->current;
+  }
+  return p;
+}
+
+void* reallocate_as(heap_category category, void* previous, size_t olds, size_t news) {
+  if (owner && owner->profiler && news > olds) owner->profiler(owner, news - olds, false);
+  return resize(category, previous, olds, news);
+}
 
 void* reallocate(void* previous, size_t olds, size_t news) {
-  return realloc(previous, news);
+  return reallocate_as(HEAP_OTHER, previous, olds, news);
+}
+
+// Moves size bytes handed out by an arena from one category to another.
+static void recategorize(heap_category from, heap_category to, size_t size) {
+  if (!owner) return;
+  owner->heap.categories[from] -= size;
+  owner->heap.categories[to] += size;
+}
+
+// Compiling allocates its objects old, where exhausted() lets it be, so the
+// heap limit is kept here. Returns NULL if the block cannot be had.
+static arena_block* add_block(arena* a, size_t size) {
+  size_t total = sizeof(arena_block) + size;
+  if (owner && owner->heap.limit && owner->heap.current + total > owner->heap.limit) return NULL;
+
+  arena_block* b = (arena_block*)reallocate(NULL, 0, total);
+  if (!b) return NULL;
+  b->next = a->blocks;
+  b->size = size;
+  b->used = 0;
+  a->blocks = b;
+  return b;
+}
+
+bool init_arena(arena* a, size_t size) {
+  a->blocks = NULL;
+  a->last = NULL;
+  for (int i = 0; i < HEAP_CATEGORIES; i++) a->used[i] = 0;
+  a->failed = !add_block(a, ALIGN(size));
+  return !a->failed;
+}
+
+// Makes sure the next size bytes handed out come from one block. Should the
+// current block run out, the next one is at least twice as large, so a grown
+// array wastes no more than it ends up using, or just large enough if there
+// is no room for that.
+bool arena_reserve(arena* a, size_t size) {
+  size = ALIGN(size);
+  arena_block* b = a->blocks;
+  if (b && b->size - b->used >= size) return true;
+
+  size_t next = b ? b->size * 2 : 0;
+  if ((next > size && add_block(a, next)) || add_block(a, size)) return true;
+  a->failed = true;
+  return false;
+}
+
+void* arena_allocate(arena* a, heap_category category, size_t size) {
+  size = ALIGN(size);
+  if (!arena_reserve(a, size)) return NULL;
+
+  arena_block* b = a->blocks;
+  void* p = b->data + b->used;
+  b->used += size;
+  a->last = p;
+  a->used[category] += size;
+  recategorize(HEAP_OTHER, category, size);
+  return p;
+}
+
+void* arena_grow(arena* a, heap_category category, void* previous, size_t olds, size_t news) {
+  arena_block* b = a->blocks;
+  if (previous && previous == a->last && (size_t)((char*)previous - b->data) + ALIGN(news) <= b->size) {
+    b->used += ALIGN(news) - ALIGN(olds);
+    a->used[category] += ALIGN(news) - ALIGN(olds);
+    recategorize(HEAP_OTHER, category, ALIGN(news) - ALIGN(olds));
+    return previous;
+  }
+  if (news <= olds) return previous;
+
+  void* p = arena_allocate(a, category, news);
+  if (p && previous) memcpy(p, previous, olds);
+  return p;
+}
+
+void free_arena(arena* a) {
+  for (int i = 0; i < HEAP_CATEGORIES; i++) recategorize((heap_category)i, HEAP_OTHER, a->used[i]);
+
+  arena_block* b = a->blocks;
+  while (b) {
+    arena_block* next = b->next;
+    reallocate(b, sizeof(arena_block) + b->size, 0);
+    b = next;
+  }
+  a->blocks = NULL;
+  a->last = NULL;
+}
+
+// What an object was allocated with, rounded up as by allocate_object.
+static size_t object_size(obj* o) {
+  switch (o->type) {
+    case STRING: return ALIGN(offsetof(obj_str, chars)+((obj_str*)o)->len+1);
+    case BOXED_INTEGER: return ALIGN(sizeof(obj_int));
+  }
+  return 0;
+}
+
+static heap_category object_category(obj* o) {
+  return o->type == BOXED_INTEGER ? HEAP_INTEGERS : HEAP_STRINGS;
+}
+
+static void free_object(vm* cvm, obj* o) {
+  size_t size = object_size(o);
+  cvm->bytes_allocated -= size;
+  resize(object_category(o), o, size, 0);
+}
+
+bool in_nursery(vm* cvm, obj* o) {
+  return (char*)o >= cvm->nursery && (char*)o < cvm->nursery_end;
+}
+
+// Whether size more bytes would take the heap over its limit, even once the
+// garbage is gone. What the compiler allocates always fits; interpret()
+// checks the limit when it is done.
+static bool exhausted(vm* cvm, size_t size) {
+  heap_stats* h = &cvm->heap;
+  if (!h->limit || cvm->tenure || h->current + size <= h->limit) return false;
+
+  collect_garbage(cvm);
+  return h->current + size > h->limit;
+}
+
+static obj* allocate_old(vm* cvm, size_t size) {
+#ifdef DEBUG_STRESS_GC
+  collect_garbage(cvm);
+#else
+  if (cvm->bytes_allocated + size > cvm->next_gc) collect_garbage(cvm);
+#endif
+  if (exhausted(cvm, size)) return NULL;
+
+  obj* o = (obj*)resize(HEAP_STRINGS, NULL, 0, size);
+  if (!o) return NULL;
+  cvm->bytes_allocated += size;
+  o->next = cvm->objs;
+  cvm->objs = o;
+  return o;
+}
+
+// Copies a young object to the old space, unless it was already. The copy is
+// remembered in the next field of the original, which marked flags as moved.
+// Should there be no room for the copy, the original stays where it is and
+// *failed is set.
+static value promote(vm* cvm, value v, bool* failed) {
+  if (!IS_OBJ(v) || !in_nursery(cvm, AS_OBJ(v))) return v;
+
+  obj* o = AS_OBJ(v);
+  if (!o->marked) {
+    size_t size = object_size(o);
+    obj* copy = (obj*)resize(object_category(o), NULL, 0, size);
+    if (!copy) {
+      *failed = true;
+      return v;
+    }
+    memcpy(copy, o, size);
+    cvm->bytes_allocated += size;
+    copy->next = cvm->objs;
+    cvm->objs = copy;
+
+    o->marked = true;
+    o->next = copy;
+  }
+
+  return OBJ_VAL(o->next);
+}
+
+static void promote_values(vm* cvm, value* values, int count, bool* failed) {
+  for (int i = 0; i < count; i++) values[i] = promote(cvm, values[i], failed);
+}
+
+// A minor collection. Nothing old refers to a young object but the globals,
+// as strings hold no references and the intern table is weak, so the
+// globals are the whole remembered set and get scanned along with the
+// stack. The intern table learns where its young strings that survived
+// went and forgets the others.
+//
+// Fails if the old space has no room for some survivor. The nursery is
+// kept as it is then, survivors that were not promoted and the garbage
+// among them, and the next collection picks up where this one left off.
+bool collect_nursery(vm* cvm) {
+#ifdef DEBUG_LOG_GC
+  size_t before = cvm->bytes_allocated;
+#endif
+
+  bool failed = false;
+  promote_values(cvm, cvm->stack, cvm->stack_top - cvm->stack, &failed);
+  promote_values(cvm, cvm->frame, cvm->frame_size, &failed);
+  promote_values(cvm, cvm->global_values.values, cvm->global_values.count, &failed);
+
+  for (char* p = cvm->nursery; p < cvm->nursery_top; p += object_size((obj*)p)) {
+    obj_str* s = (obj_str*)p;
+    if (!s->interned) continue;
+    if (s->o.marked) table_move_key(&cvm->strings, s, (obj_str*)s->o.next);
+    else if (!failed) table_delete(&cvm->strings, s);
+  }
+  if (failed) return false;
+  cvm->nursery_top = cvm->nursery;
+
+#ifdef DEBUG_LOG_GC
+  fprintf(stderr, "gc: promoted %zu bytes\n", cvm->bytes_allocated - before);
+#endif
+  return true;
+}
+
+// Objects are bump-allocated in the nursery. The compiler's go straight to
+// the old space, as constants get copied into threaded code and machine code,
+// where they could not be updated, and so do those too large for the
+// nursery. Returns NULL once the heap is exhausted.
+obj* allocate_object(vm* cvm, size_t size) {
+  size = ALIGN(size);
+  if (cvm->profiler) cvm->profiler(cvm, size, true);
+  if (!cvm->nursery || cvm->tenure || size > NURSERY_MAX_OBJECT) return allocate_old(cvm, size);
+
+#ifdef DEBUG_STRESS_GC
+  collect_nursery(cvm);
+#endif
+
+  if (cvm->nursery_top + size > cvm->nursery_end) {
+    if (!collect_nursery(cvm)) return NULL;
+    if (cvm->bytes_allocated > cvm->next_gc) collect_garbage(cvm);
+    if (exhausted(cvm, 0)) return NULL;
+  }
+
+  obj* o = (obj*)cvm->nursery_top;
+  cvm->nursery_top += size;
+  return o;
+}
+
+#ifdef NAN_BOXING
+// Integers are boxed in the middle of arithmetic, with the operands and
+// whatever else the running tier holds still in C variables, so a box never
+// sets off a collection. It goes straight to the old space of the VM the
+// thread allocates for, counting towards the next collection, which the
+// tiers start where they know their roots. Without a VM or the memory for a
+// box, or with the heap at its limit, the integer makes do as a double.
+//
+// Boxes are left out of allocation profiles, as the tiers only say which
+// instruction runs on their slow paths, which leaves no line to charge.
+value box_wide_integer(int64_t i) {
+  vm* cvm = owner;
+  if (!cvm) return NUMBER_VAL((double)i);
+
+  size_t size = ALIGN(sizeof(obj_int));
+  heap_stats* h = &cvm->heap;
+  if (h->limit && h->current + size > h->limit) return NUMBER_VAL((double)i);
+
+  obj_int* box = (obj_int*)resize(HEAP_INTEGERS, NULL, 0, size);
+  if (!box) return NUMBER_VAL((double)i);
+
+  box->o.type = BOXED_INTEGER;
+  box->o.marked = false;
+  box->o.next = cvm->objs;
+  cvm->objs = &box->o;
+  cvm->bytes_allocated += size;
+  box->value = i;
+  return OBJ_VAL(box);
+}
+#endif
+
+// Strings and boxed integers are the only objects and refer to nothing, so
+// marking one is all there is to it and no worklist is needed.
+void mark_value(value v) {
+  if (IS_OBJ(v)) AS_OBJ(v)->marked = true;
+}
+
+static void mark_array(value_array* a) {
+  for (int i = 0; i < a->count; i++) mark_value(a->values[i]);
+}
+
+// The roots are whatever the running tier can still reach: the VM stack up
+// to stack_top, which the tiers bring up to date before anything allocates,
+// the register frame while one runs, the globals and the constants of the
+// chunk being compiled or run.
+static void mark_roots(vm* cvm) {
+  for (value* slot = cvm->stack; slot < cvm->stack_top; slot++) mark_value(*slot);
+  for (int i = 0; i < cvm->frame_size; i++) mark_value(cvm->frame[i]);
+
+  mark_table(&cvm->globals);
+  mark_array(&cvm->global_values);
+  mark_array(&cvm->global_names);
+  if (cvm->c) mark_array(&cvm->c->constants);
+}
+
+static void sweep(vm* cvm) {
+  obj** link = &cvm->objs;
+
+  while (*link) {
+    obj* o = *link;
+    if (o->marked) {
+      o->marked = false;
+      link = &o->next;
+    } else {
+      *link = o->next;
+      free_object(cvm, o);
+    }
+  }
+}
+
+// A major collection, which empties the nursery first so that only the old
+// space is left to mark and sweep. Young objects cannot be marked, as that
+// flags them as moved, so if the nursery stays full there is no collection.
+void collect_garbage(vm* cvm) {
+  if (!collect_nursery(cvm)) return;
+
+#ifdef DEBUG_LOG_GC
+  size_t before = cvm->bytes_allocated;
+#endif
+
+  mark_roots(cvm);
+  // The intern table holds on to no string itself.
+  table_remove_white(&cvm->strings);
+  sweep(cvm);
+
+  cvm->next_gc = (size_t)(cvm->bytes_allocated * cvm->gc_growth);
+  if (cvm->next_gc < GC_INITIAL_THRESHOLD) cvm->next_gc = GC_INITIAL_THRESHOLD;
+
+#ifdef DEBUG_LOG_GC
+  fprintf(stderr, "gc: %zu -> %zu bytes, next at %zu\n",
+          before, cvm->bytes_allocated, cvm->next_gc);
+#endif
+}
+
+void free_objects(vm* cvm) {
+  obj* o = cvm->objs;
+  while (o) {
+    obj* next = o->next;
+    free_object(cvm, o);
+    o = next;
+  }
+  cvm->objs = NULL;
 }
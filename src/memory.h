@@ -1,16 +1,84 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
-#define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type)*(count))
+#include "value.h"
+
+// What the heap of a VM is spent on. Compiler and JIT working memory, and
+// anything else not told apart, is other. Integers are the boxes of those
+// too wide for a value.
+typedef enum {
+  HEAP_STRINGS,
+  HEAP_INTEGERS,
+  HEAP_CODE,
+  HEAP_CONSTANTS,
+  HEAP_TABLES,
+  HEAP_STACK,
+  HEAP_OTHER,
+  HEAP_CATEGORIES
+} heap_category;
+
+// Bytes held by a VM, in all and by category, the most it ever held, and
+// the most it may hold, if limit is not 0.
+typedef struct {
+  size_t current;
+  size_t peak;
+  size_t limit;
+  size_t categories[HEAP_CATEGORIES];
+} heap_stats;
+
+#define ALLOCATE_AS(category, type, count) \
+    (type*)reallocate_as(category, NULL, 0, sizeof(type)*(count))
+#define ALLOCATE(type, count) ALLOCATE_AS(HEAP_OTHER, type, count)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
+#define GROW_ARRAY_AS(category, previous, type, oldc, count) \
+    (type*)reallocate_as(category, previous, sizeof(type) * (oldc), sizeof(type) * (count))
 #define GROW_ARRAY(previous, type, oldc, count) \
-    (type*)reallocate(previous, sizeof(type) * (oldc), sizeof(type) * (count))
+    GROW_ARRAY_AS(HEAP_OTHER, previous, type, oldc, count)
 
-#define FREE_ARRAY(type, p, oldc) reallocate(p, sizeof(type) * (oldc), 0)
+#define FREE_ARRAY_AS(category, type, p, oldc) \
+    reallocate_as(category, p, sizeof(type) * (oldc), 0)
+#define FREE_ARRAY(type, p, oldc) FREE_ARRAY_AS(HEAP_OTHER, type, p, oldc)
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// The first collection comes after this many bytes of objects. Every later one
+// comes once the heap has grown by the VM's gc_growth over what survived.
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_GROWTH 2.0
+
+// Young objects live in a nursery of NURSERY_SIZE bytes, unless they are
+// larger than NURSERY_MAX_OBJECT.
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 16)
+#define ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Memory handed out piecemeal and given back all at once, for what
+// compiling a script allocates. Blocks are chained, newest first, and only
+// the last thing allocated can grow in place. Blocks count as other until
+// handed out, and used keeps track of what they were handed out as.
+typedef struct arena_block {
+  struct arena_block* next;
+  size_t size;
+  size_t used;
+  char data[];
+} arena_block;
+
+typedef struct {
+  arena_block* blocks;
+  void* last;
+  size_t used[HEAP_CATEGORIES];
+  // Set once a block could not be had. What asked for it got NULL.
+  bool failed;
+} arena;
+
+void* reallocate_as(heap_category, void*, size_t, size_t);
 void* reallocate(void*, size_t, size_t);
+void mark_value(value);
+bool init_arena(arena*, size_t);
+bool arena_reserve(arena*, size_t);
+void* arena_allocate(arena*, heap_category, size_t);
+void* arena_grow(arena*, heap_category, void*, size_t, size_t);
+void free_arena(arena*);
 
 #endif
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,53 +14,72 @@ void print_obj(value v) {
     case STRING:
       printf("%s", AS_CSTRING(v));
       break;
+    case BOXED_INTEGER:
+      printf("%" PRId64, ((obj_int*)AS_OBJ(v))->value);
+      break;
   }
 }
 
 static obj* allocate_obj(vm* cvm, size_t size, obj_type type) {
-  obj* o = (obj*)reallocate(NULL, 0, size);
+  obj* o = allocate_object(cvm, size);
+  if (!o) return NULL;
   o->type = type;
-  o->next = cvm->objs;
-  cvm->objs = o;
+  o->marked = false;
   return o;
 }
 
-static obj_str* allocate_str(vm* cvm, char* chars, int len, uint32_t hash) {
+// A string of len chars for the caller to fill in. It stays out of the
+// intern table, which saves hashing it and probing for it, and which only
+// values_equal() has to make up for.
+obj_str* new_str(void* cvm, int len) {
   obj_str* string = (obj_str*)allocate_obj(cvm, offsetof(obj_str, chars)+len+1, STRING);
+  if (!string) return NULL;
   string->len = len;
-  for (int i = 0; i < len; i++) string->chars[i] = chars[i];
   string->chars[len] = '\0';
+  string->hash = 0;
+  string->interned = false;
+  return string;
+}
+
+static obj_str* allocate_str(vm* cvm, char* chars, int len, uint32_t hash) {
+  obj_str* string = new_str(cvm, len);
+  if (!string) return NULL;
+  memcpy(string->chars, chars, len);
   string->hash = hash;
+  string->interned = true;
 
   table_set(&cvm->strings, string, NIL_VAL);
 
   return string;
 }
 
-static uint32_t hash_str(const char* key, int len) {
-  uint32_t hash = 2166136261u;
-
-  for (int i = 0; i < len; i++) {
-    hash ^= key[i];
-    hash *= 16777619;
+// The compiler needs its strings to stay where they are, and an interned one
+// may still be young. Fails, leaving *interned NULL, if it cannot be moved
+// out of the nursery.
+static bool find_interned(vm* cvm, const char* chars, int len, uint32_t hash, obj_str** interned) {
+  *interned = table_find_str(&cvm->strings, chars, len, hash);
+  if (*interned && cvm->tenure && in_nursery(cvm, &(*interned)->o)) {
+    *interned = NULL;
+    if (!collect_nursery(cvm)) return false;
+    *interned = table_find_str(&cvm->strings, chars, len, hash);
   }
-
-  return hash;
+  return true;
 }
 
 obj_str* take_str(void* cvm, char* chars, int len) {
-  uint32_t hash = hash_str(chars, len);
-  obj_str* interned = table_find_str(&((vm*)cvm)->strings, chars, len, hash);
-  if (interned) {
-    FREE_ARRAY(char, chars, len);
-    return interned;
+  uint32_t hash = hash_string(chars, len);
+  obj_str* interned;
+  if (find_interned(cvm, chars, len, hash, &interned) && !interned) {
+    interned = allocate_str((vm*)cvm, chars, len, hash);
   }
-  return allocate_str((vm*)cvm, chars, len, hash);
+  FREE_ARRAY_AS(HEAP_STRINGS, char, chars, len+1);
+  return interned;
 }
 
 obj_str* copy_str(void* cvm, const char* chars, int len) {
-  uint32_t hash = hash_str(chars, len);
-  obj_str* interned = table_find_str(&((vm*)cvm)->strings, chars, len, hash);
+  uint32_t hash = hash_string(chars, len);
+  obj_str* interned;
+  if (!find_interned(cvm, chars, len, hash, &interned)) return NULL;
   if (interned) return interned;
   return allocate_str((vm*)cvm, (char*)chars, len, hash);
 }
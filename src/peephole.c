@@ -0,0 +1,133 @@
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "memory.h"
+#include "peephole.h"
+
+// Returns the length in bytes of the n instructions starting at offs if
+// their opcodes are the ones given and nothing jumps into their middle,
+// or 0 otherwise.
+static int sequence(chunk* c, bool* is_target, int offs, int n, ...) {
+  va_list ops;
+  va_start(ops, n);
+
+  int len = 0;
+  for (int i = 0; i < n; i++) {
+    int at = offs+len;
+    if (at >= c->count || c->code[at] != va_arg(ops, int) || (i && is_target[at])) {
+      len = 0;
+      break;
+    }
+    len += instruction_length(c->code[at]);
+  }
+
+  va_end(ops);
+  return len;
+}
+
+// The length of the local += constant sequence at offs, or 0. The compiler
+// may have picked an unchecked add, which the superinstruction covers as
+// well.
+static int add_local_constant(chunk* c, bool* is_target, int offs) {
+  static const uint8_t adds[] = { OP_ADD, OP_ADD_NUMERIC, OP_ADD_DOUBLE };
+  uint8_t* code = c->code+offs;
+  int len;
+
+  for (int i = 0; i < (int)(sizeof(adds)/sizeof(adds[0])); i++) {
+    if ((len = sequence(c, is_target, offs, 5, OP_GET_LOCAL, OP_CONSTANT, adds[i],
+                                               OP_SET_LOCAL, OP_POP)) &&
+        code[1] == code[6]) {
+      return len;
+    }
+  }
+
+  return 0;
+}
+
+// Emits the superinstruction for the sequence at offs, if there is one, and
+// returns the number of bytes it replaces. Otherwise the instruction is
+// copied over as is.
+static int fuse(chunk* c, bool* is_target, int offs, chunk* out, int line) {
+  uint8_t* code = c->code+offs;
+  int len;
+
+  if ((len = add_local_constant(c, is_target, offs))) {
+    write_chunk(out, OP_ADD_LOCAL_CONSTANT, line);
+    write_chunk(out, code[1], line);
+    write_chunk(out, code[3], line);
+    return len;
+  }
+
+  if ((len = sequence(c, is_target, offs, 2, OP_SET_LOCAL, OP_POP))) {
+    write_chunk(out, OP_SET_LOCAL_POP, line);
+    write_chunk(out, code[1], line);
+    return len;
+  }
+
+  if ((len = sequence(c, is_target, offs, 2, OP_SET_GLOBAL, OP_POP))) {
+    write_chunk(out, OP_SET_GLOBAL_POP, line);
+    write_chunk(out, code[1], line);
+    write_chunk(out, code[2], line);
+    return len;
+  }
+
+  // Fusing is greedy, so a pair whose second half starts an add to a local
+  // is left apart, or the add would lose it.
+  if ((len = sequence(c, is_target, offs, 2, OP_GET_LOCAL, OP_GET_LOCAL)) &&
+      !add_local_constant(c, is_target, offs + 2)) {
+    write_chunk(out, OP_GET_LOCALS, line);
+    write_chunk(out, code[1], line);
+    write_chunk(out, code[3], line);
+    return len;
+  }
+
+  len = instruction_length(code[0]);
+  for (int i = 0; i < len; i++) write_chunk(out, code[i], line);
+  return len;
+}
+
+// Rewrites common instruction sequences into superinstructions. Jumps are
+// retargeted afterwards, and every new instruction keeps the line of the
+// first instruction it replaces.
+void peephole_optimize(chunk* c) {
+  int count = c->count;
+  bool* is_target = ALLOCATE(bool, c->count+1);
+  int* lines = ALLOCATE(int, c->count);
+  int* map = ALLOCATE(int, c->count+1);
+
+  for (int i = 0; i <= c->count; i++) is_target[i] = false;
+  for (int offs = 0; offs < c->count; offs += instruction_length(c->code[offs])) {
+    int target = jump_target(c, offs);
+    if (target != -1) is_target[target] = true;
+  }
+
+  for (int i = 0, offs = 0; i < c->lines_count; i += 2) {
+    for (int j = 0; j < c->lines[i]; j++) lines[offs++] = c->lines[i+1];
+  }
+
+  chunk out;
+  init_chunk(&out);
+  out.arena = c->arena;
+
+  for (int offs = 0; offs < c->count;) {
+    map[offs] = out.count;
+    offs += fuse(c, is_target, offs, &out, lines[offs]);
+  }
+  map[c->count] = out.count;
+
+  // Code the arena had no room for is missing, and c stays as it was.
+  if (out.arena && out.arena->failed) free_chunk(&out);
+  else {
+    for (int offs = 0; offs < c->count; offs += instruction_length(c->code[offs])) {
+      int target = jump_target(c, offs);
+      if (target != -1) set_jump_target(&out, map[offs], map[target]);
+    }
+
+    replace_code(c, &out);
+  }
+
+  FREE_ARRAY(bool, is_target, count+1);
+  FREE_ARRAY(int, lines, count);
+  FREE_ARRAY(int, map, count+1);
+}
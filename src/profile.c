@@ -0,0 +1,204 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "profile.h"
+#include "vm.h"
+
+// The profile keeps to malloc, so as not to show up in the heap it
+// profiles, nor profile itself.
+
+void init_profile(profile* p) {
+  p->lines = NULL;
+  p->capacity = 0;
+}
+
+void free_profile(profile* p) {
+  free(p->lines);
+  init_profile(p);
+}
+
+// Attributes an allocation of bytes to the line of the instruction at the
+// VM's site, or to the compiler if no instruction is running. A line's
+// count sticks at SIZE_MAX rather than wrap back to something plausible.
+void profile_allocation(void* v, size_t bytes, bool object) {
+  vm* cvm = (vm*)v;
+  profile* p = cvm->profile;
+
+  int line = 0;
+  if (!cvm->tenure && cvm->c && cvm->site >= 0) {
+    line = get_line(cvm->c->lines, cvm->c->lines_count, cvm->site);
+  }
+
+  if (line >= p->capacity) {
+    int oldc = p->capacity;
+    while (p->capacity <= line) p->capacity = GROW_CAPACITY(p->capacity);
+    p->lines = realloc(p->lines, sizeof(profile_line) * p->capacity);
+    memset(p->lines + oldc, 0, sizeof(profile_line) * (p->capacity - oldc));
+  }
+
+  profile_line* l = &p->lines[line];
+  l->bytes = bytes > SIZE_MAX - l->bytes ? SIZE_MAX : l->bytes + bytes;
+  l->objects += object;
+}
+
+static profile* sorted;
+
+static int by_volume(const void* a, const void* b) {
+  profile_line* x = &sorted->lines[*(const int*)a];
+  profile_line* y = &sorted->lines[*(const int*)b];
+  if (x->bytes != y->bytes) return x->bytes < y->bytes ? 1 : -1;
+  if (x->objects != y->objects) return x->objects < y->objects ? 1 : -1;
+  return *(const int*)a - *(const int*)b;
+}
+
+// The lines that allocated anything, most bytes first. Returns how many.
+static int allocating_lines(profile* p, int* out) {
+  int n = 0;
+  for (int i = 0; i < p->capacity; i++) {
+    if (p->lines[i].bytes || p->lines[i].objects) out[n++] = i;
+  }
+
+  sorted = p;
+  qsort(out, n, sizeof(int), by_volume);
+  return n;
+}
+
+void print_profile(profile* p, FILE* out) {
+  int* order = malloc(sizeof(int) * (p->capacity + 1));
+  int n = allocating_lines(p, order);
+  size_t bytes = 0, objects = 0;
+
+  fputs("allocations by line, most bytes first:\n", out);
+  fprintf(out, "  %14s %10s  line\n", "bytes", "objects");
+  for (int i = 0; i < n; i++) {
+    profile_line* l = &p->lines[order[i]];
+    bytes = l->bytes > SIZE_MAX - bytes ? SIZE_MAX : bytes + l->bytes;
+    objects += l->objects;
+    if (order[i]) fprintf(out, "  %14zu %10zu  %d\n", l->bytes, l->objects, order[i]);
+    else fprintf(out, "  %14zu %10zu  (compiling)\n", l->bytes, l->objects);
+  }
+  fprintf(out, "  %14zu %10zu  total\n", bytes, objects);
+
+  free(order);
+}
+
+// The profile is written as an uncompressed profile.proto message, which
+// pprof reads as it is. Only the handful of fields it needs are encoded.
+typedef struct {
+  uint8_t* data;
+  size_t count;
+  size_t capacity;
+} buffer;
+
+static void put_bytes(buffer* b, const void* data, size_t len) {
+  if (b->count + len > b->capacity) {
+    while (b->count + len > b->capacity) b->capacity = GROW_CAPACITY(b->capacity);
+    b->data = realloc(b->data, b->capacity);
+  }
+  memcpy(b->data + b->count, data, len);
+  b->count += len;
+}
+
+static void put_varint(buffer* b, uint64_t v) {
+  uint8_t bytes[10];
+  int n = 0;
+  do {
+    bytes[n++] = (uint8_t)(v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+    v >>= 7;
+  } while (v);
+  put_bytes(b, bytes, n);
+}
+
+static void put_int(buffer* b, int field, uint64_t v) {
+  put_varint(b, (uint64_t)field << 3);
+  put_varint(b, v);
+}
+
+static void put_field(buffer* b, int field, const void* data, size_t len) {
+  put_varint(b, (uint64_t)field << 3 | 2);
+  put_varint(b, len);
+  put_bytes(b, data, len);
+}
+
+// Writes message as field of b, and empties it for the next one.
+static void put_message(buffer* b, int field, buffer* message) {
+  put_field(b, field, message->data, message->count);
+  message->count = 0;
+}
+
+enum {
+  STR_EMPTY,
+  STR_OBJECTS,
+  STR_COUNT,
+  STR_SPACE,
+  STR_BYTES,
+  STR_FILE,
+  STR_SCRIPT,
+  STR_COMPILING,
+};
+
+static void put_value_type(buffer* b, buffer* m, int type, int unit) {
+  put_int(m, 1, type);
+  put_int(m, 2, unit);
+  put_message(b, 1, m);
+}
+
+static void put_function(buffer* b, buffer* m, int id, int name) {
+  put_int(m, 1, id);
+  put_int(m, 2, name);
+  put_int(m, 4, STR_FILE);
+  put_message(b, 5, m);
+}
+
+// Every line gets a location of its own, numbered one past it, in a
+// function called script, or one for the compiler for line 0.
+bool write_pprof(profile* p, const char* script, const char* path) {
+  buffer b = {NULL, 0, 0}, m = {NULL, 0, 0}, inner = {NULL, 0, 0};
+
+  put_value_type(&b, &m, STR_OBJECTS, STR_COUNT);
+  put_value_type(&b, &m, STR_SPACE, STR_BYTES);
+
+  for (int i = 0; i < p->capacity; i++) {
+    profile_line* l = &p->lines[i];
+    if (!l->bytes && !l->objects) continue;
+
+    put_varint(&inner, i + 1);
+    put_field(&m, 1, inner.data, inner.count);
+    inner.count = 0;
+    put_varint(&inner, l->objects);
+    put_varint(&inner, l->bytes);
+    put_field(&m, 2, inner.data, inner.count);
+    inner.count = 0;
+    put_message(&b, 2, &m);
+
+    put_int(&inner, 1, i ? 1 : 2);
+    put_int(&inner, 2, i);
+    put_int(&m, 1, i + 1);
+    put_message(&m, 4, &inner);
+    put_message(&b, 4, &m);
+  }
+
+  put_function(&b, &m, 1, STR_SCRIPT);
+  put_function(&b, &m, 2, STR_COMPILING);
+
+  const char* strings[] = {
+    "", "alloc_objects", "count", "alloc_space", "bytes", script, "script", "(compiling)"
+  };
+  for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+    put_field(&b, 6, strings[i], strlen(strings[i]));
+  }
+  put_int(&b, 14, STR_SPACE);
+
+  FILE* out = fopen(path, "wb");
+  bool ok = out && fwrite(b.data, 1, b.count, out) == b.count;
+  if (out) ok = !fclose(out) && ok;
+
+  free(b.data);
+  free(m.data);
+  free(inner.data);
+  return ok;
+}
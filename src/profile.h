@@ -0,0 +1,27 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// What the instructions of one source line allocated.
+typedef struct {
+  size_t bytes;
+  size_t objects;
+} profile_line;
+
+// Allocations by source line, line 0 standing for those made while
+// compiling.
+typedef struct {
+  profile_line* lines;
+  int capacity;
+} profile;
+
+void init_profile(profile*);
+void free_profile(profile*);
+void profile_allocation(void*, size_t, bool);
+void print_profile(profile*, FILE*);
+bool write_pprof(profile*, const char*, const char*);
+
+#endif
@@ -0,0 +1,342 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "memory.h"
+#include "regcode.h"
+
+void init_reg_code(reg_code* rc) {
+  rc->code = NULL;
+  rc->count = 0;
+  rc->capacity = 0;
+  rc->offsets = NULL;
+  rc->registers = 0;
+  rc->frame_size = 0;
+  rc->threaded = false;
+}
+
+void free_reg_code(reg_code* rc) {
+  FREE_ARRAY(reg_inst, rc->code, rc->capacity);
+  FREE_ARRAY(int, rc->offsets, rc->capacity);
+  init_reg_code(rc);
+}
+
+// The register backend. It lowers the finished stack code rather than
+// compiling the source once more: every stack slot becomes a register, and
+// the stack is simulated while the code is walked, so that instead of moving
+// values through it the instructions name the registers the values already
+// are in.
+typedef struct {
+  chunk* c;
+  reg_code* out;
+  int offs;
+  int depth;
+  // The frame slot every stack slot's value currently lives in. Pushing a
+  // local or a constant does not copy it, the slot just refers to it.
+  int* src;
+  // The instruction that computed the value on top of the stack into its
+  // own register, or -1.
+  int result;
+  int constants;
+} lowering;
+
+static int emit(lowering* l, uint8_t op, int a, int b, int c) {
+  reg_code* out = l->out;
+
+  if (out->capacity < out->count + 1) {
+    int oldc = out->capacity;
+    out->capacity = GROW_CAPACITY(oldc);
+    out->code = GROW_ARRAY(out->code, reg_inst, oldc, out->capacity);
+    out->offsets = GROW_ARRAY(out->offsets, int, oldc, out->capacity);
+  }
+
+  reg_inst* inst = &out->code[out->count];
+  inst->op = op;
+  inst->a = a;
+  inst->b = b;
+  inst->c = c;
+  inst->as.index = -1;
+  out->offsets[out->count] = l->offs;
+  return out->count++;
+}
+
+static void push(lowering* l, int slot) {
+  l->src[l->depth++] = slot;
+}
+
+static void push_result(lowering* l, int inst) {
+  push(l, l->depth);
+  l->result = inst;
+}
+
+static int pop(lowering* l) {
+  return l->src[--l->depth];
+}
+
+// Copies the value of stack slot i into its own register.
+static void materialize(lowering* l, int i) {
+  if (l->src[i] == i) return;
+  emit(l, OP_MOVE, i, l->src[i], 0);
+  l->src[i] = i;
+}
+
+// Control flow only ever meets with every value in its own register.
+static void materialize_all(lowering* l) {
+  for (int i = 0; i < l->depth; i++) materialize(l, i);
+}
+
+// Whether any stack slot but the local's own refers to it.
+static bool referenced(lowering* l, int local) {
+  for (int i = 0; i < l->depth; i++) {
+    if (i != local && l->src[i] == local) return true;
+  }
+
+  return false;
+}
+
+// Moves whatever still refers to a local out of the way before it changes.
+static void release(lowering* l, int local) {
+  for (int i = 0; i < l->depth; i++) {
+    if (i != local && l->src[i] == local) materialize(l, i);
+  }
+}
+
+// Assigns the top of the stack to a local. When the value was just computed,
+// the instruction computing it writes the local instead.
+static void set_local(lowering* l, int local) {
+  int top = l->depth - 1;
+  reg_code* out = l->out;
+
+  if (l->result == out->count - 1 && l->src[top] == top &&
+      !referenced(l, local)) {
+    out->code[l->result].a = local;
+  } else {
+    release(l, local);
+    if (l->src[top] != local) emit(l, OP_MOVE, local, l->src[top], 0);
+  }
+
+  l->src[local] = local;
+  l->src[top] = local;
+  l->result = -1;
+}
+
+static void branch(lowering* l, uint8_t op, int b, int c) {
+  materialize_all(l);
+  int inst = emit(l, op, 0, b, c);
+  l->out->code[inst].as.index = jump_target(l->c, l->offs);
+}
+
+// Global instructions keep the global's slot in c.
+static void global(lowering* l, uint8_t op, int a, int b) {
+  uint8_t* operand = l->c->code + l->offs + 1;
+  int inst = emit(l, op, a, b, (operand[0] << 8) | operand[1]);
+  if (op == OP_GET_GLOBAL) push_result(l, inst);
+}
+
+static bool branches(uint8_t op) {
+  switch (op) {
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP_IF_TRUE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_LOOP_IF_EQUAL:
+    case OP_LOOP_IF_NOT_EQUAL:
+    case OP_LOOP_IF_GREATER:
+    case OP_LOOP_IF_NOT_GREATER:
+    case OP_LOOP_IF_LESS:
+    case OP_LOOP_IF_NOT_LESS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void lower_instruction(lowering* l) {
+  uint8_t op = l->c->code[l->offs];
+  uint8_t* operand = l->c->code + l->offs + 1;
+
+  switch (op) {
+    case OP_CONSTANT:
+      push(l, l->constants + operand[0]);
+      break;
+    case OP_CONSTANT_LONG:
+      push(l, l->constants + (operand[0] | (operand[1] << 8) | (operand[2] << 16)));
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      push(l, l->constants + l->c->constants.count + op - OP_NIL);
+      break;
+    case OP_POP:
+      pop(l);
+      break;
+    case OP_GET_LOCAL:
+      push(l, l->src[operand[0]]);
+      break;
+    case OP_GET_LOCALS:
+      push(l, l->src[operand[0]]);
+      push(l, l->src[operand[1]]);
+      break;
+    case OP_SET_LOCAL:
+      set_local(l, operand[0]);
+      break;
+    case OP_SET_LOCAL_POP:
+      set_local(l, operand[0]);
+      pop(l);
+      break;
+    case OP_ADD_LOCAL_CONSTANT:
+      release(l, operand[0]);
+      emit(l, OP_ADD, operand[0], l->src[operand[0]], l->constants + operand[1]);
+      l->src[operand[0]] = operand[0];
+      break;
+    case OP_GET_GLOBAL:
+      global(l, op, l->depth, 0);
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+      global(l, op == OP_DEFINE_GLOBAL ? op : OP_SET_GLOBAL, 0, pop(l));
+      break;
+    case OP_SET_GLOBAL:
+      global(l, op, 0, l->src[l->depth-1]);
+      break;
+    case OP_NEGATE:
+    case OP_NEGATE_NUMERIC:
+    case OP_NEGATE_DOUBLE:
+    case OP_NOT:
+    case OP_BITNOT: {
+      int b = pop(l);
+      push_result(l, emit(l, op, l->depth, b, 0));
+      break;
+    }
+    case OP_PRINT:
+      emit(l, op, 0, pop(l), 0);
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      branch(l, op, 0, 0);
+      break;
+    case OP_JUMP_IF_FALSE:
+      branch(l, op, l->depth-1, 0);
+      break;
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LOOP_IF_TRUE: {
+      int b = pop(l);
+      branch(l, op == OP_LOOP_IF_TRUE ? op : OP_JUMP_IF_FALSE, b, 0);
+      break;
+    }
+    case OP_RETURN:
+      emit(l, op, 0, 0, 0);
+      break;
+    default: {
+      int c = pop(l);
+      int b = pop(l);
+      if (branches(op)) branch(l, op, b, c);
+      else push_result(l, emit(l, op, l->depth, b, c));
+      break;
+    }
+  }
+}
+
+// Translates the stack code of c into register code. Frames have to be
+// addressable with 16 bits, so this fails for chunks with too many
+// constants, which are then left to the stack tier.
+bool lower_registers(chunk* c, reg_code* out) {
+  int* heights = ALLOCATE(int, c->count);
+  bool* is_target = ALLOCATE(bool, c->count+1);
+  int* map = ALLOCATE(int, c->count+1);
+
+  int registers = stack_heights(c, heights);
+  out->registers = registers;
+  out->frame_size = registers + c->constants.count + 3;
+
+  if (out->frame_size > UINT16_COUNT) {
+    FREE_ARRAY(int, heights, c->count);
+    FREE_ARRAY(bool, is_target, c->count+1);
+    FREE_ARRAY(int, map, c->count+1);
+    return false;
+  }
+
+  for (int i = 0; i <= c->count; i++) is_target[i] = false;
+  for (int offs = 0; offs < c->count; offs += instruction_length(c->code[offs])) {
+    int target = jump_target(c, offs);
+    if (target != -1) is_target[target] = true;
+  }
+
+  lowering l;
+  l.c = c;
+  l.out = out;
+  l.depth = 0;
+  l.src = ALLOCATE(int, registers + 1);
+  l.result = -1;
+  l.constants = registers;
+
+  bool reached = true;
+  for (l.offs = 0; l.offs < c->count; l.offs += instruction_length(c->code[l.offs])) {
+    uint8_t op = c->code[l.offs];
+    if (heights[l.offs] == -1) {
+      reached = false;
+      continue;
+    }
+
+    // Whatever comes in from elsewhere has every value in its own register,
+    // and so has to whatever falls in from above.
+    if (is_target[l.offs] || !reached) {
+      if (reached) materialize_all(&l);
+      l.depth = heights[l.offs];
+      for (int i = 0; i < l.depth; i++) l.src[i] = i;
+      l.result = -1;
+    }
+
+    map[l.offs] = out->count;
+    lower_instruction(&l);
+    reached = falls_through(op);
+  }
+
+  for (int i = 0; i < out->count; i++) {
+    reg_inst* inst = &out->code[i];
+    if (branches(inst->op)) inst->as.index = map[inst->as.index];
+  }
+
+  FREE_ARRAY(int, l.src, registers + 1);
+  FREE_ARRAY(int, heights, c->count);
+  FREE_ARRAY(bool, is_target, c->count+1);
+  FREE_ARRAY(int, map, c->count+1);
+  return true;
+}
+
+// The value a frame slot above the registers starts out with: the chunk's
+// constants, then nil, true and false.
+value frame_constant(chunk* c, reg_code* rc, int slot) {
+  int i = slot - rc->registers;
+  if (i < c->constants.count) return c->constants.values[i];
+  return i == c->constants.count ? NIL_VAL : BOOL_VAL(i == c->constants.count + 1);
+}
+
+void init_frame(chunk* c, reg_code* rc, value* frame) {
+  for (int i = 0; i < rc->registers; i++) frame[i] = NIL_VAL;
+  for (int i = rc->registers; i < rc->frame_size; i++) {
+    frame[i] = frame_constant(c, rc, i);
+  }
+}
+
+// Resolves handlers, jump targets and global slots into the instructions,
+// much like thread_chunk does for the stack tier.
+void thread_registers(reg_code* rc, const handler* handlers, value* globals) {
+  for (int i = 0; i < rc->count; i++) {
+    reg_inst* inst = &rc->code[i];
+    inst->h = handlers[inst->op];
+
+    if (branches(inst->op)) inst->as.target = rc->code + inst->as.index;
+    else if (inst->op == OP_GET_GLOBAL || inst->op == OP_DEFINE_GLOBAL ||
+             inst->op == OP_SET_GLOBAL) {
+      inst->as.global = globals + inst->c;
+    }
+  }
+
+  rc->threaded = true;
+}
@@ -0,0 +1,42 @@
+#ifndef clox_regcode_h
+#define clox_regcode_h
+
+#include "chunk.h"
+
+// An instruction of the register tier. Operands name slots of the frame,
+// which holds the registers, one per stack slot of the stack code, followed
+// by the constants. Registers reuse the stack opcodes, reading their operands
+// from b and c and writing the result to a, plus OP_MOVE.
+typedef struct reg_inst {
+  handler h;
+  uint8_t op;
+  uint16_t a;
+  uint16_t b;
+  uint16_t c;
+  union {
+    struct reg_inst* target;
+    value* global;
+    int index;
+  } as;
+} reg_inst;
+
+typedef struct {
+  reg_inst* code;
+  int count;
+  int capacity;
+  // The offset of the stack instruction every instruction was made from,
+  // which is where its line is kept.
+  int* offsets;
+  int registers;
+  int frame_size;
+  bool threaded;
+} reg_code;
+
+void init_reg_code(reg_code*);
+void free_reg_code(reg_code*);
+bool lower_registers(chunk*, reg_code*);
+value frame_constant(chunk*, reg_code*, int);
+void init_frame(chunk*, reg_code*, value*);
+void thread_registers(reg_code*, const handler*, value*);
+
+#endif
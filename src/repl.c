@@ -1,9 +1,11 @@
 #include <stdlib.h>
+#include <string.h>
 
+#include "emit_c.h"
 #include "readline_hack.h"
 #include "repl.h"
 
-void repl(vm* cvm) {
+void repl(vm* cvm, tier t) {
   char* line;
   for (;;) {
     if (!(line = readline("> "))) {
@@ -11,7 +13,7 @@ void repl(vm* cvm) {
       break;
     }
 
-    interpret(cvm, line);
+    interpret(cvm, line, t);
     add_history(line);
     free(line);
   }
@@ -49,11 +51,42 @@ static char* read_file(const char* path) {
   return buffer;
 }
 
-void run_file(vm* cvm, const char* path) {
+// Returns the status to exit with.
+int run_file(vm* cvm, const char* path, tier t) {
   char* source = read_file(path);
-  interpret_result result = interpret(cvm, source);
+  interpret_result result = interpret(cvm, source, t);
   free(source);
 
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+  if (result == INTERPRET_COMPILE_ERROR) return 65;
+  if (result == INTERPRET_RUNTIME_ERROR) return 70;
+  return 0;
+}
+
+// Translates the script at path to C, written next to it with the extension
+// swapped for .c.
+void emit_file(vm* cvm, const char* path) {
+  char* source = read_file(path);
+  const char* dot = strrchr(path, '.');
+  const char* slash = strrchr(path, '/');
+  size_t len = dot && (!slash || dot > slash) && strcmp(dot, ".c") ? (size_t)(dot - path)
+                                                                   : strlen(path);
+  char* out_path = (char*) malloc(len + 3);
+  memcpy(out_path, path, len);
+  strcpy(out_path + len, ".c");
+
+  FILE* out = fopen(out_path, "w");
+  if (!out) {
+    fprintf(stderr, "Could not open file \"%s\".\n", out_path);
+    exit(74);
+  }
+
+  bool ok = emit_c(cvm, source, path, out);
+  fclose(out);
+  free(source);
+
+  if (!ok) {
+    remove(out_path);
+    exit(65);
+  }
+  free(out_path);
 }
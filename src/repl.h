@@ -3,7 +3,8 @@
 
 #include "vm.h"
 
-void repl(vm*);
-void run_file(vm*, const char*);
+void repl(vm*, tier);
+int run_file(vm*, const char*, tier);
+void emit_file(vm*, const char*);
 
 #endif
@@ -1,16 +1,13 @@
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "scanner.h"
 
-scanner* init_scanner(const char* source) {
-  scanner* s = malloc(sizeof(scanner));
+void init_scanner(scanner* s, const char* source) {
   s->start = source;
   s->current = source;
   s->line = 1;
-  return s;
 }
 
 static token make_token(scanner* s, token_type type) {
@@ -132,9 +129,10 @@ static token number(scanner* s) {
     advance(s);
 
     while (is_digit(peek(s))) advance(s);
+    return make_token(s, TOKEN_NUMBER);
   }
 
-  return make_token(s, TOKEN_NUMBER);
+  return make_token(s, TOKEN_INTEGER);
 }
 
 static bool is_idstart(char c) {
@@ -216,6 +214,7 @@ token scan_token(scanner* s) {
     case '+': return make_token(s, TOKEN_PLUS);
     case '/': return make_token(s, TOKEN_SLASH);
     case '*': return make_token(s, TOKEN_STAR);
+    case '%': return make_token(s, TOKEN_PERCENT);
     case '^': return make_token(s, TOKEN_HAT);
     case '~': return make_token(s, TOKEN_TILDE);
     case '|': return make_token(s, TOKEN_PIPE);
@@ -7,6 +7,7 @@ typedef enum {
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
+  TOKEN_PERCENT,
 
   // One or two character tokens.
   TOKEN_BANG, TOKEN_BANG_EQUAL,
@@ -18,7 +19,7 @@ typedef enum {
 
   // Literals.
   TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
-  TOKEN_CHAR,
+  TOKEN_INTEGER, TOKEN_CHAR,
 
   // Keywords.
   TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
@@ -43,7 +44,7 @@ typedef struct {
   int line;
 } token;
 
-scanner* init_scanner(const char* source);
+void init_scanner(scanner*, const char* source);
 
 token scan_token(scanner*);
 
@@ -0,0 +1,1399 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "compiler.h"
+#include "memory.h"
+#include "ssa.h"
+
+// The optimizing middle-end. The compiler's stack code is turned into SSA
+// form: basic blocks of instructions that each define one value, with a phi
+// for every stack slot where control flow meets. Locals are stack slots, so
+// getting and setting them only moves values around and disappears, which
+// is copy propagation. Constant folding, global value numbering,
+// loop-invariant code motion and dead code elimination then run on the
+// values, and the result is lowered back to stack code, keeping the values
+// that outlive the expression they are computed in in frame slots of their
+// own.
+//
+// Anything the pass does not understand leaves the chunk as it was.
+
+// Not an opcode: the phis of a block.
+#define PHI UINT8_MAX
+
+// Frames that would need more slots than locals can address, and graphs too
+// big for the interference matrix, stay unoptimized.
+#define MAX_SLOT_VALUES 4096
+
+typedef struct {
+  uint8_t op;
+  int block;
+  // The instruction it was made from, whose line it keeps.
+  int offs;
+  // The constant or global slot the instruction names.
+  int operand;
+  int args[2];
+  int arg_count;
+  // Phis take one argument per predecessor of their block.
+  int* phi_args;
+  // The value that turned out to be the same as this one, or -1.
+  int same;
+  int uses;
+  int user;
+  bool live;
+  // Left on the stack for its user rather than kept in a slot.
+  bool stacked;
+  // Index among the values kept in slots, or -1.
+  int reg;
+} ssa_value;
+
+typedef struct {
+  int start;
+  int end;
+  int height;
+  int* values;
+  int count;
+  int capacity;
+  // The phi of every stack slot on entry.
+  int* phis;
+  // The branch ending the block, or -1 if it falls through.
+  int term;
+  // Where control goes: succ[0] on falling through or jumping, succ[1] on
+  // taking a conditional branch.
+  int succ[2];
+  int* preds;
+  int pred_count;
+  int pred_capacity;
+  // The value of every stack slot on leaving.
+  int* exit;
+  int exit_count;
+  int rpo;
+  int idom;
+  uint64_t* live_in;
+} ssa_block;
+
+typedef struct {
+  chunk* c;
+  int* heights;
+  int* block_of;
+  int* lines;
+  ssa_value* values;
+  int count;
+  int capacity;
+  // Open addressing over the constant values, one per distinct constant.
+  int* constants;
+  int constant_count;
+  int constant_capacity;
+  ssa_block* blocks;
+  int block_count;
+  // The blocks in reverse postorder.
+  int* order;
+  // Dense over the values kept in slots.
+  int regs;
+  int words;
+  uint64_t* interference;
+  int* group;
+  int* color;
+  int slots;
+} ssa;
+
+#define WORDS(n) (((n) + 63) / 64)
+
+static bool has_bit(uint64_t* set, int i) {
+  return set[i / 64] & ((uint64_t)1 << (i % 64));
+}
+
+static void set_bit(uint64_t* set, int i) {
+  set[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static void clear_bit(uint64_t* set, int i) {
+  set[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+static bool is_constant(uint8_t op) {
+  return op == OP_CONSTANT || op == OP_CONSTANT_LONG || op == OP_NIL ||
+         op == OP_TRUE || op == OP_FALSE;
+}
+
+// Instructions that can neither fail nor have effects, which is what the
+// compiler's unchecked arithmetic is for.
+static bool is_pure(uint8_t op) {
+  if (is_constant(op)) return true;
+
+  switch (op) {
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_ADD_NUMERIC:
+    case OP_SUBTRACT_NUMERIC:
+    case OP_MULTIPLY_NUMERIC:
+    case OP_DIVIDE_NUMERIC:
+    case OP_NEGATE_NUMERIC:
+    case OP_GREATER_NUMERIC:
+    case OP_LESS_NUMERIC:
+    case OP_ADD_DOUBLE:
+    case OP_SUBTRACT_DOUBLE:
+    case OP_MULTIPLY_DOUBLE:
+    case OP_DIVIDE_DOUBLE:
+    case OP_NEGATE_DOUBLE:
+    case OP_GREATER_DOUBLE:
+    case OP_LESS_DOUBLE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool is_branch(uint8_t op) {
+  return (op >= OP_JUMP_IF_FALSE && op <= OP_LOOP_IF_NOT_LESS) || op == OP_RETURN;
+}
+
+static bool has_result(uint8_t op) {
+  return !is_branch(op) && op != OP_PRINT && op != OP_DEFINE_GLOBAL && op != OP_SET_GLOBAL;
+}
+
+static bool supported(uint8_t op) {
+  return op <= OP_LESS_DOUBLE;
+}
+
+static int new_value(ssa* s, uint8_t op, int block, int offs) {
+  if (s->capacity < s->count + 1) {
+    int oldc = s->capacity;
+    s->capacity = GROW_CAPACITY(oldc);
+    s->values = GROW_ARRAY(s->values, ssa_value, oldc, s->capacity);
+  }
+
+  ssa_value* v = &s->values[s->count];
+  v->op = op;
+  v->block = block;
+  v->offs = offs;
+  v->operand = -1;
+  v->arg_count = 0;
+  v->phi_args = NULL;
+  v->same = -1;
+  v->uses = 0;
+  v->user = -1;
+  v->live = true;
+  v->stacked = false;
+  v->reg = -1;
+  return s->count++;
+}
+
+static int new_op(ssa* s, uint8_t op, int block, int offs, int arg_count, int a, int b) {
+  int v = new_value(s, op, block, offs);
+  s->values[v].arg_count = arg_count;
+  s->values[v].args[0] = a;
+  s->values[v].args[1] = b;
+  return v;
+}
+
+static void append_value(ssa_block* blk, int v) {
+  if (blk->capacity < blk->count + 1) {
+    int oldc = blk->capacity;
+    blk->capacity = GROW_CAPACITY(oldc);
+    blk->values = GROW_ARRAY(blk->values, int, oldc, blk->capacity);
+  }
+  blk->values[blk->count++] = v;
+}
+
+static void add_pred(ssa_block* blk, int pred) {
+  if (blk->pred_capacity < blk->pred_count + 1) {
+    int oldc = blk->pred_capacity;
+    blk->pred_capacity = GROW_CAPACITY(oldc);
+    blk->preds = GROW_ARRAY(blk->preds, int, oldc, blk->pred_capacity);
+  }
+  blk->preds[blk->pred_count++] = pred;
+}
+
+// Numbers are only the same constant as numbers of the same kind and bits,
+// which keeps 1 apart from 1.0 and 0.0 apart from -0.0.
+static bool same_constant(value a, value b) {
+  if (IS_NUMBER(a) || IS_NUMBER(b)) {
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a), y = AS_NUMBER(b);
+    return !memcmp(&x, &y, sizeof(double));
+  }
+
+  return IS_INTEGER(a) == IS_INTEGER(b) && values_equal(a, b);
+}
+
+static bool in_pool(uint8_t op) {
+  return op == OP_CONSTANT || op == OP_CONSTANT_LONG;
+}
+
+static uint32_t hash_constant(uint8_t op, value c) {
+  if (!in_pool(op)) return op;
+
+  uint64_t bits = 0;
+  if (IS_NUMBER(c)) {
+    double d = AS_NUMBER(c);
+    memcpy(&bits, &d, sizeof(bits));
+  } else if (IS_INTEGER(c)) bits = (uint64_t)AS_INTEGER(c);
+  else if (IS_STRING(c)) bits = AS_STRING(c)->hash;
+  else if (IS_CHAR(c)) bits = (uint8_t)AS_CHAR(c);
+
+  bits *= 0x9e3779b97f4a7c15u;
+  return (uint32_t)(bits >> 32);
+}
+
+// Where the constant op, with the value c if it comes from the pool, is or
+// would go among the constant values.
+static int* constant_entry(ssa* s, uint8_t op, value c) {
+  uint32_t mask = s->constant_capacity - 1;
+  for (uint32_t i = hash_constant(op, c) & mask; ; i = (i + 1) & mask) {
+    int* e = &s->constants[i];
+    if (*e == -1) return e;
+
+    ssa_value* other = &s->values[*e];
+    if (!in_pool(op) || !in_pool(other->op)) {
+      if (other->op == op) return e;
+    } else if (same_constant(s->c->constants.values[other->operand], c)) return e;
+  }
+}
+
+// Gives every literal of the same constant the same value, whatever pool
+// entry it was compiled to, so that value numbering sees them as one. The
+// value belongs to the entry block, which dominates all its uses.
+static int constant(ssa* s, uint8_t op, int operand, int offs) {
+  if (s->constant_capacity < (s->constant_count + 1) * 2) {
+    int* old = s->constants;
+    int oldc = s->constant_capacity;
+    s->constant_capacity = oldc < 16 ? 16 : oldc * 2;
+    s->constants = ALLOCATE(int, s->constant_capacity);
+    for (int i = 0; i < s->constant_capacity; i++) s->constants[i] = -1;
+    for (int i = 0; i < oldc; i++) {
+      if (old[i] == -1) continue;
+      ssa_value* v = &s->values[old[i]];
+      value c = in_pool(v->op) ? s->c->constants.values[v->operand] : NIL_VAL;
+      *constant_entry(s, v->op, c) = old[i];
+    }
+    if (old) FREE_ARRAY(int, old, oldc);
+  }
+
+  int* e = constant_entry(s, op, in_pool(op) ? s->c->constants.values[operand] : NIL_VAL);
+  if (*e != -1) return *e;
+
+  int v = new_value(s, op, 0, offs);
+  s->values[v].operand = operand;
+  s->constant_count++;
+  return *e = v;
+}
+
+// Follows the chain of values found to be the same.
+static int find(ssa* s, int v) {
+  while (s->values[v].same != -1) v = s->values[v].same;
+  return v;
+}
+
+// Splits the reachable code into blocks and links them up. Fails on
+// instructions the pass does not know.
+static bool find_blocks(ssa* s) {
+  chunk* c = s->c;
+  bool* leader = ALLOCATE(bool, c->count+1);
+  bool ok = true;
+
+  for (int i = 0; i <= c->count; i++) leader[i] = false;
+  leader[0] = true;
+
+  for (int offs = 0; offs < c->count; offs += instruction_length(c->code[offs])) {
+    uint8_t op = c->code[offs];
+    if (s->heights[offs] == -1) continue;
+    if (!supported(op)) ok = false;
+
+    int target = jump_target(c, offs);
+    if (target != -1) leader[target] = true;
+    if (is_branch(op)) leader[offs + instruction_length(op)] = true;
+  }
+
+  for (int offs = 0; offs < c->count; offs += instruction_length(c->code[offs])) {
+    s->block_of[offs] = -1;
+    if (!leader[offs] || s->heights[offs] == -1) continue;
+    s->block_of[offs] = s->block_count++;
+  }
+
+  s->blocks = ALLOCATE(ssa_block, s->block_count);
+  int b = -1;
+  for (int offs = 0; offs < c->count; offs += instruction_length(c->code[offs])) {
+    if (s->heights[offs] == -1) continue;
+    if (s->block_of[offs] != -1) {
+      b = s->block_of[offs];
+      ssa_block* blk = &s->blocks[b];
+      blk->start = offs;
+      blk->height = s->heights[offs];
+      blk->values = NULL;
+      blk->count = blk->capacity = 0;
+      blk->phis = NULL;
+      blk->term = -1;
+      blk->succ[0] = blk->succ[1] = -1;
+      blk->preds = NULL;
+      blk->pred_count = blk->pred_capacity = 0;
+      blk->exit = NULL;
+      blk->live_in = NULL;
+    }
+    s->blocks[b].end = offs + instruction_length(c->code[offs]);
+  }
+
+  for (b = 0; ok && b < s->block_count; b++) {
+    ssa_block* blk = &s->blocks[b];
+    int last = blk->start;
+    while (last + instruction_length(c->code[last]) < blk->end) {
+      last += instruction_length(c->code[last]);
+    }
+
+    uint8_t op = c->code[last];
+    int target = jump_target(c, last);
+    if (op == OP_JUMP || op == OP_LOOP) blk->succ[0] = s->block_of[target];
+    else if (op != OP_RETURN) {
+      // Code that runs off the end of the chunk is left alone.
+      if (blk->end >= c->count || s->block_of[blk->end] == -1) ok = false;
+      else blk->succ[0] = s->block_of[blk->end];
+      if (target != -1) blk->succ[1] = s->block_of[target];
+    }
+  }
+
+  for (b = 0; ok && b < s->block_count; b++) {
+    for (int i = 0; i < 2; i++) {
+      if (s->blocks[b].succ[i] != -1) add_pred(&s->blocks[s->blocks[b].succ[i]], b);
+    }
+  }
+
+  FREE_ARRAY(bool, leader, c->count+1);
+  return ok;
+}
+
+// Works through the instructions of a block on an abstract stack of values.
+static void build_block(ssa* s, int b, int* stack) {
+  chunk* c = s->c;
+  ssa_block* blk = &s->blocks[b];
+  int h = blk->height;
+
+  for (int i = 0; i < h; i++) stack[i] = blk->phis[i];
+
+  for (int offs = blk->start; offs < blk->end; offs += instruction_length(c->code[offs])) {
+    uint8_t op = c->code[offs];
+    uint8_t* operand = c->code + offs + 1;
+    int v;
+
+    switch (op) {
+      case OP_CONSTANT:
+        stack[h++] = constant(s, op, operand[0], offs);
+        break;
+      case OP_CONSTANT_LONG:
+        stack[h++] = constant(s, op, operand[0] | (operand[1] << 8) | (operand[2] << 16), offs);
+        break;
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE:
+        stack[h++] = constant(s, op, -1, offs);
+        break;
+      case OP_POP:
+        h--;
+        break;
+      case OP_GET_LOCAL:
+        stack[h] = stack[operand[0]];
+        h++;
+        break;
+      case OP_GET_LOCALS:
+        stack[h] = stack[operand[0]];
+        stack[h+1] = stack[operand[1]];
+        h += 2;
+        break;
+      case OP_SET_LOCAL:
+        stack[operand[0]] = stack[h-1];
+        break;
+      case OP_SET_LOCAL_POP:
+        stack[operand[0]] = stack[--h];
+        break;
+      case OP_ADD_LOCAL_CONSTANT: {
+        v = new_op(s, OP_ADD, b, offs, 2, stack[operand[0]], constant(s, OP_CONSTANT, operand[1], offs));
+        append_value(blk, v);
+        stack[operand[0]] = v;
+        break;
+      }
+      case OP_GET_GLOBAL:
+        v = new_value(s, op, b, offs);
+        s->values[v].operand = (operand[0] << 8) | operand[1];
+        append_value(blk, v);
+        stack[h++] = v;
+        break;
+      case OP_DEFINE_GLOBAL:
+      case OP_SET_GLOBAL:
+      case OP_SET_GLOBAL_POP:
+        v = new_op(s, op == OP_DEFINE_GLOBAL ? op : OP_SET_GLOBAL, b, offs, 1, stack[h-1], 0);
+        s->values[v].operand = (operand[0] << 8) | operand[1];
+        append_value(blk, v);
+        if (op != OP_SET_GLOBAL) h--;
+        break;
+      case OP_PRINT:
+        append_value(blk, new_op(s, op, b, offs, 1, stack[--h], 0));
+        break;
+      case OP_NEGATE:
+      case OP_NEGATE_NUMERIC:
+      case OP_NEGATE_DOUBLE:
+      case OP_NOT:
+      case OP_BITNOT:
+        v = new_op(s, op, b, offs, 1, stack[h-1], 0);
+        append_value(blk, v);
+        stack[h-1] = v;
+        break;
+      case OP_JUMP:
+      case OP_LOOP:
+      case OP_RETURN:
+        blk->term = new_op(s, op, b, offs, 0, 0, 0);
+        break;
+      case OP_JUMP_IF_FALSE:
+        blk->term = new_op(s, op, b, offs, 1, stack[h-1], 0);
+        break;
+      case OP_POP_JUMP_IF_FALSE:
+      case OP_LOOP_IF_TRUE:
+        blk->term = new_op(s, op, b, offs, 1, stack[h-1], 0);
+        h--;
+        break;
+      default:
+        v = new_op(s, op, b, offs, 2, stack[h-2], stack[h-1]);
+        h -= 2;
+        if (jump_target(c, offs) != -1) blk->term = v;
+        else {
+          append_value(blk, v);
+          stack[h++] = v;
+        }
+        break;
+    }
+  }
+
+  blk->exit = ALLOCATE(int, h+1);
+  blk->exit_count = h;
+  memcpy(blk->exit, stack, sizeof(int) * h);
+}
+
+// A phi whose arguments are all the same value, or itself, is that value.
+static void remove_trivial_phis(ssa* s) {
+  bool changed = true;
+
+  while (changed) {
+    changed = false;
+
+    for (int b = 0; b < s->block_count; b++) {
+      ssa_block* blk = &s->blocks[b];
+      if (!blk->phis) continue;
+
+      for (int i = 0; i < blk->height; i++) {
+        int p = blk->phis[i];
+        if (s->values[p].same != -1) continue;
+
+        int only = -1;
+        bool trivial = true;
+        for (int k = 0; k < blk->pred_count; k++) {
+          int a = find(s, s->values[p].phi_args[k]);
+          if (a == p || a == only) continue;
+          if (only != -1) {
+            trivial = false;
+            break;
+          }
+          only = a;
+        }
+
+        if (trivial && only != -1) {
+          s->values[p].same = only;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+// Points every argument at the value it stands for.
+static void resolve_args(ssa* s) {
+  for (int v = 0; v < s->count; v++) {
+    ssa_value* val = &s->values[v];
+    for (int i = 0; i < val->arg_count; i++) val->args[i] = find(s, val->args[i]);
+    if (val->op != PHI) continue;
+    int preds = s->blocks[val->block].pred_count;
+    for (int k = 0; k < preds; k++) val->phi_args[k] = find(s, val->phi_args[k]);
+  }
+}
+
+static bool build(ssa* s) {
+  if (!find_blocks(s)) return false;
+
+  for (int b = 1; b < s->block_count; b++) {
+    ssa_block* blk = &s->blocks[b];
+    blk->phis = ALLOCATE(int, blk->height+1);
+    for (int i = 0; i < blk->height; i++) {
+      int p = new_value(s, PHI, b, blk->start);
+      s->values[p].phi_args = ALLOCATE(int, blk->pred_count);
+      s->values[p].operand = i;
+      blk->phis[i] = p;
+    }
+  }
+
+  int max = 0;
+  for (int offs = 0; offs < s->c->count; offs++) {
+    if (s->heights[offs] > max) max = s->heights[offs];
+  }
+  int* stack = ALLOCATE(int, max+3);
+  for (int b = 0; b < s->block_count; b++) build_block(s, b, stack);
+  FREE_ARRAY(int, stack, max+3);
+
+  for (int b = 1; b < s->block_count; b++) {
+    ssa_block* blk = &s->blocks[b];
+    for (int i = 0; i < blk->height; i++) {
+      ssa_value* p = &s->values[blk->phis[i]];
+      for (int k = 0; k < blk->pred_count; k++) p->phi_args[k] = s->blocks[blk->preds[k]].exit[i];
+    }
+  }
+
+  remove_trivial_phis(s);
+  resolve_args(s);
+  return true;
+}
+
+// Numbers the blocks in reverse postorder and finds their immediate
+// dominators, after Cooper, Harvey and Kennedy.
+static void find_dominators(ssa* s) {
+  int n = s->block_count;
+  int* stack = ALLOCATE(int, n);
+  int* next = ALLOCATE(int, n);
+  bool* seen = ALLOCATE(bool, n);
+  int depth = 0;
+  int post = n;
+
+  s->order = ALLOCATE(int, n);
+  for (int b = 0; b < n; b++) {
+    seen[b] = false;
+    next[b] = 0;
+    s->blocks[b].idom = -1;
+  }
+
+  stack[depth++] = 0;
+  seen[0] = true;
+  while (depth) {
+    int b = stack[depth-1];
+    ssa_block* blk = &s->blocks[b];
+    if (next[b] < 2) {
+      int succ = blk->succ[next[b]++];
+      if (succ != -1 && !seen[succ]) {
+        seen[succ] = true;
+        stack[depth++] = succ;
+      }
+      continue;
+    }
+    depth--;
+    s->order[--post] = b;
+    blk->rpo = post;
+  }
+
+  s->blocks[0].idom = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 1; i < n; i++) {
+      int b = s->order[i];
+      ssa_block* blk = &s->blocks[b];
+      int idom = -1;
+
+      for (int k = 0; k < blk->pred_count; k++) {
+        int p = blk->preds[k];
+        if (s->blocks[p].idom == -1) continue;
+        if (idom == -1) {
+          idom = p;
+          continue;
+        }
+
+        int x = p;
+        int y = idom;
+        while (x != y) {
+          while (s->blocks[x].rpo > s->blocks[y].rpo) x = s->blocks[x].idom;
+          while (s->blocks[y].rpo > s->blocks[x].rpo) y = s->blocks[y].idom;
+        }
+        idom = x;
+      }
+
+      if (blk->idom != idom) {
+        blk->idom = idom;
+        changed = true;
+      }
+    }
+  }
+
+  FREE_ARRAY(int, stack, n);
+  FREE_ARRAY(int, next, n);
+  FREE_ARRAY(bool, seen, n);
+}
+
+static bool dominates(ssa* s, int a, int b) {
+  while (b != a && b != 0) b = s->blocks[b].idom;
+  return b == a;
+}
+
+static bool same_key(ssa_value* a, ssa_value* b) {
+  return a->op == b->op && a->operand == b->operand && a->arg_count == b->arg_count &&
+         (a->arg_count < 1 || a->args[0] == b->args[0]) &&
+         (a->arg_count < 2 || a->args[1] == b->args[1]);
+}
+
+static uint32_t hash_key(ssa_value* v) {
+  uint32_t hash = 2166136261u;
+  int key[4] = { v->op, v->operand, v->arg_count > 0 ? v->args[0] : -1,
+                 v->arg_count > 1 ? v->args[1] : -1 };
+
+  for (int i = 0; i < 4; i++) {
+    hash ^= (uint32_t)key[i];
+    hash *= 16777619;
+  }
+
+  return hash;
+}
+
+// The generic instruction an unchecked one works out the same as.
+static uint8_t generic_op(uint8_t op) {
+  switch (op) {
+    case OP_ADD_NUMERIC:
+    case OP_ADD_DOUBLE:      return OP_ADD;
+    case OP_SUBTRACT_NUMERIC:
+    case OP_SUBTRACT_DOUBLE: return OP_SUBTRACT;
+    case OP_MULTIPLY_NUMERIC:
+    case OP_MULTIPLY_DOUBLE: return OP_MULTIPLY;
+    case OP_DIVIDE_NUMERIC:
+    case OP_DIVIDE_DOUBLE:   return OP_DIVIDE;
+    case OP_NEGATE_NUMERIC:
+    case OP_NEGATE_DOUBLE:   return OP_NEGATE;
+    case OP_GREATER_NUMERIC:
+    case OP_GREATER_DOUBLE:  return OP_GREATER;
+    case OP_LESS_NUMERIC:
+    case OP_LESS_DOUBLE:     return OP_LESS;
+    default:                 return op;
+  }
+}
+
+static value constant_of(ssa* s, ssa_value* v) {
+  switch (v->op) {
+    case OP_NIL:   return NIL_VAL;
+    case OP_TRUE:  return BOOL_VAL(true);
+    case OP_FALSE: return BOOL_VAL(false);
+    default:       return s->c->constants.values[v->operand];
+  }
+}
+
+// The constant value for c, which goes into the pool if no literal has put
+// it there yet. Fails when the pool is full.
+static int constant_value(ssa* s, value c, int offs) {
+  if (IS_NIL(c)) return constant(s, OP_NIL, -1, offs);
+  if (IS_BOOL(c)) return constant(s, AS_BOOL(c) ? OP_TRUE : OP_FALSE, -1, offs);
+
+  if (s->constant_capacity) {
+    int* e = constant_entry(s, OP_CONSTANT, c);
+    if (*e != -1) return *e;
+  }
+
+  int index = s->c->constants.count;
+  if (index >= 1 << 24 || add_constant(s->c, c) == -1) return -1;
+  return constant(s, index < UINT8_COUNT ? OP_CONSTANT : OP_CONSTANT_LONG, index, offs);
+}
+
+// Constant folding, with the compiler's own folding so that the result is
+// what run() would give. Instructions that would raise an error stay.
+static void fold(ssa* s, int v) {
+  ssa_value* val = &s->values[v];
+  value args[2];
+  if (!val->arg_count || val->op == PHI) return;
+
+  for (int i = 0; i < val->arg_count; i++) {
+    ssa_value* arg = &s->values[val->args[i]];
+    if (!is_constant(arg->op)) return;
+    args[i] = constant_of(s, arg);
+  }
+
+  value result;
+  uint8_t op = generic_op(val->op);
+  if (val->arg_count == 1 ? !fold_unary(op, args[0], &result)
+                          : !fold_arithmetic(op, args[0], args[1], &result)) {
+    return;
+  }
+
+  int c = constant_value(s, result, val->offs);
+  if (c != -1) s->values[v].same = c;
+}
+
+// Global value numbering. Pure values are replaced by an equal one that
+// dominates them, and values computed from constants by their result.
+// Blocks go in reverse postorder, which sees dominators first, so the
+// candidates are already in the table and the operands already folded.
+static void number_values(ssa* s) {
+  int size = 16;
+  while (size < s->count * 2) size *= 2;
+  int* heads = ALLOCATE(int, size);
+  // Folding adds constants as it goes, so the table is sized up front.
+  int count = s->count;
+  int* chain = ALLOCATE(int, count);
+  for (int i = 0; i < size; i++) heads[i] = -1;
+
+  for (int i = 0; i < s->block_count; i++) {
+    int b = s->order[i];
+    ssa_block* blk = &s->blocks[b];
+
+    for (int j = 0; j < blk->count; j++) {
+      int v = blk->values[j];
+      ssa_value* val = &s->values[v];
+      for (int k = 0; k < val->arg_count; k++) val->args[k] = find(s, val->args[k]);
+
+      fold(s, v);
+      val = &s->values[v];
+      if (val->same != -1 || !is_pure(val->op)) continue;
+
+      uint32_t h = hash_key(val) & (size - 1);
+
+      int other = heads[h];
+      while (other != -1) {
+        if (same_key(&s->values[other], val) && dominates(s, s->values[other].block, b)) break;
+        other = chain[other];
+      }
+
+      if (other != -1) val->same = other;
+      else {
+        chain[v] = heads[h];
+        heads[h] = v;
+      }
+    }
+  }
+
+  FREE_ARRAY(int, heads, size);
+  FREE_ARRAY(int, chain, count);
+  remove_trivial_phis(s);
+  resolve_args(s);
+}
+
+// Loop-invariant code motion. A pure value in a loop whose arguments all
+// come from outside of it moves to the block the loop is entered from, when
+// that block goes nowhere else. Pure values cannot fail, so computing one
+// for a loop that then runs no iteration is harmless.
+static void hoist_invariants(ssa* s) {
+  int n = s->block_count;
+  bool* in_loop = ALLOCATE(bool, n);
+  int* work = ALLOCATE(int, n);
+
+  // Inner loops first, whose headers come later in reverse postorder.
+  for (int i = n - 1; i >= 0; i--) {
+    int header = s->order[i];
+    ssa_block* hblk = &s->blocks[header];
+    int count = 0;
+
+    for (int b = 0; b < n; b++) in_loop[b] = false;
+    in_loop[header] = true;
+    for (int k = 0; k < hblk->pred_count; k++) {
+      int latch = hblk->preds[k];
+      if (!dominates(s, header, latch) || in_loop[latch]) continue;
+      in_loop[latch] = true;
+      work[count++] = latch;
+    }
+    if (!count) continue;
+
+    while (count) {
+      ssa_block* blk = &s->blocks[work[--count]];
+      for (int k = 0; k < blk->pred_count; k++) {
+        int p = blk->preds[k];
+        if (in_loop[p]) continue;
+        in_loop[p] = true;
+        work[count++] = p;
+      }
+    }
+
+    int entry = -1;
+    for (int k = 0; k < hblk->pred_count; k++) {
+      int p = hblk->preds[k];
+      if (in_loop[p]) continue;
+      if (entry != -1 && entry != p) entry = -2;
+      else if (entry == -1) entry = p;
+    }
+    if (entry < 0 || s->blocks[entry].succ[1] != -1) continue;
+
+    ssa_block* pre = &s->blocks[entry];
+    for (int j = 0; j < n; j++) {
+      int b = s->order[j];
+      if (!in_loop[b]) continue;
+      ssa_block* blk = &s->blocks[b];
+      int kept = 0;
+
+      for (int k = 0; k < blk->count; k++) {
+        int v = blk->values[k];
+        ssa_value* val = &s->values[v];
+        bool invariant = is_pure(val->op) && !is_constant(val->op);
+
+        for (int a = 0; invariant && a < val->arg_count; a++) {
+          if (in_loop[s->values[val->args[a]].block]) invariant = false;
+        }
+
+        if (invariant) {
+          val->block = entry;
+          append_value(pre, v);
+          // The block list may have moved.
+          blk = &s->blocks[b];
+        } else blk->values[kept++] = v;
+      }
+      blk->count = kept;
+    }
+  }
+
+  FREE_ARRAY(bool, in_loop, n);
+  FREE_ARRAY(int, work, n);
+}
+
+static void mark_live(ssa* s, int v, int* work, int* count) {
+  if (s->values[v].live) return;
+  s->values[v].live = true;
+  work[(*count)++] = v;
+}
+
+// Dead code elimination. Everything starts out dead but what has effects,
+// may fail, or branches, and lives if something live uses it.
+static void eliminate_dead_code(ssa* s) {
+  int* work = ALLOCATE(int, s->count);
+  int count = 0;
+
+  for (int v = 0; v < s->count; v++) s->values[v].live = false;
+
+  for (int b = 0; b < s->block_count; b++) {
+    ssa_block* blk = &s->blocks[b];
+    for (int j = 0; j < blk->count; j++) {
+      int v = blk->values[j];
+      if (s->values[v].same == -1 && !is_pure(s->values[v].op)) mark_live(s, v, work, &count);
+    }
+    if (blk->term != -1) mark_live(s, blk->term, work, &count);
+  }
+
+  while (count) {
+    ssa_value* val = &s->values[work[--count]];
+    for (int i = 0; i < val->arg_count; i++) mark_live(s, val->args[i], work, &count);
+    if (val->op != PHI) continue;
+    int preds = s->blocks[val->block].pred_count;
+    for (int k = 0; k < preds; k++) mark_live(s, val->phi_args[k], work, &count);
+  }
+
+  for (int b = 0; b < s->block_count; b++) {
+    ssa_block* blk = &s->blocks[b];
+    int kept = 0;
+    for (int j = 0; j < blk->count; j++) {
+      int v = blk->values[j];
+      if (s->values[v].live && s->values[v].same == -1) blk->values[kept++] = v;
+    }
+    blk->count = kept;
+  }
+
+  FREE_ARRAY(int, work, s->count);
+}
+
+static void count_use(ssa* s, int v, int user) {
+  s->values[v].uses++;
+  s->values[v].user = user;
+}
+
+static void count_uses(ssa* s) {
+  for (int v = 0; v < s->count; v++) {
+    ssa_value* val = &s->values[v];
+    if (!val->live || val->same != -1) continue;
+    for (int i = 0; i < val->arg_count; i++) count_use(s, val->args[i], v);
+    if (val->op != PHI) continue;
+    int preds = s->blocks[val->block].pred_count;
+    for (int k = 0; k < preds; k++) count_use(s, val->phi_args[k], v);
+  }
+}
+
+// How many of the leading arguments of v are waiting on the stack.
+static int stacked_args(ssa* s, ssa_value* v) {
+  int n = 0;
+  while (n < v->arg_count && s->values[v->args[n]].stacked) n++;
+  return n;
+}
+
+// Leaves values on the stack for their user where the stack code would
+// have: used once, further down the same block, and on top of the stack
+// by then. The block is replayed on a simulated stack, and values that do
+// not end up where their user needs them go into slots after all.
+static void stack_values(ssa* s, int b, int* stack) {
+  ssa_block* blk = &s->blocks[b];
+
+  for (int j = 0; j < blk->count; j++) {
+    ssa_value* val = &s->values[blk->values[j]];
+    ssa_value* user = val->user == -1 ? NULL : &s->values[val->user];
+    val->stacked = val->uses == 1 && has_result(val->op) && user && user->op != PHI &&
+                   user->block == b;
+  }
+
+  bool retry = true;
+  while (retry) {
+    retry = false;
+    int depth = 0;
+
+    for (int j = 0; j <= blk->count && !retry; j++) {
+      if (j == blk->count && blk->term == -1) break;
+      int v = j < blk->count ? blk->values[j] : blk->term;
+      ssa_value* val = &s->values[v];
+      int n = stacked_args(s, val);
+      bool fits = n <= depth;
+
+      for (int i = 0; i < val->arg_count; i++) {
+        bool on_stack = s->values[val->args[i]].stacked;
+        if (on_stack && (i >= n || !fits || stack[depth-n+i] != val->args[i])) fits = false;
+      }
+
+      if (!fits) {
+        for (int i = 0; i < val->arg_count; i++) s->values[val->args[i]].stacked = false;
+        retry = true;
+        break;
+      }
+
+      depth -= n;
+      if (val->stacked) stack[depth++] = v;
+    }
+  }
+}
+
+static bool in_slot(ssa_value* v) {
+  return v->live && v->same == -1 && v->uses > 0 && !v->stacked &&
+         !is_constant(v->op) && has_result(v->op);
+}
+
+static void use_reg(ssa* s, uint64_t* live, int v) {
+  if (s->values[v].reg != -1) set_bit(live, s->values[v].reg);
+}
+
+static void interfere(ssa* s, int a, uint64_t* live) {
+  for (int w = 0; w < s->words; w++) {
+    s->interference[a * s->words + w] |= live[w];
+    for (int bit = 0; bit < 64; bit++) {
+      if (live[w] & ((uint64_t)1 << bit)) set_bit(s->interference + (w * 64 + bit) * s->words, a);
+    }
+  }
+}
+
+// The distinct successors of a block.
+static int successors(ssa_block* blk, int* succ) {
+  int n = 0;
+  if (blk->succ[0] != -1) succ[n++] = blk->succ[0];
+  if (blk->succ[1] != -1 && blk->succ[1] != blk->succ[0]) succ[n++] = blk->succ[1];
+  return n;
+}
+
+static int pred_index(ssa_block* blk, int pred) {
+  for (int k = 0; k < blk->pred_count; k++) {
+    if (blk->preds[k] == pred) return k;
+  }
+  return -1;
+}
+
+// Goes through block b backwards, leaving in live what lives on entry. The
+// block ends by moving the arguments of its successors' phis into them, then
+// branching. With record set, every value kept in a slot is noted to
+// interfere with what is live where it is defined.
+static void walk_block(ssa* s, int b, uint64_t* live, bool record) {
+  ssa_block* blk = &s->blocks[b];
+  int succ[2];
+  int n = successors(blk, succ);
+
+  memset(live, 0, sizeof(uint64_t) * s->words);
+  for (int i = 0; i < n; i++) {
+    for (int w = 0; w < s->words; w++) live[w] |= s->blocks[succ[i]].live_in[w];
+  }
+
+  if (blk->term != -1) {
+    ssa_value* term = &s->values[blk->term];
+    for (int i = 0; i < term->arg_count; i++) use_reg(s, live, term->args[i]);
+  }
+
+  for (int i = 0; record && i < n; i++) {
+    ssa_block* sblk = &s->blocks[succ[i]];
+    for (int h = 0; h < sblk->height; h++) {
+      ssa_value* p = &s->values[sblk->phis[h]];
+      if (p->reg == -1) continue;
+      clear_bit(live, p->reg);
+      interfere(s, p->reg, live);
+      set_bit(live, p->reg);
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    ssa_block* sblk = &s->blocks[succ[i]];
+    int k = pred_index(sblk, b);
+    for (int h = 0; h < sblk->height; h++) {
+      ssa_value* p = &s->values[sblk->phis[h]];
+      if (p->reg != -1) clear_bit(live, p->reg);
+    }
+    for (int h = 0; h < sblk->height; h++) {
+      ssa_value* p = &s->values[sblk->phis[h]];
+      if (p->reg != -1) use_reg(s, live, p->phi_args[k]);
+    }
+  }
+
+  for (int j = blk->count - 1; j >= 0; j--) {
+    ssa_value* val = &s->values[blk->values[j]];
+    if (val->reg != -1) {
+      clear_bit(live, val->reg);
+      if (record) interfere(s, val->reg, live);
+    }
+    for (int i = 0; i < val->arg_count; i++) use_reg(s, live, val->args[i]);
+  }
+}
+
+static int find_group(ssa* s, int r) {
+  while (s->group[r] != r) r = s->group[r];
+  return r;
+}
+
+static bool groups_interfere(ssa* s, int a, int b) {
+  return has_bit(s->interference + a * s->words, b);
+}
+
+// Merges group b into group a.
+static void merge_groups(ssa* s, int a, int b) {
+  s->group[b] = a;
+  for (int w = 0; w < s->words; w++) {
+    s->interference[a * s->words + w] |= s->interference[b * s->words + w];
+  }
+  for (int r = 0; r < s->regs; r++) {
+    if (has_bit(s->interference + r * s->words, b)) set_bit(s->interference + r * s->words, a);
+  }
+}
+
+// Gives every value kept in a slot one of as few slots as possible. Phis
+// share a slot with their arguments where they do not interfere, so that
+// the moves between them go away.
+static bool allocate_slots(ssa* s) {
+  for (int v = 0; v < s->count; v++) {
+    if (in_slot(&s->values[v])) s->values[v].reg = s->regs++;
+  }
+  if (s->regs > MAX_SLOT_VALUES) return false;
+
+  s->words = WORDS(s->regs) ? WORDS(s->regs) : 1;
+  s->interference = ALLOCATE(uint64_t, (size_t)s->regs * s->words + 1);
+  memset(s->interference, 0, sizeof(uint64_t) * ((size_t)s->regs * s->words + 1));
+
+  uint64_t* live = ALLOCATE(uint64_t, s->words);
+  for (int b = 0; b < s->block_count; b++) {
+    s->blocks[b].live_in = ALLOCATE(uint64_t, s->words);
+    memset(s->blocks[b].live_in, 0, sizeof(uint64_t) * s->words);
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = s->block_count - 1; i >= 0; i--) {
+      ssa_block* blk = &s->blocks[s->order[i]];
+      walk_block(s, s->order[i], live, false);
+      if (memcmp(live, blk->live_in, sizeof(uint64_t) * s->words)) {
+        memcpy(blk->live_in, live, sizeof(uint64_t) * s->words);
+        changed = true;
+      }
+    }
+  }
+  for (int b = 0; b < s->block_count; b++) walk_block(s, b, live, true);
+  FREE_ARRAY(uint64_t, live, s->words);
+
+  s->group = ALLOCATE(int, s->regs);
+  s->color = ALLOCATE(int, s->regs);
+  for (int r = 0; r < s->regs; r++) {
+    s->group[r] = r;
+    s->color[r] = -1;
+  }
+
+  for (int v = 0; v < s->count; v++) {
+    ssa_value* p = &s->values[v];
+    if (p->op != PHI || p->reg == -1) continue;
+    int preds = s->blocks[p->block].pred_count;
+    for (int k = 0; k < preds; k++) {
+      int arg = s->values[p->phi_args[k]].reg;
+      if (arg == -1) continue;
+      int a = find_group(s, p->reg);
+      int b = find_group(s, arg);
+      if (a != b && !groups_interfere(s, a, b)) merge_groups(s, a, b);
+    }
+  }
+
+  bool* used = ALLOCATE(bool, s->regs + 1);
+  for (int r = 0; r < s->regs; r++) {
+    int g = find_group(s, r);
+    if (s->color[g] != -1) continue;
+
+    for (int c = 0; c <= s->regs; c++) used[c] = false;
+    for (int o = 0; o < s->regs; o++) {
+      if (!has_bit(s->interference + g * s->words, o)) continue;
+      int color = s->color[find_group(s, o)];
+      if (color != -1) used[color] = true;
+    }
+
+    int color = 0;
+    while (used[color]) color++;
+    s->color[g] = color;
+    if (color + 1 > s->slots) s->slots = color + 1;
+  }
+  FREE_ARRAY(bool, used, s->regs + 1);
+
+  return s->slots < UINT8_MAX;
+}
+
+static int slot_of(ssa* s, int v) {
+  return s->color[find_group(s, s->values[v].reg)];
+}
+
+typedef struct {
+  int at;
+  int block;
+} fixup;
+
+typedef struct {
+  ssa* s;
+  chunk out;
+  int* starts;
+  fixup* fixups;
+  int fixup_count;
+  int fixup_capacity;
+} lowering;
+
+static void write_op(lowering* l, uint8_t op, int offs) {
+  write_chunk(&l->out, op, l->s->lines[offs]);
+}
+
+// Pushes the value v for an instruction made from offs.
+static void load(lowering* l, int v, int offs) {
+  ssa_value* val = &l->s->values[v];
+
+  write_op(l, is_constant(val->op) ? val->op : OP_GET_LOCAL, offs);
+  if (val->op == OP_CONSTANT) write_op(l, val->operand, offs);
+  else if (val->op == OP_CONSTANT_LONG) {
+    write_op(l, val->operand & 0xff, offs);
+    write_op(l, (val->operand >> 8) & 0xff, offs);
+    write_op(l, (val->operand >> 16) & 0xff, offs);
+  } else if (!is_constant(val->op)) write_op(l, slot_of(l->s, v), offs);
+}
+
+static void store(lowering* l, int slot, int offs) {
+  write_op(l, OP_SET_LOCAL, offs);
+  write_op(l, slot, offs);
+  write_op(l, OP_POP, offs);
+}
+
+static void push_args(lowering* l, ssa_value* val) {
+  for (int i = stacked_args(l->s, val); i < val->arg_count; i++) load(l, val->args[i], val->offs);
+}
+
+static void lower_value(lowering* l, int v) {
+  ssa* s = l->s;
+  ssa_value* val = &s->values[v];
+
+  push_args(l, val);
+  write_op(l, val->op, val->offs);
+  if (val->op == OP_GET_GLOBAL || val->op == OP_DEFINE_GLOBAL || val->op == OP_SET_GLOBAL) {
+    write_op(l, (val->operand >> 8) & 0xff, val->offs);
+    write_op(l, val->operand & 0xff, val->offs);
+  }
+
+  if (val->op == OP_SET_GLOBAL) write_op(l, OP_POP, val->offs);
+  else if (!has_result(val->op) || val->stacked) return;
+  else if (val->reg != -1) store(l, slot_of(s, v), val->offs);
+  else write_op(l, OP_POP, val->offs);
+}
+
+// Moves the arguments of the phis of every successor into their slots. The
+// stack makes it a parallel move: everything is pushed before anything is
+// stored.
+static void lower_moves(lowering* l, int b, int offs) {
+  ssa* s = l->s;
+  int succ[2];
+  int n = successors(&s->blocks[b], succ);
+  int* dst = ALLOCATE(int, s->regs+1);
+  int count = 0;
+
+  for (int i = 0; i < n; i++) {
+    ssa_block* sblk = &s->blocks[succ[i]];
+    int k = pred_index(sblk, b);
+
+    for (int h = 0; h < sblk->height; h++) {
+      int p = sblk->phis[h];
+      int arg = s->values[p].phi_args[k];
+      if (s->values[p].reg == -1) continue;
+      if (s->values[arg].reg != -1 && slot_of(s, arg) == slot_of(s, p)) continue;
+
+      load(l, arg, offs);
+      dst[count++] = slot_of(s, p);
+    }
+  }
+
+  while (count) store(l, dst[--count], offs);
+  FREE_ARRAY(int, dst, s->regs+1);
+}
+
+static void jump_to(lowering* l, uint8_t op, int target, int offs) {
+  if (l->fixup_capacity < l->fixup_count + 1) {
+    int oldc = l->fixup_capacity;
+    l->fixup_capacity = GROW_CAPACITY(oldc);
+    l->fixups = GROW_ARRAY(l->fixups, fixup, oldc, l->fixup_capacity);
+  }
+
+  write_op(l, op, offs);
+  l->fixups[l->fixup_count].at = l->out.count - 1;
+  l->fixups[l->fixup_count].block = target;
+  l->fixup_count++;
+  write_op(l, 0xff, offs);
+  write_op(l, 0xff, offs);
+}
+
+// The backward twin of a forward conditional jump.
+static uint8_t loop_op(uint8_t jump) {
+  switch (jump) {
+    case OP_JUMP_IF_EQUAL:       return OP_LOOP_IF_EQUAL;
+    case OP_JUMP_IF_NOT_EQUAL:   return OP_LOOP_IF_NOT_EQUAL;
+    case OP_JUMP_IF_GREATER:     return OP_LOOP_IF_GREATER;
+    case OP_JUMP_IF_NOT_GREATER: return OP_LOOP_IF_NOT_GREATER;
+    case OP_JUMP_IF_LESS:        return OP_LOOP_IF_LESS;
+    default:                     return OP_LOOP_IF_NOT_LESS;
+  }
+}
+
+static uint8_t jump_op(uint8_t loop) {
+  switch (loop) {
+    case OP_LOOP_IF_EQUAL:       return OP_JUMP_IF_EQUAL;
+    case OP_LOOP_IF_NOT_EQUAL:   return OP_JUMP_IF_NOT_EQUAL;
+    case OP_LOOP_IF_GREATER:     return OP_JUMP_IF_GREATER;
+    case OP_LOOP_IF_NOT_GREATER: return OP_JUMP_IF_NOT_GREATER;
+    case OP_LOOP_IF_LESS:        return OP_JUMP_IF_LESS;
+    default:                     return OP_JUMP_IF_NOT_LESS;
+  }
+}
+
+// Jumps to block target unless it comes next anyway.
+static void lower_goto(lowering* l, int b, int target, int offs) {
+  if (target == b + 1) return;
+  jump_to(l, target <= b ? OP_LOOP : OP_JUMP, target, offs);
+}
+
+// Conditional jumps go forward and conditional loops backward, and only
+// some conditions have both. The others are negated first.
+static void lower_branch(lowering* l, int b, ssa_value* term) {
+  int target = l->s->blocks[b].succ[1];
+  bool back = target <= b;
+  uint8_t op = term->op;
+
+  push_args(l, term);
+  switch (op) {
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+      if (back) write_op(l, OP_NOT, term->offs);
+      jump_to(l, back ? OP_LOOP_IF_TRUE : OP_POP_JUMP_IF_FALSE, target, term->offs);
+      break;
+    case OP_LOOP_IF_TRUE:
+      if (!back) write_op(l, OP_NOT, term->offs);
+      jump_to(l, back ? OP_LOOP_IF_TRUE : OP_POP_JUMP_IF_FALSE, target, term->offs);
+      break;
+    default:
+      if (op >= OP_LOOP_IF_EQUAL) op = jump_op(op);
+      jump_to(l, back ? loop_op(op) : op, target, term->offs);
+      break;
+  }
+}
+
+static bool lower(ssa* s, chunk* out) {
+  lowering l;
+  l.s = s;
+  init_chunk(&l.out);
+  l.out.arena = s->c->arena;
+  l.starts = ALLOCATE(int, s->block_count);
+  l.fixups = NULL;
+  l.fixup_count = l.fixup_capacity = 0;
+
+  // Room for the slots, below whatever the code pushes.
+  for (int i = 0; i < s->slots; i++) write_op(&l, OP_NIL, 0);
+
+  for (int b = 0; b < s->block_count; b++) {
+    ssa_block* blk = &s->blocks[b];
+    l.starts[b] = l.out.count;
+
+    for (int j = 0; j < blk->count; j++) lower_value(&l, blk->values[j]);
+
+    ssa_value* term = blk->term == -1 ? NULL : &s->values[blk->term];
+    int offs = term ? term->offs : blk->end - 1;
+    if (term && term->op == OP_RETURN) {
+      write_op(&l, OP_RETURN, offs);
+      continue;
+    }
+
+    lower_moves(&l, b, offs);
+    if (term && blk->succ[1] != -1) lower_branch(&l, b, term);
+    lower_goto(&l, b, blk->succ[0], offs);
+  }
+
+  // Code the arena had no room for is missing.
+  bool ok = !l.out.arena || !l.out.arena->failed;
+  for (int i = 0; ok && i < l.fixup_count; i++) {
+    int at = l.fixups[i].at;
+    int target = l.starts[l.fixups[i].block];
+    int distance = target > at ? target - at - 3 : at + 3 - target;
+    if (distance > UINT16_MAX) ok = false;
+    set_jump_target(&l.out, at, target);
+  }
+
+  FREE_ARRAY(int, l.starts, s->block_count);
+  FREE_ARRAY(fixup, l.fixups, l.fixup_capacity);
+  if (!ok) free_chunk(&l.out);
+  else *out = l.out;
+  return ok;
+}
+
+static void free_ssa(ssa* s) {
+  for (int v = 0; v < s->count; v++) {
+    ssa_value* val = &s->values[v];
+    if (val->phi_args) FREE_ARRAY(int, val->phi_args, s->blocks[val->block].pred_count);
+  }
+
+  for (int b = 0; b < s->block_count; b++) {
+    ssa_block* blk = &s->blocks[b];
+    FREE_ARRAY(int, blk->values, blk->capacity);
+    FREE_ARRAY(int, blk->preds, blk->pred_capacity);
+    if (blk->phis) FREE_ARRAY(int, blk->phis, blk->height+1);
+    if (blk->exit) FREE_ARRAY(int, blk->exit, blk->exit_count+1);
+    if (blk->live_in) FREE_ARRAY(uint64_t, blk->live_in, s->words);
+  }
+
+  FREE_ARRAY(ssa_value, s->values, s->capacity);
+  FREE_ARRAY(ssa_block, s->blocks, s->block_count);
+  if (s->order) FREE_ARRAY(int, s->order, s->block_count);
+  if (s->constants) FREE_ARRAY(int, s->constants, s->constant_capacity);
+  if (s->interference) FREE_ARRAY(uint64_t, s->interference, (size_t)s->regs * s->words + 1);
+  if (s->group) FREE_ARRAY(int, s->group, s->regs);
+  if (s->color) FREE_ARRAY(int, s->color, s->regs);
+}
+
+void optimize_ssa(chunk* c) {
+  int count = c->count;
+  ssa s;
+  memset(&s, 0, sizeof(s));
+  s.c = c;
+  s.heights = ALLOCATE(int, c->count);
+  s.block_of = ALLOCATE(int, c->count+1);
+  s.lines = ALLOCATE(int, c->count);
+  stack_heights(c, s.heights);
+
+  for (int i = 0, offs = 0; i < c->lines_count; i += 2) {
+    for (int j = 0; j < c->lines[i]; j++) s.lines[offs++] = c->lines[i+1];
+  }
+
+  chunk out;
+  bool ok = build(&s);
+  if (ok) {
+    find_dominators(&s);
+    number_values(&s);
+    hoist_invariants(&s);
+    eliminate_dead_code(&s);
+    count_uses(&s);
+
+    int* stack = ALLOCATE(int, s.count+1);
+    for (int b = 0; b < s.block_count; b++) stack_values(&s, b, stack);
+    FREE_ARRAY(int, stack, s.count+1);
+
+    ok = allocate_slots(&s) && lower(&s, &out);
+  }
+
+  if (ok) replace_code(c, &out);
+
+  FREE_ARRAY(int, s.heights, count);
+  FREE_ARRAY(int, s.block_of, count+1);
+  FREE_ARRAY(int, s.lines, count);
+  free_ssa(&s);
+}
@@ -0,0 +1,8 @@
+#ifndef clox_ssa_h
+#define clox_ssa_h
+
+#include "chunk.h"
+
+void optimize_ssa(chunk*);
+
+#endif
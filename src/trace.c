@@ -0,0 +1,187 @@
+#include "common.h"
+#include "jit.h"
+#include "memory.h"
+#include "trace.h"
+
+void init_tracer(tracer* tr, chunk* c) {
+  tr->c = c;
+  tr->loops = ALLOCATE(loop_state, c->cell_count);
+  tr->recording = false;
+  tr->rec.entries = NULL;
+
+  for (int i = 0; i < c->cell_count; i++) {
+    tr->loops[i].hotness = HOT_LOOP;
+    tr->loops[i].aborts = 0;
+    tr->loops[i].trace = NULL;
+  }
+}
+
+void free_tracer(tracer* tr) {
+  for (int i = 0; i < tr->c->cell_count; i++) {
+    native_trace* t = tr->loops[i].trace;
+    if (!t) continue;
+    free_native_trace(t);
+    FREE(native_trace, t);
+  }
+
+  FREE_ARRAY(loop_state, tr->loops, tr->c->cell_count);
+  if (tr->recording) FREE_ARRAY(trace_entry, tr->rec.entries, MAX_TRACE);
+}
+
+static int target_cell(chunk* c, int cell) {
+  return c->cells[cell].as.target - c->cells;
+}
+
+// Whether the cell starts an instruction rather than carrying the operands
+// of the one before.
+static bool starts_instruction(chunk* c, int cell) {
+  return cell == 0 || c->cell_offsets[cell] != c->cell_offsets[cell-1];
+}
+
+// Starts recording the loop closed by the backward branch in cell anchor,
+// by having every instruction of it go through the record handler first.
+bool start_recording(tracer* tr, int anchor, handler record) {
+  if (tr->recording || tr->loops[anchor].aborts >= MAX_ABORTS) return false;
+
+  recording* rec = &tr->rec;
+  rec->anchor = anchor;
+  rec->header = target_cell(tr->c, anchor);
+  rec->count = 0;
+  rec->entries = ALLOCATE(trace_entry, MAX_TRACE);
+  tr->recording = true;
+
+  for (int i = rec->header; i <= anchor; i++) {
+    if (starts_instruction(tr->c, i)) tr->c->cells[i].h = record;
+  }
+
+  return true;
+}
+
+// Whether the branch in entry e jumps. Comparisons that are about to fail
+// are not worth recording.
+static bool record_branch(trace_entry* e, uint8_t op, value* sp) {
+  value a = sp[-2];
+  value b = sp[-1];
+
+  switch (op) {
+    case OP_JUMP:
+    case OP_LOOP:
+      e->taken = true;
+      break;
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+      e->taken = is_falsy(b);
+      break;
+    case OP_LOOP_IF_TRUE:
+      e->taken = !is_falsy(b);
+      break;
+    case OP_JUMP_IF_EQUAL:
+    case OP_LOOP_IF_EQUAL:
+      e->taken = values_equal(a, b);
+      break;
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_LOOP_IF_NOT_EQUAL:
+      e->taken = !values_equal(a, b);
+      break;
+    default: {
+      if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) return false;
+
+      bool greater = op == OP_JUMP_IF_GREATER || op == OP_JUMP_IF_NOT_GREATER ||
+                     op == OP_LOOP_IF_GREATER || op == OP_LOOP_IF_NOT_GREATER;
+      bool holds = ARE_INTEGERS(a, b)
+                     ? (greater ? AS_INTEGER(a) > AS_INTEGER(b) : AS_INTEGER(a) < AS_INTEGER(b))
+                     : (greater ? to_number(a) > to_number(b) : to_number(a) < to_number(b));
+      bool negated = op == OP_JUMP_IF_NOT_GREATER || op == OP_JUMP_IF_NOT_LESS ||
+                     op == OP_LOOP_IF_NOT_GREATER || op == OP_LOOP_IF_NOT_LESS;
+      e->taken = holds != negated;
+      break;
+    }
+  }
+
+  return true;
+}
+
+// Records the instruction in cell, about to be executed with the stack
+// at sp. Recording stops once the anchor jumps back to the header, and
+// fails wherever execution strays from the loop.
+record_status record_instruction(tracer* tr, int cell, value* slots, value* sp) {
+  chunk* c = tr->c;
+  recording* rec = &tr->rec;
+  int offs = c->cell_offsets[cell];
+  uint8_t op = c->code[offs];
+  int expected = rec->header;
+
+  if (rec->count) {
+    trace_entry* prev = &rec->entries[rec->count-1];
+    expected = prev->taken ? target_cell(c, prev->cell)
+                           : prev->cell + cell_length(c->code[prev->offs]);
+  }
+
+  if (cell != expected || rec->count == MAX_TRACE || op == OP_RETURN) return RECORD_ABORT;
+
+  trace_entry* e = &rec->entries[rec->count++];
+  e->cell = cell;
+  e->offs = offs;
+  e->height = sp - slots;
+  e->types[0] = e->height > 1 ? trace_type_of(sp[-2]) : TRACE_OTHER;
+  e->types[1] = e->height > 0 ? trace_type_of(sp[-1]) : TRACE_OTHER;
+  e->taken = false;
+
+  if (op == OP_ADD_LOCAL_CONSTANT) {
+    e->types[0] = trace_type_of(slots[c->cells[cell].as.slot]);
+    e->types[1] = trace_type_of(c->cells[cell+1].as.v);
+  }
+
+  if (jump_target(c, offs) != -1) {
+    if (!record_branch(e, op, sp)) return RECORD_ABORT;
+    // Inner loops get traces of their own.
+    if (target_cell(c, cell) <= cell && cell != rec->anchor) return RECORD_ABORT;
+  }
+
+  if (cell == rec->anchor) return e->taken ? RECORD_DONE : RECORD_ABORT;
+  return RECORD_CONTINUE;
+}
+
+// Puts the handlers back into the loop and, for a complete recording,
+// compiles it, having the header enter the trace from then on.
+void stop_recording(tracer* tr, vm* cvm, bool done, const handler* handlers,
+                    handler enter) {
+  chunk* c = tr->c;
+  recording* rec = &tr->rec;
+
+  for (int i = rec->header; i <= rec->anchor; i++) {
+    if (starts_instruction(c, i)) c->cells[i].h = handlers[c->code[c->cell_offsets[i]]];
+  }
+
+  native_trace* t = done ? ALLOCATE(native_trace, 1) : NULL;
+  if (t && compile_trace(cvm, c, rec, t)) {
+    t->anchor = rec->anchor;
+    t->side_exits = 0;
+    tr->loops[rec->header].trace = t;
+    c->cells[rec->header].h = enter;
+  } else {
+    if (t) FREE(native_trace, t);
+    tr->loops[rec->anchor].aborts++;
+  }
+
+  FREE_ARRAY(trace_entry, rec->entries, MAX_TRACE);
+  rec->entries = NULL;
+  tr->recording = false;
+}
+
+// Counts a trace leaving through exit e. Traces that keep leaving before
+// their loop ends are thrown away, giving the header its handler back.
+void leave_trace(tracer* tr, native_trace* t, trace_exit* e, const handler* handlers) {
+  chunk* c = tr->c;
+  int anchor = t->anchor;
+  int header = target_cell(c, anchor);
+
+  if (e->cell == anchor + cell_length(c->code[c->cell_offsets[anchor]])) return;
+  if (++t->side_exits < MAX_SIDE_EXITS) return;
+
+  c->cells[header].h = handlers[c->code[c->cell_offsets[header]]];
+  tr->loops[header].trace = NULL;
+  tr->loops[anchor].aborts++;
+  free_native_trace(t);
+  FREE(native_trace, t);
+}
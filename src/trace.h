@@ -0,0 +1,94 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "chunk.h"
+#include "vm.h"
+
+// How often a backward branch has to be taken before the loop it closes is
+// recorded, and how often recording it may fail before the loop is left to
+// the interpreter for good.
+#define HOT_LOOP 56
+#define MAX_ABORTS 4
+#define MAX_TRACE 512
+
+// How often a trace may leave other than by its loop ending before it is
+// thrown away, to be recorded again for the types the loop has now.
+#define MAX_SIDE_EXITS 56
+
+typedef enum {
+  TRACE_INTEGER,
+  TRACE_DOUBLE,
+  TRACE_OTHER,
+} trace_type;
+
+// Boxed integers are objects to traces.
+static inline uint8_t trace_type_of(value v) {
+  if (IS_SMALL_INTEGER(v)) return TRACE_INTEGER;
+  if (IS_NUMBER(v)) return TRACE_DOUBLE;
+  return TRACE_OTHER;
+}
+
+// An instruction as it was executed while recording, with the types of the
+// operands it saw and, for branches, whether it jumped.
+typedef struct {
+  int cell;
+  int offs;
+  int height;
+  uint8_t types[2];
+  bool taken;
+} trace_entry;
+
+// One iteration of a loop, from the target of its backward branch, the
+// header, up to the branch itself, the anchor.
+typedef struct {
+  int anchor;
+  int header;
+  int count;
+  trace_entry* entries;
+} recording;
+
+// Where the interpreter picks up when a trace leaves: the cell to go on
+// with and the height of the stack there.
+typedef struct {
+  int cell;
+  int height;
+} trace_exit;
+
+typedef struct {
+  void* code;
+  size_t size;
+  trace_exit* exits;
+  int exit_count;
+  int anchor;
+  int side_exits;
+} native_trace;
+
+// Kept for every cell. Anchors count down their hotness, headers hold the
+// trace compiled for their loop.
+typedef struct {
+  int hotness;
+  int aborts;
+  native_trace* trace;
+} loop_state;
+
+typedef struct {
+  chunk* c;
+  loop_state* loops;
+  bool recording;
+  recording rec;
+} tracer;
+
+typedef enum {
+  RECORD_CONTINUE,
+  RECORD_DONE,
+  RECORD_ABORT,
+} record_status;
+
+void init_tracer(tracer*, chunk*);
+void free_tracer(tracer*);
+bool start_recording(tracer*, int, handler);
+record_status record_instruction(tracer*, int, value*, value*);
+void stop_recording(tracer*, vm*, bool, const handler*, handler);
+void leave_trace(tracer*, native_trace*, trace_exit*, const handler*);
+
+#endif
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -10,11 +11,13 @@ void init_value_array(value_array* array) {
   array->count = 0;
 }
 
+// Value arrays hold the globals, which count as tables like the one mapping
+// their names.
 void write_value_array(value_array* array, value v) {
   if (array->capacity < array->count + 1) {
     int oldc = array->capacity;
     array->capacity = GROW_CAPACITY(oldc);
-    array->values = GROW_ARRAY(array->values, value, oldc, array->capacity);
+    array->values = GROW_ARRAY_AS(HEAP_TABLES, array->values, value, oldc, array->capacity);
   }
 
   array->values[array->count] = v;
@@ -22,18 +25,57 @@ void write_value_array(value_array* array, value v) {
 }
 
 void free_value_array(value_array* array) {
-  FREE_ARRAY(value, array->values, array->capacity);
+  FREE_ARRAY_AS(HEAP_TABLES, value, array->values, array->capacity);
   init_value_array(array);
 }
 
+// Two interned strings are equal only if they are the same string.
+static bool strings_equal(obj_str* a, obj_str* b) {
+  if (a == b) return true;
+  if (a->interned && b->interned) return false;
+  return a->len == b->len && !memcmp(a->chars, b->chars, a->len);
+}
+
 bool values_equal(value a, value b) {
+  if (IS_INTEGER(a) != IS_INTEGER(b) && IS_NUMERIC(a) && IS_NUMERIC(b)) {
+    return to_number(a) == to_number(b);
+  }
+
+#ifdef NAN_BOXING
+  if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+  if (a == b) return true;
+  if (IS_INTEGER(a) && IS_INTEGER(b)) return AS_INTEGER(a) == AS_INTEGER(b);
+  return IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b));
+#else
   if (a.type != b.type) return false;
 
   switch (a.type) {
     case BOOL:   return AS_BOOL(a) == AS_BOOL(b);
-    case NIL:    return true;
+    case NIL:
+    case UNDEFINED: return true;
     case NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+    case INTEGER: return AS_INTEGER(a) == AS_INTEGER(b);
     case CHAR:   return AS_CHAR(a) == AS_CHAR(b);
-    case OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    case OBJ:    return strings_equal(AS_STRING(a), AS_STRING(b));
   }
+
+  return false;
+#endif
+}
+
+// Doubles that hold an integer print like one, so an integer promoted to a
+// double reads the same as long as it is exact.
+static void print_number(double d) {
+  if (d >= -9007199254740992.0 && d <= 9007199254740992.0 && d == (int64_t)d) {
+    printf("%.0f", d);
+  } else printf("%g", d);
+}
+
+void print_value(value v) {
+  if (IS_BOOL(v))        printf(AS_BOOL(v) ? "true" : "false");
+  else if (IS_NIL(v))    printf("nil");
+  else if (IS_NUMBER(v)) print_number(AS_NUMBER(v));
+  else if (IS_INTEGER(v)) printf("%" PRId64, AS_INTEGER(v));
+  else if (IS_CHAR(v))   printf("%c", AS_CHAR(v));
+  else if (IS_OBJ(v))    print_obj(v);
 }
@@ -5,26 +5,136 @@
 
 typedef enum {
   STRING,
+  BOXED_INTEGER,
 } obj_type;
 
 typedef struct obj {
   obj_type type;
+  bool marked;
   struct obj* next;
 } obj;
 
+// Interned strings are the only ones with their contents, so they compare
+// by address. Runtime strings are not interned, nor hashed, until they
+// have to be.
 typedef struct obj_str {
   obj o;
   uint32_t hash;
   int len;
+  bool interned;
   char chars[];
 } obj_str;
 
+// An integer too wide for the payload of a NaN-boxed value. Integers are
+// boxed only when they have to be, so a box never holds one that fits.
+typedef struct {
+  obj o;
+  int64_t value;
+} obj_int;
+
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// Every value is a 64-bit double. Anything that is not a number hides in the
+// payload of a quiet NaN: singletons and chars by their low tag bits, objects
+// by setting the sign bit on top of the pointer, and integers by the integer
+// tag above a 48-bit payload. Integers outside of that range are boxed on the
+// heap, so they keep all of their 64 bits.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+#define INTEGER_TAG     ((uint64_t)0x0002000000000000)
+#define INTEGER_PAYLOAD ((uint64_t)0x0000ffffffffffff)
+#define INTEGER_MIN     (-((int64_t)1 << 47))
+#define INTEGER_MAX     (((int64_t)1 << 47) - 1)
+
+#define TAG_NIL   1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+#define TAG_CHAR  4
+#define TAG_UNDEFINED 5
+#define TAG_MASK  ((uint64_t)0xff)
+
+typedef uint64_t value;
+
+#define FALSE_VAL     ((value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL      ((value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define BOOL_VAL(v)   ((v) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL       ((value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(v) num_to_value(v)
+#define INTEGER_VAL(v) integer_to_value(v)
+#define CHAR_VAL(v)   ((value)(QNAN | TAG_CHAR | ((uint64_t)(uint8_t)(v) << 8)))
+#define OBJ_VAL(v)    ((value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(v)))
+
+#define AS_BOOL(v)    ((v) == TRUE_VAL)
+#define AS_NUMBER(v)  value_to_num(v)
+#define AS_INTEGER(v) as_integer(v)
+#define AS_CHAR(v)    ((char)(((v) >> 8) & 0xff))
+#define AS_OBJ(v)     ((obj*)(uintptr_t)((v) & ~(SIGN_BIT | QNAN)))
+
+#define IS_BOOL(v)    (((v) | 1) == TRUE_VAL)
+#define IS_NIL(v)     ((v) == NIL_VAL)
+#define IS_UNDEFINED(v) ((v) == UNDEFINED_VAL)
+#define IS_NUMBER(v)  (((v) & QNAN) != QNAN)
+#define IS_INTEGER(v) is_integer(v)
+#define ARE_INTEGERS(a, b) are_integers(a, b)
+// Small integers are the ones in the payload, the only ones machine code
+// knows. Doubles lack some QNAN bit and objects the integer tag, so one test
+// does for two values.
+#define IS_SMALL_INTEGER(v) (((v) & (SIGN_BIT | QNAN | INTEGER_TAG)) == (QNAN | INTEGER_TAG))
+#define ARE_SMALL_INTEGERS(a, b) \
+  ((((a) & (b)) & (SIGN_BIT | QNAN | INTEGER_TAG)) == (QNAN | INTEGER_TAG))
+#define IS_CHAR(v)    (((v) & (SIGN_BIT | QNAN | INTEGER_TAG | TAG_MASK)) == \
+                       (QNAN | TAG_CHAR))
+#define IS_OBJ(v)     (((v) & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
+
+static inline double value_to_num(value v) {
+  double num;
+  memcpy(&num, &v, sizeof(value));
+  return num;
+}
+
+static inline value num_to_value(double num) {
+  value v;
+  memcpy(&v, &num, sizeof(double));
+  return v;
+}
+
+static inline bool is_integer(value v) {
+  return IS_SMALL_INTEGER(v) || (IS_OBJ(v) && AS_OBJ(v)->type == BOXED_INTEGER);
+}
+
+// Boxes are rare, so they are kept off the path of small integers. They have
+// all QNAN bits, so one test keeps them off the path of doubles too.
+static inline bool are_integers(value a, value b) {
+  if (__builtin_expect(ARE_SMALL_INTEGERS(a, b), 1)) return true;
+  return (a & b & QNAN) == QNAN && is_integer(a) && is_integer(b);
+}
+
+static inline int64_t as_integer(value v) {
+  if (__builtin_expect(IS_SMALL_INTEGER(v), 1)) return (int64_t)(v << 16) >> 16;
+  return ((obj_int*)AS_OBJ(v))->value;
+}
+
+value box_wide_integer(int64_t);
+
+static inline value integer_to_value(int64_t i) {
+  if (i < INTEGER_MIN || i > INTEGER_MAX) return box_wide_integer(i);
+  return (value)(QNAN | INTEGER_TAG | ((uint64_t)i & INTEGER_PAYLOAD));
+}
+
+#else
+
 typedef enum {
   BOOL,
   NIL,
   NUMBER,
   CHAR,
   OBJ,
+  UNDEFINED,
+  INTEGER,
 } value_type;
 
 typedef struct {
@@ -33,27 +143,95 @@ typedef struct {
     bool boolean;
     char chr;
     double num;
+    int64_t integer;
     obj* o;
   } as;
 }value;
 
 #define BOOL_VAL(v)   ((value){ BOOL, { .boolean = v } })
 #define NIL_VAL       ((value){ NIL, { .num = 0 } })
+#define UNDEFINED_VAL ((value){ UNDEFINED, { .num = 0 } })
 #define NUMBER_VAL(v) ((value){ NUMBER, { .num = v } })
+#define INTEGER_VAL(v) ((value){ INTEGER, { .integer = v } })
 #define CHAR_VAL(v)   ((value){ CHAR, { .chr = v } })
 #define OBJ_VAL(v)    ((value){ OBJ, { .o = (obj*)v }})
 
 #define AS_BOOL(v)    ((v).as.boolean)
 #define AS_NUMBER(v)  ((v).as.num)
+#define AS_INTEGER(v) ((v).as.integer)
 #define AS_CHAR(v)    ((v).as.chr)
 #define AS_OBJ(v)     ((v).as.o)
 
 #define IS_BOOL(v)    ((v).type == BOOL)
 #define IS_NIL(v)     ((v).type == NIL)
+#define IS_UNDEFINED(v) ((v).type == UNDEFINED)
 #define IS_NUMBER(v)  ((v).type == NUMBER)
+#define IS_INTEGER(v) ((v).type == INTEGER)
+#define ARE_INTEGERS(a, b) (IS_INTEGER(a) && IS_INTEGER(b))
+#define IS_SMALL_INTEGER(v) IS_INTEGER(v)
 #define IS_CHAR(v)  ((v).type == CHAR)
 #define IS_OBJ(v)  ((v).type == OBJ)
 
+#endif
+
+// NUMBER is the double. Arithmetic accepts it and INTEGER alike, and integer
+// results that overflow 64 bits are promoted to doubles.
+#define IS_NUMERIC(v) (IS_NUMBER(v) || IS_INTEGER(v))
+
+// v has to be numeric.
+static inline double to_number(value v) {
+  return IS_NUMBER(v) ? AS_NUMBER(v) : (double)AS_INTEGER(v);
+}
+
+// The integer operand of bitwise operators. Doubles are truncated, saturating
+// outside of the int64_t range, with NaN becoming 0.
+static inline int64_t to_integer(value v) {
+  if (IS_INTEGER(v)) return AS_INTEGER(v);
+
+  double d = AS_NUMBER(v);
+  if (d != d) return 0;
+  if (d >= 9223372036854775807.0) return INT64_MAX;
+  if (d <= -9223372036854775808.0) return INT64_MIN;
+  return (int64_t)d;
+}
+
+static inline value add_integers(int64_t a, int64_t b) {
+  int64_t r;
+  if (__builtin_add_overflow(a, b, &r)) return NUMBER_VAL((double)a + (double)b);
+  return INTEGER_VAL(r);
+}
+
+static inline value subtract_integers(int64_t a, int64_t b) {
+  int64_t r;
+  if (__builtin_sub_overflow(a, b, &r)) return NUMBER_VAL((double)a - (double)b);
+  return INTEGER_VAL(r);
+}
+
+static inline value multiply_integers(int64_t a, int64_t b) {
+  int64_t r;
+  if (__builtin_mul_overflow(a, b, &r)) return NUMBER_VAL((double)a * (double)b);
+  return INTEGER_VAL(r);
+}
+
+// b must not be 0. INT64_MIN % -1 overflows in C, but is 0 all the same.
+static inline value modulo_integers(int64_t a, int64_t b) {
+  return INTEGER_VAL(b == -1 ? 0 : a % b);
+}
+
+// Shift counts are taken modulo 64 and left shifts wrap, so every shift is
+// defined.
+static inline value shift_integer(int64_t a, int64_t b, bool left) {
+  b &= 63;
+  return INTEGER_VAL(left ? (int64_t)((uint64_t)a << b) : a >> b);
+}
+
+static inline bool is_falsy(value v) {
+  return IS_NIL(v) || (IS_BOOL(v) && !AS_BOOL(v));
+}
+
+// UNDEFINED_VAL fills global slots that have been resolved but not yet
+// defined. Scripts never get to see it.
+
 typedef struct {
   int capacity;
   int count;
@@ -65,6 +243,7 @@ void write_value_array(value_array*, value);
 void free_value_array(value_array*);
 
 bool values_equal(value, value);
+void print_value(value);
 
 #define OBJ_TYPE(v) (AS_OBJ(v)->type)
 
@@ -78,6 +257,7 @@ static inline bool is_obj_type(value v, obj_type type) {
 }
 
 obj_str* copy_str(void*, const char*, int);
+obj_str* new_str(void*, int);
 void print_obj(value);
 obj_str* take_str(void*, char*, int);
 
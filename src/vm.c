@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -7,7 +8,10 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
+#include "regcode.h"
+#include "trace.h"
 #include "vm.h"
 
 
@@ -17,48 +21,55 @@ void reset_stack(vm* cvm) {
 
 vm* init_vm() {
   vm* res = malloc(sizeof(vm));
+  // The VM itself, which is mostly its stack, counts as stack.
+  memset(&res->heap, 0, sizeof(heap_stats));
+  res->heap.current = res->heap.peak = res->heap.categories[HEAP_STACK] = sizeof(vm);
+  res->profiler = NULL;
+  res->profile = NULL;
+  res->site = -1;
+  charge_to(res);
   reset_stack(res);
+  res->c = NULL;
   res->objs = NULL;
+  res->bytes_allocated = 0;
+  res->next_gc = GC_INITIAL_THRESHOLD;
+  res->gc_growth = GC_GROWTH;
+  res->nursery = ALLOCATE_AS(HEAP_STRINGS, char, NURSERY_SIZE);
+  res->nursery_top = res->nursery;
+  res->nursery_end = res->nursery + NURSERY_SIZE;
+  res->tenure = false;
+  res->frame = NULL;
+  res->frame_size = 0;
+  res->optimize = false;
   init_table(&res->strings);
   init_table(&res->globals);
+  init_value_array(&res->global_values);
+  init_value_array(&res->global_names);
   return res;
 }
 
-static void free_object(obj* o) {
-  switch (o->type) {
-    case STRING: {
-      reallocate(o, offsetof(obj_str, chars)+((obj_str*)o)->len+1, 0);
-      break;
-    }
-  }
-}
-
-void free_objects(vm* cvm) {
-  obj* o = cvm->objs;
-  while (o) {
-    obj* next = o->next;
-    free_object(o);
-    o = next;
-  }
-}
-
 void free_vm(vm* cvm) {
+  charge_to(cvm);
   free_table(&cvm->strings);
   free_table(&cvm->globals);
+  free_value_array(&cvm->global_values);
+  free_value_array(&cvm->global_names);
   free_objects(cvm);
+  FREE_ARRAY_AS(HEAP_STRINGS, char, cvm->nursery, NURSERY_SIZE);
+  charge_to(NULL);
   free(cvm);
 }
 
-static void runtime_error(vm* cvm, const char* format, ...) {
+// Reports an error raised by the instruction at offs of the stack code.
+void runtime_error(vm* cvm, int offs, const char* format, ...) {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
   va_end(args);
   fputs("\n", stderr);
 
-  size_t instruction = cvm->ip - cvm->c->code - 1;
   fprintf(stderr, "[line %d] in script\n",
-          cvm->c->lines[instruction]);
+          get_line(cvm->c->lines, cvm->c->lines_count, offs));
 
   reset_stack(cvm);
 }
@@ -72,233 +83,1023 @@ value pop(vm* cvm) {
   return *(--cvm->stack_top);
 }
 
-static value peek(vm* cvm, int distance) {
-  return cvm->stack_top[-1-distance];
+static const char* global_name(vm* cvm, value* global) {
+  return AS_CSTRING(cvm->global_names.values[global - cvm->global_values.values]);
 }
 
-static bool is_falsy(value v) {
-  return IS_NIL(v) || (IS_BOOL(v) && !AS_BOOL(v));
-}
+// The operands stay on the stack until the result is allocated, which may
+// collect garbage and move them. The result is not interned. Fails if the
+// heap is exhausted.
+static bool concatenate(vm* cvm) {
+  // A string longer than an int can count is one there is no room for.
+  int64_t len = (int64_t)AS_STRING(cvm->stack_top[-2])->len + AS_STRING(cvm->stack_top[-1])->len;
+  if (len > INT_MAX) return false;
+  obj_str* result = new_str(cvm, (int)len);
+  if (!result) return false;
 
-static void concatenate(vm* cvm) {
-  obj_str* b = AS_STRING(pop(cvm));
-  obj_str* a = AS_STRING(pop(cvm));
+  obj_str* b = AS_STRING(cvm->stack_top[-1]);
+  obj_str* a = AS_STRING(cvm->stack_top[-2]);
+  memcpy(result->chars, a->chars, a->len);
+  memcpy(result->chars + a->len, b->chars, b->len);
+  cvm->stack_top -= 2;
+  push(cvm, OBJ_VAL(result));
+  return true;
+}
 
-  int len = a->len + b->len;
-  char* chars = ALLOCATE(char, len + 1);
-  memcpy(chars, a->chars, a->len);
-  memcpy(chars + a->len, b->chars, b->len);
-  chars[len] = '\0';
+// Turns the char distance down the stack into a string in place.
+static bool char_to_str(vm* cvm, int distance) {
+  obj_str* s = new_str(cvm, 1);
+  if (!s) return false;
+  s->chars[0] = AS_CHAR(cvm->stack_top[-1-distance]);
+  cvm->stack_top[-1-distance] = OBJ_VAL(s);
+  return true;
+}
 
-  obj_str* result = take_str(cvm, chars, len);
-  FREE_ARRAY(char, chars, len+1);
-  push(cvm, OBJ_VAL(result));
+static bool concatenate_str_chr(vm* cvm) {
+  return char_to_str(cvm, 1) && concatenate(cvm);
 }
 
-static void concatenate_str_chr(vm* cvm) {
-  obj_str* b = AS_STRING(pop(cvm));
-  char a = AS_CHAR(pop(cvm));
-  obj_str* a_str = take_str(cvm, &a, 1);
-  push(cvm, OBJ_VAL(a_str));
-  push(cvm, OBJ_VAL(b));
-  concatenate(cvm);
+static bool concatenate_chr_str(vm* cvm) {
+  return char_to_str(cvm, 0) && concatenate(cvm);
 }
 
-static void concatenate_chr_str(vm* cvm) {
-  char a = AS_CHAR(pop(cvm));
-  obj_str* a_str = take_str(cvm, &a, 1);
-  push(cvm, OBJ_VAL(a_str));
-  concatenate(cvm);
+static bool concatenate_chr_chr(vm* cvm) {
+  return char_to_str(cvm, 1) && char_to_str(cvm, 0) && concatenate(cvm);
 }
 
-static void concatenate_chr_chr(vm* cvm) {
-  char a = AS_CHAR(pop(cvm));
-  char b = AS_CHAR(pop(cvm));
-  obj_str* a_str = take_str(cvm, &a, 1);
-  obj_str* b_str = take_str(cvm, &b, 1);
-  push(cvm, OBJ_VAL(b_str));
-  push(cvm, OBJ_VAL(a_str));
-  concatenate(cvm);
+// '+' on anything but two numbers, working on the two values on top of the
+// stack, for the instruction at offs. Returns the error to raise if there is
+// one.
+const char* add_values(vm* cvm, int offs) {
+  cvm->site = offs;
+  value b = cvm->stack_top[-1];
+  value a = cvm->stack_top[-2];
+  bool ok = true;
+
+  if (IS_STRING(b) && IS_STRING(a)) ok = concatenate(cvm);
+  else if (IS_STRING(b) && IS_CHAR(a)) ok = concatenate_str_chr(cvm);
+  else if (IS_CHAR(b) && IS_STRING(a)) ok = concatenate_chr_str(cvm);
+  else if (IS_CHAR(b) && IS_CHAR(a)) ok = concatenate_chr_chr(cvm);
+  else if (IS_INTEGER(b) && IS_INTEGER(a)) {
+    cvm->stack_top -= 2;
+    push(cvm, add_integers(AS_INTEGER(a), AS_INTEGER(b)));
+  } else if (IS_NUMERIC(b) && IS_NUMERIC(a)) {
+    cvm->stack_top -= 2;
+    push(cvm, NUMBER_VAL(to_number(a) + to_number(b)));
+  } else return "Operands must be two numbers or two strings.";
+
+  return ok ? NULL : "Out of memory.";
 }
 
-static interpret_result run(vm* cvm) {
-#define binary_op(value_type, op) { \
-      if (!IS_NUMBER(peek(cvm, 0)) || !IS_NUMBER(peek(cvm, 1))) { \
-        runtime_error(cvm, "Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+static interpret_result run(vm* cvm, bool tracing) {
+// With labels-as-values every cell carries the address of its handler and
+// each handler jumps straight to the next one through its own indirect
+// branch; otherwise the cells hold opcodes and we go back around the switch.
+#ifdef COMPUTED_GOTO
+#define handler_for(op) &&lbl_##op
+#else
+#define handler_for(op) op
+#endif
+
+  static const handler handlers[] = {
+    [OP_CONSTANT] = handler_for(OP_CONSTANT),
+    [OP_CONSTANT_LONG] = handler_for(OP_CONSTANT),
+    [OP_NIL] = handler_for(OP_NIL),
+    [OP_TRUE] = handler_for(OP_TRUE),
+    [OP_FALSE] = handler_for(OP_FALSE),
+    [OP_POP] = handler_for(OP_POP),
+    [OP_GET_LOCAL] = handler_for(OP_GET_LOCAL),
+    [OP_GET_GLOBAL] = handler_for(OP_GET_GLOBAL),
+    [OP_DEFINE_GLOBAL] = handler_for(OP_DEFINE_GLOBAL),
+    [OP_SET_LOCAL] = handler_for(OP_SET_LOCAL),
+    [OP_SET_GLOBAL] = handler_for(OP_SET_GLOBAL),
+    [OP_SET_LOCAL_POP] = handler_for(OP_SET_LOCAL_POP),
+    [OP_SET_GLOBAL_POP] = handler_for(OP_SET_GLOBAL_POP),
+    [OP_GET_LOCALS] = handler_for(OP_GET_LOCALS),
+    [OP_ADD_LOCAL_CONSTANT] = handler_for(OP_ADD_LOCAL_CONSTANT),
+    [OP_ADD] = handler_for(OP_ADD),
+    [OP_SUBTRACT] = handler_for(OP_SUBTRACT),
+    [OP_MULTIPLY] = handler_for(OP_MULTIPLY),
+    [OP_DIVIDE] = handler_for(OP_DIVIDE),
+    [OP_MODULO] = handler_for(OP_MODULO),
+    [OP_SHIFTLEFT] = handler_for(OP_SHIFTLEFT),
+    [OP_SHIFTRIGHT] = handler_for(OP_SHIFTRIGHT),
+    [OP_BITNOT] = handler_for(OP_BITNOT),
+    [OP_BITOR] = handler_for(OP_BITOR),
+    [OP_BITXOR] = handler_for(OP_BITXOR),
+    [OP_BITAND] = handler_for(OP_BITAND),
+    [OP_NEGATE] = handler_for(OP_NEGATE),
+    [OP_RETURN] = handler_for(OP_RETURN),
+    [OP_NOT] = handler_for(OP_NOT),
+    [OP_EQUAL] = handler_for(OP_EQUAL),
+    [OP_GREATER] = handler_for(OP_GREATER),
+    [OP_LESS] = handler_for(OP_LESS),
+    [OP_PRINT] = handler_for(OP_PRINT),
+    [OP_JUMP_IF_FALSE] = handler_for(OP_JUMP_IF_FALSE),
+    [OP_POP_JUMP_IF_FALSE] = handler_for(OP_POP_JUMP_IF_FALSE),
+    [OP_JUMP_IF_EQUAL] = handler_for(OP_JUMP_IF_EQUAL),
+    [OP_JUMP_IF_NOT_EQUAL] = handler_for(OP_JUMP_IF_NOT_EQUAL),
+    [OP_JUMP_IF_GREATER] = handler_for(OP_JUMP_IF_GREATER),
+    [OP_JUMP_IF_NOT_GREATER] = handler_for(OP_JUMP_IF_NOT_GREATER),
+    [OP_JUMP_IF_LESS] = handler_for(OP_JUMP_IF_LESS),
+    [OP_JUMP_IF_NOT_LESS] = handler_for(OP_JUMP_IF_NOT_LESS),
+    [OP_JUMP] = handler_for(OP_JUMP),
+    [OP_LOOP] = handler_for(OP_LOOP),
+    [OP_LOOP_IF_TRUE] = handler_for(OP_LOOP_IF_TRUE),
+    [OP_LOOP_IF_EQUAL] = handler_for(OP_LOOP_IF_EQUAL),
+    [OP_LOOP_IF_NOT_EQUAL] = handler_for(OP_LOOP_IF_NOT_EQUAL),
+    [OP_LOOP_IF_GREATER] = handler_for(OP_LOOP_IF_GREATER),
+    [OP_LOOP_IF_NOT_GREATER] = handler_for(OP_LOOP_IF_NOT_GREATER),
+    [OP_LOOP_IF_LESS] = handler_for(OP_LOOP_IF_LESS),
+    [OP_LOOP_IF_NOT_LESS] = handler_for(OP_LOOP_IF_NOT_LESS),
+    [OP_ADD_NUMERIC] = handler_for(OP_ADD_NUMERIC),
+    [OP_SUBTRACT_NUMERIC] = handler_for(OP_SUBTRACT_NUMERIC),
+    [OP_MULTIPLY_NUMERIC] = handler_for(OP_MULTIPLY_NUMERIC),
+    [OP_DIVIDE_NUMERIC] = handler_for(OP_DIVIDE_NUMERIC),
+    [OP_NEGATE_NUMERIC] = handler_for(OP_NEGATE_NUMERIC),
+    [OP_GREATER_NUMERIC] = handler_for(OP_GREATER_NUMERIC),
+    [OP_LESS_NUMERIC] = handler_for(OP_LESS_NUMERIC),
+    [OP_ADD_DOUBLE] = handler_for(OP_ADD_DOUBLE),
+    [OP_SUBTRACT_DOUBLE] = handler_for(OP_SUBTRACT_DOUBLE),
+    [OP_MULTIPLY_DOUBLE] = handler_for(OP_MULTIPLY_DOUBLE),
+    [OP_DIVIDE_DOUBLE] = handler_for(OP_DIVIDE_DOUBLE),
+    [OP_NEGATE_DOUBLE] = handler_for(OP_NEGATE_DOUBLE),
+    [OP_GREATER_DOUBLE] = handler_for(OP_GREATER_DOUBLE),
+    [OP_LESS_DOUBLE] = handler_for(OP_LESS_DOUBLE),
+    [OP_ADD_NUMBER] = handler_for(OP_ADD_NUMBER),
+    [OP_ADD_STRING] = handler_for(OP_ADD_STRING),
+    [OP_GREATER_NUMBER] = handler_for(OP_GREATER_NUMBER),
+    [OP_LESS_NUMBER] = handler_for(OP_LESS_NUMBER),
+    [OP_ADD_INTEGER] = handler_for(OP_ADD_INTEGER),
+    [OP_GREATER_INTEGER] = handler_for(OP_GREATER_INTEGER),
+    [OP_LESS_INTEGER] = handler_for(OP_LESS_INTEGER),
+  };
+
+#ifdef TRACING
+  // While tracing, backward branches go through hot_loop, which counts how
+  // often they are taken before handing over to their own handlers.
+  handler traced[sizeof(handlers) / sizeof(handlers[0])];
+  memcpy(traced, handlers, sizeof(handlers));
+  for (int op = OP_LOOP; op <= OP_LOOP_IF_NOT_LESS; op++) traced[op] = &&lbl_hot_loop;
+
+  tracer tr;
+  const handler* threaded = tracing ? traced : handlers;
+#else
+  const handler* threaded = handlers;
+  (void)tracing;
+#endif
+
+  if (!cvm->c->cells && !thread_chunk(cvm->c, threaded, cvm->global_values.values)) {
+    fputs("Out of memory.\n", stderr);
+    return INTERPRET_RUNTIME_ERROR;
+  }
+#ifdef TRACING
+  if (tracing) init_tracer(&tr, cvm->c);
+#endif
+
+  cell* ip = cvm->c->cells;
+  value* sp = cvm->stack_top;
+  value* slots = cvm->stack;
+
+#define store_frame() (cvm->ip = ip, cvm->stack_top = sp)
+#define load_frame() (ip = cvm->ip, sp = cvm->stack_top)
+#define stack_push(v) (*sp++ = (v))
+#define stack_pop() (*--sp)
+#define stack_peek(distance) (sp[-1-(distance)])
+#ifdef TRACING
+#define stop_tracing() (tracing ? free_tracer(&tr) : (void)0)
+#else
+#define stop_tracing() ((void)0)
+#endif
+#define runtime_fail(...) { \
+      store_frame(); \
+      runtime_error(cvm, cvm->c->cell_offsets[ip - cvm->c->cells - 1], __VA_ARGS__); \
+      stop_tracing(); \
+      return INTERPRET_RUNTIME_ERROR; \
+    }
+#define numeric_operands() \
+      if (!both(IS_NUMERIC, stack_peek(0), stack_peek(1))) { \
+        runtime_fail("Operands must be numbers."); \
+      }
+// Integers stay integers as long as both operands are; anything else is
+// worked out on doubles.
+#define arith_op(integer_op, op) { \
+      value b = stack_peek(0); \
+      value a = stack_peek(1); \
+      if (ARE_INTEGERS(a, b)) { \
+        sp--; \
+        stack_peek(0) = integer_op(AS_INTEGER(a), AS_INTEGER(b)); \
+      } else { \
+        numeric_operands(); \
+        sp--; \
+        stack_peek(0) = NUMBER_VAL(to_number(a) op to_number(b)); \
       } \
-      double b = AS_NUMBER(pop(cvm)); \
-      double a = AS_NUMBER(pop(cvm)); \
-      push(cvm, value_type(a op b)); \
     }
-#define bitwise_op(value_type, op) { \
-      long b = (long)AS_NUMBER(pop(cvm)); \
-      long a = (long)AS_NUMBER(pop(cvm)); \
-      push(cvm, value_type(a op b)); \
+#define compare(a, b, op) \
+      (ARE_INTEGERS(a, b) ? AS_INTEGER(a) op AS_INTEGER(b) \
+                              : to_number(a) op to_number(b))
+#define integer_fast_path(a, b) \
+      if (!ARE_INTEGERS(a, b)) { numeric_operands(); }
+#define binary_op(value_type, op) { \
+      numeric_operands(); \
+      double b = to_number(stack_pop()); \
+      double a = to_number(stack_pop()); \
+      stack_push(value_type(a op b)); \
+    }
+#define compare_op(op) { \
+      integer_fast_path(stack_peek(1), stack_peek(0)); \
+      value b = stack_pop(); \
+      stack_peek(0) = BOOL_VAL(compare(stack_peek(0), b, op)); \
+    }
+#define integer_operands(x, y) \
+      int64_t x, y; \
+      if (ARE_INTEGERS(stack_peek(0), stack_peek(1))) { \
+        y = AS_INTEGER(stack_pop()); \
+        x = AS_INTEGER(stack_peek(0)); \
+      } else { \
+        numeric_operands(); \
+        y = to_integer(stack_pop()); \
+        x = to_integer(stack_peek(0)); \
+      }
+#define bitwise_op(op) { \
+      integer_operands(x, y); \
+      stack_peek(0) = INTEGER_VAL(x op y); \
+    }
+#define number_op(value_type, op) { \
+      double b = AS_NUMBER(stack_pop()); \
+      double a = AS_NUMBER(stack_pop()); \
+      stack_push(value_type(a op b)); \
+    }
+// Operands the compiler has proven to be numbers, of either kind.
+#define numeric_op(integer_op, op) { \
+      value b = stack_pop(); \
+      value a = stack_peek(0); \
+      stack_peek(0) = ARE_INTEGERS(a, b) ? integer_op(AS_INTEGER(a), AS_INTEGER(b)) \
+                                         : NUMBER_VAL(to_number(a) op to_number(b)); \
     }
-#define read_byte() (*cvm->ip++)
-#define read_short() (cvm->ip += 2, (uint16_t)((cvm->ip[-2] <<8) | cvm->ip[-1]))
-#define read_constant() (cvm->c->constants.values[read_byte()])
-#define read_long_constant() (cvm->c->constants.values[read_byte() + (read_byte()<<8) + (read_byte()<<16)])
-#define read_string() (AS_STRING(read_constant()))
+#define numeric_compare(op) { \
+      value b = stack_pop(); \
+      stack_peek(0) = BOOL_VAL(compare(stack_peek(0), b, op)); \
+    }
+#define integer_op(value_type, op) { \
+      int64_t b = AS_INTEGER(stack_pop()); \
+      int64_t a = AS_INTEGER(stack_pop()); \
+      stack_push(value_type(a op b)); \
+    }
+#define compare_jump(op, when) { \
+      integer_fast_path(stack_peek(1), stack_peek(0)); \
+      value b = stack_pop(); \
+      value a = stack_pop(); \
+      if (compare(a, b, op) == when) ip = operand().target; \
+    }
+#define equal_jump(when) { \
+      value b = stack_pop(); \
+      value a = stack_pop(); \
+      if (values_equal(a, b) == when) ip = operand().target; \
+    }
+#define add_slow_path() { \
+      store_frame(); \
+      const char* error = add_values(cvm, cvm->c->cell_offsets[ip - cvm->c->cells - 1]); \
+      if (error) runtime_fail("%s", error); \
+      load_frame(); \
+    }
+// Boxing an integer cannot collect, so backward branches do, should boxes
+// have taken the heap past next_gc. A loop is the only way to box without end.
+#define safepoint() \
+      if (cvm->bytes_allocated > cvm->next_gc) { store_frame(); collect_garbage(cvm); }
+#define quicken(op) (ip[-1].h = handlers[op])
+#define deoptimize(op) { quicken(op); ip--; dispatch(); }
+#define both(is, a, b) (is(a) && is(b))
+#define operand() (ip[-1].as)
 
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    print_trace(cvm);
+#define trace() (store_frame(), print_trace(cvm))
+#else
+#define trace() ((void)0)
 #endif
 
-    uint8_t instruction;
-    switch (instruction = read_byte()) {
-      case OP_CONSTANT: {
-        value constant = read_constant();
-        push(cvm, constant);
-        break;
-      }
-      case OP_CONSTANT_LONG: {
-        value constant = read_long_constant();
-        push(cvm, constant);
-        break;
+#ifdef COMPUTED_GOTO
+#define dispatch() { trace(); goto *(ip++)->h; }
+#define op_switch() dispatch();
+#define op_case(op) lbl_##op
+#else
+#define dispatch() break
+#define op_switch() trace(); switch ((ip++)->h)
+#define op_case(op) case op
+#endif
+
+  for (;;) {
+    op_switch() {
+      op_case(OP_CONSTANT): {
+        stack_push(operand().v);
+        dispatch();
       }
-      case OP_PRINT: {
-        print_value(pop(cvm));
+      op_case(OP_PRINT): {
+        print_value(stack_pop());
         puts("");
-        break;
+        dispatch();
+      }
+      op_case(OP_LOOP): {
+        safepoint();
+        ip = operand().target;
+        dispatch();
+      }
+      op_case(OP_JUMP): {
+        ip = operand().target;
+        dispatch();
       }
-      case OP_LOOP: {
-        cvm->ip -= read_short();
-        break;
+      op_case(OP_JUMP_IF_FALSE): {
+        if (is_falsy(stack_peek(0))) ip = operand().target;
+        dispatch();
       }
-      case OP_JUMP: {
-        cvm->ip += read_short();
-        break;
+      op_case(OP_POP_JUMP_IF_FALSE): {
+        if (is_falsy(stack_pop())) ip = operand().target;
+        dispatch();
       }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offs = read_short();
-        if (is_falsy(peek(cvm, 0))) cvm->ip += offs;
-        break;
+      op_case(OP_LOOP_IF_TRUE): {
+        safepoint();
+        if (!is_falsy(stack_pop())) ip = operand().target;
+        dispatch();
       }
-      case OP_RETURN: {
+      // Cells hold resolved targets, so backward branches are their forward
+      // twins plus the safepoint.
+      op_case(OP_LOOP_IF_EQUAL):       safepoint(); equal_jump(true); dispatch();
+      op_case(OP_JUMP_IF_EQUAL):       equal_jump(true); dispatch();
+      op_case(OP_LOOP_IF_NOT_EQUAL):   safepoint(); equal_jump(false); dispatch();
+      op_case(OP_JUMP_IF_NOT_EQUAL):   equal_jump(false); dispatch();
+      op_case(OP_LOOP_IF_GREATER):     safepoint(); compare_jump(>, true); dispatch();
+      op_case(OP_JUMP_IF_GREATER):     compare_jump(>, true); dispatch();
+      op_case(OP_LOOP_IF_NOT_GREATER): safepoint(); compare_jump(>, false); dispatch();
+      op_case(OP_JUMP_IF_NOT_GREATER): compare_jump(>, false); dispatch();
+      op_case(OP_LOOP_IF_LESS):        safepoint(); compare_jump(<, true); dispatch();
+      op_case(OP_JUMP_IF_LESS):        compare_jump(<, true); dispatch();
+      op_case(OP_LOOP_IF_NOT_LESS):    safepoint(); compare_jump(<, false); dispatch();
+      op_case(OP_JUMP_IF_NOT_LESS):    compare_jump(<, false); dispatch();
+      op_case(OP_RETURN): {
         // Exeunt.
+        store_frame();
+        stop_tracing();
         return INTERPRET_OK;
       }
-      case OP_EQUAL: {
-        value b = pop(cvm);
-        value a = pop(cvm);
-        push(cvm, BOOL_VAL(values_equal(a, b)));
-        break;
-      }
-      case OP_GREATER:    binary_op(BOOL_VAL, >); break;
-      case OP_LESS:       binary_op(BOOL_VAL, <); break;
-      case OP_NIL:        push(cvm, NIL_VAL); break;
-      case OP_TRUE:       push(cvm, BOOL_VAL(true)); break;
-      case OP_FALSE:      push(cvm, BOOL_VAL(false)); break;
-      case OP_POP:        pop(cvm); break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = read_byte();
-        push(cvm, cvm->stack[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = read_byte();
-        cvm->stack[slot] = peek(cvm, 0);
-        break;
-      }
-      case OP_GET_GLOBAL: {
-        obj_str* name = read_string();
-        value v;
-
-        if (!table_get(&cvm->globals, name, &v)) {
-          runtime_error(cvm, "Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+      op_case(OP_EQUAL): {
+        value b = stack_pop();
+        value a = stack_pop();
+        stack_push(BOOL_VAL(values_equal(a, b)));
+        dispatch();
+      }
+      op_case(OP_GREATER): {
+        if (ARE_INTEGERS(stack_peek(0), stack_peek(1))) quicken(OP_GREATER_INTEGER);
+        else if (both(IS_NUMBER, stack_peek(0), stack_peek(1))) quicken(OP_GREATER_NUMBER);
+        compare_op(>);
+        dispatch();
+      }
+      op_case(OP_LESS): {
+        if (ARE_INTEGERS(stack_peek(0), stack_peek(1))) quicken(OP_LESS_INTEGER);
+        else if (both(IS_NUMBER, stack_peek(0), stack_peek(1))) quicken(OP_LESS_NUMBER);
+        compare_op(<);
+        dispatch();
+      }
+      op_case(OP_GREATER_NUMBER): {
+        if (!both(IS_NUMBER, stack_peek(0), stack_peek(1))) deoptimize(OP_GREATER);
+        number_op(BOOL_VAL, >);
+        dispatch();
+      }
+      op_case(OP_LESS_NUMBER): {
+        if (!both(IS_NUMBER, stack_peek(0), stack_peek(1))) deoptimize(OP_LESS);
+        number_op(BOOL_VAL, <);
+        dispatch();
+      }
+      op_case(OP_GREATER_INTEGER): {
+        if (!ARE_INTEGERS(stack_peek(0), stack_peek(1))) deoptimize(OP_GREATER);
+        integer_op(BOOL_VAL, >);
+        dispatch();
+      }
+      op_case(OP_LESS_INTEGER): {
+        if (!ARE_INTEGERS(stack_peek(0), stack_peek(1))) deoptimize(OP_LESS);
+        integer_op(BOOL_VAL, <);
+        dispatch();
+      }
+      op_case(OP_NIL):        stack_push(NIL_VAL); dispatch();
+      op_case(OP_TRUE):       stack_push(BOOL_VAL(true)); dispatch();
+      op_case(OP_FALSE):      stack_push(BOOL_VAL(false)); dispatch();
+      op_case(OP_POP):        sp--; dispatch();
+      op_case(OP_GET_LOCAL): {
+        stack_push(slots[operand().slot]);
+        dispatch();
+      }
+      op_case(OP_SET_LOCAL): {
+        slots[operand().slot] = stack_peek(0);
+        dispatch();
+      }
+      op_case(OP_SET_LOCAL_POP): {
+        slots[operand().slot] = stack_pop();
+        dispatch();
+      }
+      op_case(OP_GET_LOCALS): {
+        stack_push(slots[operand().slots[0]]);
+        stack_push(slots[operand().slots[1]]);
+        dispatch();
+      }
+      op_case(OP_GET_GLOBAL): {
+        value* global = operand().global;
+        if (IS_UNDEFINED(*global)) {
+          runtime_fail("Undefined variable '%s'.", global_name(cvm, global));
         }
-        push(cvm, v);
-        break;
-      }
-      case OP_DEFINE_GLOBAL: {
-        obj_str* name = read_string();
-        if (!table_set(&cvm->globals, name, peek(cvm, 0))) {
-          runtime_error(cvm, "Redefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+        stack_push(*global);
+        dispatch();
+      }
+      op_case(OP_DEFINE_GLOBAL): {
+        value* global = operand().global;
+        if (!IS_UNDEFINED(*global)) {
+          runtime_fail("Redefined variable '%s'.", global_name(cvm, global));
+        }
+        *global = stack_pop();
+        dispatch();
+      }
+      op_case(OP_SET_GLOBAL): {
+        value* global = operand().global;
+        if (IS_UNDEFINED(*global)) {
+          runtime_fail("Undefined variable '%s'.", global_name(cvm, global));
         }
-        pop(cvm);
-        break;
-      }
-      case OP_SET_GLOBAL: {
-        obj_str* name = read_string();
-        if (table_set(&cvm->globals, name, peek(cvm, 0))) {
-          runtime_error(cvm, "Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+        *global = stack_peek(0);
+        dispatch();
+      }
+      op_case(OP_SET_GLOBAL_POP): {
+        value* global = operand().global;
+        if (IS_UNDEFINED(*global)) {
+          runtime_fail("Undefined variable '%s'.", global_name(cvm, global));
         }
-        break;
-      }
-      case OP_ADD: {
-        if (IS_STRING(peek(cvm, 0)) && IS_STRING(peek(cvm, 1))) {
-          concatenate(cvm);
-        } else if (IS_STRING(peek(cvm, 0)) && IS_CHAR(peek(cvm, 1))) {
-          concatenate_str_chr(cvm);
-        } else if (IS_CHAR(peek(cvm, 0)) && IS_STRING(peek(cvm, 1))) {
-          concatenate_chr_str(cvm);
-        } else if (IS_CHAR(peek(cvm, 0)) && IS_CHAR(peek(cvm, 1))) {
-          concatenate_chr_chr(cvm);
-        } else if (IS_NUMBER(peek(cvm, 0)) && IS_NUMBER(peek(cvm, 1))) {
-          binary_op(NUMBER_VAL, +); break;
+        *global = stack_pop();
+        dispatch();
+      }
+      op_case(OP_ADD): {
+        if (ARE_INTEGERS(stack_peek(0), stack_peek(1))) {
+          quicken(OP_ADD_INTEGER);
+          arith_op(add_integers, +);
+        } else if (both(IS_NUMBER, stack_peek(0), stack_peek(1))) {
+          quicken(OP_ADD_NUMBER);
+          number_op(NUMBER_VAL, +);
+        } else if (both(IS_NUMERIC, stack_peek(0), stack_peek(1))) {
+          arith_op(add_integers, +);
+        } else {
+          if (both(IS_STRING, stack_peek(0), stack_peek(1))) quicken(OP_ADD_STRING);
+          add_slow_path();
+        }
+        dispatch();
+      }
+      op_case(OP_ADD_LOCAL_CONSTANT): {
+        value* local = slots+operand().slot;
+        value constant = (ip++)->as.v;
+
+        if (ARE_INTEGERS(*local, constant)) {
+          *local = add_integers(AS_INTEGER(*local), AS_INTEGER(constant));
+        } else if (both(IS_NUMBER, *local, constant)) {
+          *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(constant));
         } else {
-          runtime_error(cvm, "Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+          stack_push(*local);
+          stack_push(constant);
+          add_slow_path();
+          *local = stack_pop();
+        }
+        dispatch();
+      }
+      op_case(OP_ADD_NUMBER): {
+        if (!both(IS_NUMBER, stack_peek(0), stack_peek(1))) deoptimize(OP_ADD);
+        number_op(NUMBER_VAL, +);
+        dispatch();
+      }
+      op_case(OP_ADD_INTEGER): {
+        if (!ARE_INTEGERS(stack_peek(0), stack_peek(1))) deoptimize(OP_ADD);
+        arith_op(add_integers, +);
+        dispatch();
+      }
+      op_case(OP_ADD_STRING): {
+        if (!both(IS_STRING, stack_peek(0), stack_peek(1))) deoptimize(OP_ADD);
+        add_slow_path();
+        dispatch();
+      }
+      op_case(OP_SUBTRACT):   arith_op(subtract_integers, -); dispatch();
+      op_case(OP_MULTIPLY):   arith_op(multiply_integers, *); dispatch();
+      op_case(OP_DIVIDE):     binary_op(NUMBER_VAL, /); dispatch();
+      op_case(OP_MODULO): {
+        integer_operands(x, y);
+        if (!y) runtime_fail("Modulo by zero.");
+        stack_peek(0) = modulo_integers(x, y);
+        dispatch();
+      }
+      op_case(OP_SHIFTLEFT): {
+        integer_operands(x, y);
+        stack_peek(0) = shift_integer(x, y, true);
+        dispatch();
+      }
+      op_case(OP_SHIFTRIGHT): {
+        integer_operands(x, y);
+        stack_peek(0) = shift_integer(x, y, false);
+        dispatch();
+      }
+      op_case(OP_BITOR):      bitwise_op(|); dispatch();
+      op_case(OP_BITXOR):     bitwise_op(^); dispatch();
+      op_case(OP_BITAND):     bitwise_op(&); dispatch();
+      op_case(OP_ADD_NUMERIC):      numeric_op(add_integers, +); dispatch();
+      op_case(OP_SUBTRACT_NUMERIC): numeric_op(subtract_integers, -); dispatch();
+      op_case(OP_MULTIPLY_NUMERIC): numeric_op(multiply_integers, *); dispatch();
+      op_case(OP_DIVIDE_NUMERIC): {
+        double b = to_number(stack_pop());
+        stack_peek(0) = NUMBER_VAL(to_number(stack_peek(0)) / b);
+        dispatch();
+      }
+      op_case(OP_NEGATE_NUMERIC): {
+        value a = stack_peek(0);
+        stack_peek(0) = IS_INTEGER(a) ? subtract_integers(0, AS_INTEGER(a))
+                                      : NUMBER_VAL(-AS_NUMBER(a));
+        dispatch();
+      }
+      op_case(OP_GREATER_NUMERIC):  numeric_compare(>); dispatch();
+      op_case(OP_LESS_NUMERIC):     numeric_compare(<); dispatch();
+      op_case(OP_ADD_DOUBLE):       number_op(NUMBER_VAL, +); dispatch();
+      op_case(OP_SUBTRACT_DOUBLE):  number_op(NUMBER_VAL, -); dispatch();
+      op_case(OP_MULTIPLY_DOUBLE):  number_op(NUMBER_VAL, *); dispatch();
+      op_case(OP_DIVIDE_DOUBLE):    number_op(NUMBER_VAL, /); dispatch();
+      op_case(OP_NEGATE_DOUBLE):    stack_peek(0) = NUMBER_VAL(-AS_NUMBER(stack_peek(0))); dispatch();
+      op_case(OP_GREATER_DOUBLE):   number_op(BOOL_VAL, >); dispatch();
+      op_case(OP_LESS_DOUBLE):      number_op(BOOL_VAL, <); dispatch();
+      op_case(OP_NOT):        stack_peek(0) = BOOL_VAL(is_falsy(stack_peek(0))); dispatch();
+      op_case(OP_NEGATE):
+        if (IS_INTEGER(stack_peek(0))) {
+          stack_peek(0) = subtract_integers(0, AS_INTEGER(stack_peek(0)));
+          dispatch();
+        }
+        if (!IS_NUMBER(stack_peek(0))) {
+          runtime_fail("Operand to '-' must be a number.");
+        }
+
+        stack_peek(0) = NUMBER_VAL(-AS_NUMBER(stack_peek(0)));
+        dispatch();
+      op_case(OP_BITNOT):
+        if (!IS_NUMERIC(stack_peek(0))) {
+          runtime_fail("Operand to '~' must be a number.");
         }
-        break;
-      }
-      case OP_SUBTRACT:   binary_op(NUMBER_VAL, -); break;
-      case OP_MULTIPLY:   binary_op(NUMBER_VAL, *); break;
-      case OP_DIVIDE:     binary_op(NUMBER_VAL, /); break;
-      case OP_MODULO:     bitwise_op(NUMBER_VAL, %); break;
-      case OP_SHIFTLEFT:  bitwise_op(NUMBER_VAL, <<); break;
-      case OP_SHIFTRIGHT: bitwise_op(NUMBER_VAL, >>); break;
-      case OP_BITOR:      bitwise_op(NUMBER_VAL, |); break;
-      case OP_BITXOR:     bitwise_op(NUMBER_VAL, ^); break;
-      case OP_BITAND:     bitwise_op(NUMBER_VAL, &); break;
-      case OP_NOT:        push(cvm, BOOL_VAL(is_falsy(pop(cvm)))); break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(cvm, 0))) {
-          runtime_error(cvm, "Operand to '-' must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+
+        stack_peek(0) = INTEGER_VAL(~to_integer(stack_peek(0)));
+        dispatch();
+#ifdef TRACING
+      // Loops taken often enough get recorded, or once they have a trace,
+      // their header enters it again.
+      lbl_hot_loop: {
+        chunk* c = cvm->c;
+        int anchor = ip - 1 - c->cells;
+        loop_state* loop = &tr.loops[anchor];
+
+        if (--loop->hotness == 0) {
+          int header = c->cells[anchor].as.target - c->cells;
+          loop->hotness = HOT_LOOP;
+          if (tr.loops[header].trace) {
+            if (!tr.recording) c->cells[header].h = &&lbl_enter_trace;
+          } else start_recording(&tr, anchor, &&lbl_record);
         }
+        goto *handlers[c->code[c->cell_offsets[anchor]]];
+      }
+      lbl_record: {
+        chunk* c = cvm->c;
+        int cur = ip - 1 - c->cells;
+        uint8_t op = c->code[c->cell_offsets[cur]];
+        record_status status = record_instruction(&tr, cur, slots, sp);
 
-        push(cvm, NUMBER_VAL(-AS_NUMBER(pop(cvm))));
-        break;
-      case OP_BITNOT:
-        if (!IS_NUMBER(peek(cvm, 0))) {
-          runtime_error(cvm, "Operand to '-' must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+        if (status != RECORD_CONTINUE) {
+          stop_recording(&tr, cvm, status == RECORD_DONE, traced, &&lbl_enter_trace);
         }
+        goto *handlers[op];
+      }
+      // Runs the trace and goes on where it left. Leaving right at the
+      // header runs the header's own handler, not the trace once more.
+      lbl_enter_trace: {
+        chunk* c = cvm->c;
+        cell* header = ip - 1;
+        native_trace* t = tr.loops[header - c->cells].trace;
+        trace_exit* e = &t->exits[run_trace(cvm, t, slots)];
 
-        push(cvm, NUMBER_VAL((double)(~((long)AS_NUMBER(pop(cvm))))));
-        break;
+        ip = c->cells + e->cell;
+        sp = slots + e->height;
+        leave_trace(&tr, t, e, traced);
+        if (ip != header) dispatch();
+        ip++;
+        goto *handlers[c->code[c->cell_offsets[header - c->cells]]];
+      }
+#endif
     }
   }
 
+#undef stop_tracing
+#undef store_frame
+#undef load_frame
+#undef stack_push
+#undef stack_pop
+#undef stack_peek
+#undef runtime_fail
+#undef numeric_operands
+#undef arith_op
+#undef compare
 #undef binary_op
-#undef read_byte
-#undef read_short
-#undef read_constant
-#undef read_long_constant
-#undef read_string
+#undef compare_op
+#undef integer_operands
+#undef bitwise_op
+#undef number_op
+#undef numeric_op
+#undef numeric_compare
+#undef integer_op
+#undef integer_fast_path
+#undef compare_jump
+#undef equal_jump
+#undef add_slow_path
+#undef safepoint
+#undef quicken
+#undef deoptimize
+#undef both
+#undef operand
+#undef trace
+#undef dispatch
+#undef op_switch
+#undef op_case
+#undef handler_for
 }
 
-interpret_result interpret(vm* cvm, const char* source) {
+// The register tier. Instructions read their operands straight from the
+// frame and write their result back to it, so apart from the helpers shared
+// with the stack tier, which use the VM stack as scratch, nothing is pushed.
+static interpret_result run_registers(vm* cvm, reg_code* rc) {
+#ifdef COMPUTED_GOTO
+#define handler_for(op) &&lbl_##op
+#else
+#define handler_for(op) op
+#endif
+
+  static const handler handlers[] = {
+    [OP_MOVE] = handler_for(OP_MOVE),
+    [OP_GET_GLOBAL] = handler_for(OP_GET_GLOBAL),
+    [OP_DEFINE_GLOBAL] = handler_for(OP_DEFINE_GLOBAL),
+    [OP_SET_GLOBAL] = handler_for(OP_SET_GLOBAL),
+    [OP_ADD] = handler_for(OP_ADD),
+    [OP_SUBTRACT] = handler_for(OP_SUBTRACT),
+    [OP_MULTIPLY] = handler_for(OP_MULTIPLY),
+    [OP_DIVIDE] = handler_for(OP_DIVIDE),
+    [OP_MODULO] = handler_for(OP_MODULO),
+    [OP_SHIFTLEFT] = handler_for(OP_SHIFTLEFT),
+    [OP_SHIFTRIGHT] = handler_for(OP_SHIFTRIGHT),
+    [OP_BITNOT] = handler_for(OP_BITNOT),
+    [OP_BITOR] = handler_for(OP_BITOR),
+    [OP_BITXOR] = handler_for(OP_BITXOR),
+    [OP_BITAND] = handler_for(OP_BITAND),
+    [OP_NEGATE] = handler_for(OP_NEGATE),
+    [OP_RETURN] = handler_for(OP_RETURN),
+    [OP_NOT] = handler_for(OP_NOT),
+    [OP_EQUAL] = handler_for(OP_EQUAL),
+    [OP_GREATER] = handler_for(OP_GREATER),
+    [OP_LESS] = handler_for(OP_LESS),
+    [OP_PRINT] = handler_for(OP_PRINT),
+    [OP_JUMP_IF_FALSE] = handler_for(OP_JUMP_IF_FALSE),
+    [OP_JUMP_IF_EQUAL] = handler_for(OP_JUMP_IF_EQUAL),
+    [OP_JUMP_IF_NOT_EQUAL] = handler_for(OP_JUMP_IF_NOT_EQUAL),
+    [OP_JUMP_IF_GREATER] = handler_for(OP_JUMP_IF_GREATER),
+    [OP_JUMP_IF_NOT_GREATER] = handler_for(OP_JUMP_IF_NOT_GREATER),
+    [OP_JUMP_IF_LESS] = handler_for(OP_JUMP_IF_LESS),
+    [OP_JUMP_IF_NOT_LESS] = handler_for(OP_JUMP_IF_NOT_LESS),
+    [OP_JUMP] = handler_for(OP_JUMP),
+    [OP_LOOP] = handler_for(OP_LOOP),
+    [OP_LOOP_IF_TRUE] = handler_for(OP_LOOP_IF_TRUE),
+    [OP_LOOP_IF_EQUAL] = handler_for(OP_LOOP_IF_EQUAL),
+    [OP_LOOP_IF_NOT_EQUAL] = handler_for(OP_LOOP_IF_NOT_EQUAL),
+    [OP_LOOP_IF_GREATER] = handler_for(OP_LOOP_IF_GREATER),
+    [OP_LOOP_IF_NOT_GREATER] = handler_for(OP_LOOP_IF_NOT_GREATER),
+    [OP_LOOP_IF_LESS] = handler_for(OP_LOOP_IF_LESS),
+    [OP_LOOP_IF_NOT_LESS] = handler_for(OP_LOOP_IF_NOT_LESS),
+    [OP_ADD_NUMERIC] = handler_for(OP_ADD_NUMERIC),
+    [OP_SUBTRACT_NUMERIC] = handler_for(OP_SUBTRACT_NUMERIC),
+    [OP_MULTIPLY_NUMERIC] = handler_for(OP_MULTIPLY_NUMERIC),
+    [OP_DIVIDE_NUMERIC] = handler_for(OP_DIVIDE_NUMERIC),
+    [OP_NEGATE_NUMERIC] = handler_for(OP_NEGATE_NUMERIC),
+    [OP_GREATER_NUMERIC] = handler_for(OP_GREATER_NUMERIC),
+    [OP_LESS_NUMERIC] = handler_for(OP_LESS_NUMERIC),
+    [OP_ADD_DOUBLE] = handler_for(OP_ADD_DOUBLE),
+    [OP_SUBTRACT_DOUBLE] = handler_for(OP_SUBTRACT_DOUBLE),
+    [OP_MULTIPLY_DOUBLE] = handler_for(OP_MULTIPLY_DOUBLE),
+    [OP_DIVIDE_DOUBLE] = handler_for(OP_DIVIDE_DOUBLE),
+    [OP_NEGATE_DOUBLE] = handler_for(OP_NEGATE_DOUBLE),
+    [OP_GREATER_DOUBLE] = handler_for(OP_GREATER_DOUBLE),
+    [OP_LESS_DOUBLE] = handler_for(OP_LESS_DOUBLE),
+  };
+
+  if (!rc->threaded) thread_registers(rc, handlers, cvm->global_values.values);
+
+  value* frame = ALLOCATE_AS(HEAP_STACK, value, rc->frame_size);
+  if (!frame) {
+    runtime_error(cvm, rc->offsets[0], "Out of memory.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  init_frame(cvm->c, rc, frame);
+  reg_inst* ip = rc->code;
+  cvm->frame = frame;
+  cvm->frame_size = rc->frame_size;
+
+#define operand() (ip[-1])
+#define reg(x) (frame[operand().x])
+#define free_frame() \
+      (FREE_ARRAY_AS(HEAP_STACK, value, frame, rc->frame_size), cvm->frame = NULL, cvm->frame_size = 0)
+#define runtime_fail(...) { \
+      runtime_error(cvm, rc->offsets[ip - rc->code - 1], __VA_ARGS__); \
+      free_frame(); \
+      return INTERPRET_RUNTIME_ERROR; \
+    }
+#define numeric_operands(x, y) \
+      if (!both(IS_NUMERIC, x, y)) { \
+        runtime_fail("Operands must be numbers."); \
+      }
+#define arith_op(integer_op, op) { \
+      value x = reg(b); \
+      value y = reg(c); \
+      if (ARE_INTEGERS(x, y)) reg(a) = integer_op(AS_INTEGER(x), AS_INTEGER(y)); \
+      else { \
+        numeric_operands(x, y); \
+        reg(a) = NUMBER_VAL(to_number(x) op to_number(y)); \
+      } \
+    }
+#define compare(x, y, op) \
+      (ARE_INTEGERS(x, y) ? AS_INTEGER(x) op AS_INTEGER(y) \
+                          : to_number(x) op to_number(y))
+#define compare_op(op) { \
+      value x = reg(b); \
+      value y = reg(c); \
+      if (!ARE_INTEGERS(x, y)) { numeric_operands(x, y); } \
+      reg(a) = BOOL_VAL(compare(x, y, op)); \
+    }
+#define integer_operands(x, y) \
+      int64_t x, y; \
+      if (ARE_INTEGERS(reg(b), reg(c))) { \
+        x = AS_INTEGER(reg(b)); \
+        y = AS_INTEGER(reg(c)); \
+      } else { \
+        numeric_operands(reg(b), reg(c)); \
+        x = to_integer(reg(b)); \
+        y = to_integer(reg(c)); \
+      }
+#define bitwise_op(op) { \
+      integer_operands(x, y); \
+      reg(a) = INTEGER_VAL(x op y); \
+    }
+#define numeric_op(integer_op, op) { \
+      value x = reg(b); \
+      value y = reg(c); \
+      reg(a) = ARE_INTEGERS(x, y) ? integer_op(AS_INTEGER(x), AS_INTEGER(y)) \
+                                  : NUMBER_VAL(to_number(x) op to_number(y)); \
+    }
+#define number_op(value_type, op) \
+      reg(a) = value_type(AS_NUMBER(reg(b)) op AS_NUMBER(reg(c)))
+#define compare_jump(op, when) { \
+      value x = reg(b); \
+      value y = reg(c); \
+      if (!ARE_INTEGERS(x, y)) { numeric_operands(x, y); } \
+      if (compare(x, y, op) == when) ip = operand().as.target; \
+    }
+#define equal_jump(when) { \
+      if (values_equal(reg(b), reg(c)) == when) ip = operand().as.target; \
+    }
+#define both(is, x, y) (is(x) && is(y))
+// As in run(), though the frame is a root all along.
+#define safepoint() \
+      if (cvm->bytes_allocated > cvm->next_gc) collect_garbage(cvm);
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define trace() print_register_trace(cvm->c, rc, frame, ip - rc->code)
+#else
+#define trace() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+#define dispatch() { trace(); goto *(ip++)->h; }
+#define op_switch() dispatch();
+#define op_case(op) lbl_##op
+#else
+#define dispatch() break
+#define op_switch() trace(); switch ((ip++)->h)
+#define op_case(op) case op
+#endif
+
+  for (;;) {
+    op_switch() {
+      op_case(OP_MOVE):       reg(a) = reg(b); dispatch();
+      op_case(OP_GET_GLOBAL): {
+        value* global = operand().as.global;
+        if (IS_UNDEFINED(*global)) {
+          runtime_fail("Undefined variable '%s'.", global_name(cvm, global));
+        }
+        reg(a) = *global;
+        dispatch();
+      }
+      op_case(OP_DEFINE_GLOBAL): {
+        value* global = operand().as.global;
+        if (!IS_UNDEFINED(*global)) {
+          runtime_fail("Redefined variable '%s'.", global_name(cvm, global));
+        }
+        *global = reg(b);
+        dispatch();
+      }
+      op_case(OP_SET_GLOBAL): {
+        value* global = operand().as.global;
+        if (IS_UNDEFINED(*global)) {
+          runtime_fail("Undefined variable '%s'.", global_name(cvm, global));
+        }
+        *global = reg(b);
+        dispatch();
+      }
+      op_case(OP_ADD): {
+        value x = reg(b);
+        value y = reg(c);
+
+        if (ARE_INTEGERS(x, y)) reg(a) = add_integers(AS_INTEGER(x), AS_INTEGER(y));
+        else if (both(IS_NUMBER, x, y)) reg(a) = NUMBER_VAL(AS_NUMBER(x) + AS_NUMBER(y));
+        else {
+          reset_stack(cvm);
+          push(cvm, x);
+          push(cvm, y);
+          const char* error = add_values(cvm, rc->offsets[ip - rc->code - 1]);
+          if (error) runtime_fail("%s", error);
+          reg(a) = pop(cvm);
+        }
+        dispatch();
+      }
+      op_case(OP_SUBTRACT):   arith_op(subtract_integers, -); dispatch();
+      op_case(OP_MULTIPLY):   arith_op(multiply_integers, *); dispatch();
+      op_case(OP_DIVIDE): {
+        numeric_operands(reg(b), reg(c));
+        reg(a) = NUMBER_VAL(to_number(reg(b)) / to_number(reg(c)));
+        dispatch();
+      }
+      op_case(OP_MODULO): {
+        integer_operands(x, y);
+        if (!y) runtime_fail("Modulo by zero.");
+        reg(a) = modulo_integers(x, y);
+        dispatch();
+      }
+      op_case(OP_SHIFTLEFT): {
+        integer_operands(x, y);
+        reg(a) = shift_integer(x, y, true);
+        dispatch();
+      }
+      op_case(OP_SHIFTRIGHT): {
+        integer_operands(x, y);
+        reg(a) = shift_integer(x, y, false);
+        dispatch();
+      }
+      op_case(OP_BITOR):      bitwise_op(|); dispatch();
+      op_case(OP_BITXOR):     bitwise_op(^); dispatch();
+      op_case(OP_BITAND):     bitwise_op(&); dispatch();
+      op_case(OP_NEGATE): {
+        value x = reg(b);
+        if (IS_INTEGER(x)) reg(a) = subtract_integers(0, AS_INTEGER(x));
+        else if (IS_NUMBER(x)) reg(a) = NUMBER_VAL(-AS_NUMBER(x));
+        else runtime_fail("Operand to '-' must be a number.");
+        dispatch();
+      }
+      op_case(OP_BITNOT): {
+        if (!IS_NUMERIC(reg(b))) runtime_fail("Operand to '~' must be a number.");
+        reg(a) = INTEGER_VAL(~to_integer(reg(b)));
+        dispatch();
+      }
+      op_case(OP_NOT):        reg(a) = BOOL_VAL(is_falsy(reg(b))); dispatch();
+      op_case(OP_EQUAL):      reg(a) = BOOL_VAL(values_equal(reg(b), reg(c))); dispatch();
+      op_case(OP_GREATER):    compare_op(>); dispatch();
+      op_case(OP_LESS):       compare_op(<); dispatch();
+      op_case(OP_ADD_NUMERIC):      numeric_op(add_integers, +); dispatch();
+      op_case(OP_SUBTRACT_NUMERIC): numeric_op(subtract_integers, -); dispatch();
+      op_case(OP_MULTIPLY_NUMERIC): numeric_op(multiply_integers, *); dispatch();
+      op_case(OP_DIVIDE_NUMERIC):
+        reg(a) = NUMBER_VAL(to_number(reg(b)) / to_number(reg(c)));
+        dispatch();
+      op_case(OP_NEGATE_NUMERIC): {
+        value x = reg(b);
+        reg(a) = IS_INTEGER(x) ? subtract_integers(0, AS_INTEGER(x))
+                               : NUMBER_VAL(-AS_NUMBER(x));
+        dispatch();
+      }
+      op_case(OP_GREATER_NUMERIC):  reg(a) = BOOL_VAL(compare(reg(b), reg(c), >)); dispatch();
+      op_case(OP_LESS_NUMERIC):     reg(a) = BOOL_VAL(compare(reg(b), reg(c), <)); dispatch();
+      op_case(OP_ADD_DOUBLE):       number_op(NUMBER_VAL, +); dispatch();
+      op_case(OP_SUBTRACT_DOUBLE):  number_op(NUMBER_VAL, -); dispatch();
+      op_case(OP_MULTIPLY_DOUBLE):  number_op(NUMBER_VAL, *); dispatch();
+      op_case(OP_DIVIDE_DOUBLE):    number_op(NUMBER_VAL, /); dispatch();
+      op_case(OP_NEGATE_DOUBLE):    reg(a) = NUMBER_VAL(-AS_NUMBER(reg(b))); dispatch();
+      op_case(OP_GREATER_DOUBLE):   number_op(BOOL_VAL, >); dispatch();
+      op_case(OP_LESS_DOUBLE):      number_op(BOOL_VAL, <); dispatch();
+      op_case(OP_PRINT): {
+        print_value(reg(b));
+        puts("");
+        dispatch();
+      }
+      op_case(OP_LOOP):       safepoint(); ip = operand().as.target; dispatch();
+      op_case(OP_JUMP):       ip = operand().as.target; dispatch();
+      op_case(OP_JUMP_IF_FALSE): {
+        if (is_falsy(reg(b))) ip = operand().as.target;
+        dispatch();
+      }
+      op_case(OP_LOOP_IF_TRUE): {
+        safepoint();
+        if (!is_falsy(reg(b))) ip = operand().as.target;
+        dispatch();
+      }
+      op_case(OP_LOOP_IF_EQUAL):       safepoint(); equal_jump(true); dispatch();
+      op_case(OP_JUMP_IF_EQUAL):       equal_jump(true); dispatch();
+      op_case(OP_LOOP_IF_NOT_EQUAL):   safepoint(); equal_jump(false); dispatch();
+      op_case(OP_JUMP_IF_NOT_EQUAL):   equal_jump(false); dispatch();
+      op_case(OP_LOOP_IF_GREATER):     safepoint(); compare_jump(>, true); dispatch();
+      op_case(OP_JUMP_IF_GREATER):     compare_jump(>, true); dispatch();
+      op_case(OP_LOOP_IF_NOT_GREATER): safepoint(); compare_jump(>, false); dispatch();
+      op_case(OP_JUMP_IF_NOT_GREATER): compare_jump(>, false); dispatch();
+      op_case(OP_LOOP_IF_LESS):        safepoint(); compare_jump(<, true); dispatch();
+      op_case(OP_JUMP_IF_LESS):        compare_jump(<, true); dispatch();
+      op_case(OP_LOOP_IF_NOT_LESS):    safepoint(); compare_jump(<, false); dispatch();
+      op_case(OP_JUMP_IF_NOT_LESS):    compare_jump(<, false); dispatch();
+      op_case(OP_RETURN): {
+        free_frame();
+        return INTERPRET_OK;
+      }
+    }
+  }
+
+#undef operand
+#undef reg
+#undef free_frame
+#undef runtime_fail
+#undef numeric_operands
+#undef arith_op
+#undef compare
+#undef compare_op
+#undef integer_operands
+#undef bitwise_op
+#undef numeric_op
+#undef number_op
+#undef compare_jump
+#undef equal_jump
+#undef both
+#undef safepoint
+#undef trace
+#undef dispatch
+#undef op_switch
+#undef op_case
+#undef handler_for
+}
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+interpret_result interpret(vm* cvm, const char* source, tier t) {
+  charge_to(cvm);
+  arena a;
   chunk c;
   init_chunk(&c);
-  if (!compile(cvm, source, &c)) {
+  c.arena = &a;
+  if (!init_arena(&a, COMPILE_ARENA_SIZE(strlen(source))) || !compile(cvm, source, &c)) {
+    bool failed = a.failed;
     free_chunk(&c);
-    return INTERPRET_COMPILE_ERROR;
+    free_arena(&a);
+    cvm->c = NULL;
+    if (!failed) return INTERPRET_COMPILE_ERROR;
+    fputs("Out of memory.\n", stderr);
+    return INTERPRET_RUNTIME_ERROR;
   }
 
-  cvm->c = &c;
-  cvm->ip = cvm->c->code;
+  interpret_result res;
+  reg_code rc;
+  jit_code jc;
+  init_reg_code(&rc);
+  init_jit_code(&jc);
 
-  interpret_result res = run(cvm);
+  if (cvm->heap.limit && cvm->heap.current > cvm->heap.limit) {
+    fputs("Out of memory.\n", stderr);
+    res = INTERPRET_RUNTIME_ERROR;
+  } else if (t == TIER_REGISTER && lower_registers(&c, &rc)) {
+#ifdef DEBUG_PRINT_CODE
+    disassemble_registers(&c, &rc, "registers");
+#endif
+    res = run_registers(cvm, &rc);
+  } else if (t == TIER_JIT && jit_compile(cvm, &c, &jc)) {
+    res = run_jit(cvm, &jc);
+  } else res = run(cvm, t == TIER_TRACE);
 
+  free_reg_code(&rc);
+  free_jit_code(&jc);
   free_chunk(&c);
+  free_arena(&a);
+  cvm->c = NULL;
+  cvm->site = -1;
 
   return res;
 }
+
+heap_stats heap_usage(vm* cvm) {
+  return cvm->heap;
+}
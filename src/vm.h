@@ -3,18 +3,46 @@
 
 #include "chunk.h"
 #include "hash.h"
+#include "profile.h"
 
 #define STACK_MAX 256
 
 typedef struct {
   chunk* c;
-  uint8_t* ip;
+  cell* ip;
   value stack[STACK_MAX];
   value* stack_top;
+  // Globals are resolved to slots at compile time. The table maps names to
+  // slot numbers, global_names maps them back for error messages.
   table globals;
+  value_array global_values;
+  value_array global_names;
   table strings;
 
   obj* objs;
+  // Bytes held by objs, and how many it may grow to before the next
+  // collection.
+  size_t bytes_allocated;
+  size_t next_gc;
+  double gc_growth;
+  // Where fresh objects are bump-allocated, unless tenure is set.
+  char* nursery;
+  char* nursery_top;
+  char* nursery_end;
+  bool tenure;
+  // The frame of the register tier while it runs.
+  value* frame;
+  int frame_size;
+  // Whether the compiler runs the SSA middle-end.
+  bool optimize;
+  // What the VM holds, counted as it is allocated. Running out of it is a
+  // runtime error.
+  heap_stats heap;
+  // While profiling, every allocation is passed to profiler, which puts it
+  // down to the instruction at site of the stack code, -1 for none.
+  void (*profiler)(void*, size_t, bool);
+  profile* profile;
+  int site;
 } vm;
 
 typedef enum {
@@ -26,10 +54,30 @@ typedef enum {
 vm* init_vm();
 void free_vm(vm*);
 
-interpret_result interpret(vm*, const char*);
+// The instruction set interpret() runs a script on.
+typedef enum {
+  TIER_STACK,
+  TIER_REGISTER,
+  TIER_JIT,
+  TIER_TRACE,
+} tier;
+
+interpret_result interpret(vm*, const char*, tier);
+heap_stats heap_usage(vm*);
 
 void push(vm*, value);
 value pop(vm*);
 
+void charge_to(vm*);
+obj* allocate_object(vm*, size_t);
+bool in_nursery(vm*, obj*);
+bool collect_nursery(vm*);
+void collect_garbage(vm*);
+void free_objects(vm*);
+
+// For the runtime helpers of the JIT.
+void runtime_error(vm*, int, const char*, ...);
+const char* add_values(vm*, int);
+
 
 #endif